@@ -13,3 +13,13 @@ Benchmark.ips do |x|
   x.report("cpp") { native.parse_address("0x7f921e88a8f8") }
   x.compare!
 end
+
+# e.g. the `references` of a large Hash or of a ROOT
+references = Array.new(1_000) { |index| "0x#{(0x7f921e88a8f8 + index * 40).to_s(16)}" }
+
+Benchmark.ips do |x|
+  x.report("ruby (batch)") { ruby.parse_addresses(references) }
+  x.report("cpp (single)") { references.each { |address| native.parse_address(address) } }
+  x.report("cpp (batch)") { native.parse_addresses(references) }
+  x.compare!
+end
@@ -12,6 +12,7 @@ ruby = HeapProfiler::Parser::Ruby.new
 
 Benchmark.ips do |x|
   x.report("ruby") { ruby.build_index(FIXTURE_PATH) }
-  x.report("cpp") { native.build_index(FIXTURE_PATH) }
+  x.report("cpp (dom)") { native.build_index(FIXTURE_PATH, api: :dom) }
+  x.report("cpp (ondemand)") { native.build_index(FIXTURE_PATH, api: :ondemand) }
   x.compare!
 end
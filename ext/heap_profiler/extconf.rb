@@ -3,6 +3,7 @@
 require "mkmf"
 
 have_func("rb_enc_interned_str", "ruby.h")
+have_header("sys/mman.h")
 
 $CXXFLAGS += ' -O3 -std=c++1z -Wno-register '
 
@@ -1,16 +1,73 @@
 #include "ruby.h"
 #include "ruby/encoding.h"
+#include "ruby/thread.h"
 #include "simdjson.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <fstream>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace simdjson;
 
-static VALUE rb_eHeapProfilerError, rb_eHeapProfilerCapacityError, sym_type, sym_class,
+static VALUE rb_eHeapProfilerError, rb_eHeapProfilerCapacityError, rb_cHeapProfilerClassIndex, rb_cHeapProfilerAddressSet, rb_cHeapProfilerObjectGraph, rb_cHeapProfilerReferrerIndex, sym_type, sym_class,
              sym_address, sym_value, sym_memsize, sym_imemo_type, sym_struct, sym_file,
-             sym_line, sym_shared, sym_references, sym_edge_name, id_uminus;
+             sym_line, sym_shared, sym_references, sym_edge_name, sym_objects, sym_memory,
+             sym_files, sym_classes, sym_locations, sym_strings, sym_shape_edges, sym_dom, sym_ondemand,
+             sym_scanner, sym_index, sym_class_index, sym_string_index, sym_added, sym_removed, sym_retained, sym_addresses, sym_survivors,
+             sym_approximate_locations, sym_approximate_strings, sym_sample, sym_rate, sym_gems, id_uminus, id_uniq_bang, id_call;
+
+enum parser_api {
+    API_DOM,
+    API_ONDEMAND,
+    API_SCANNER,
+};
+
+// Each thread needs its own simdjson parsers. They are allocated lazily since they hold
+// buffers proportional to the batch size.
+class heap_parser {
+  public:
+    dom::parser &dom() {
+        if (!dom_parser) {
+            dom_parser.reset(new dom::parser);
+        }
+        return *dom_parser;
+    }
+
+    ondemand::parser &ondemand() {
+        if (!ondemand_parser) {
+            ondemand_parser.reset(new ondemand::parser);
+        }
+        return *ondemand_parser;
+    }
+
+    // Set while parsing, see `parser_lease`.
+    bool busy = false;
+
+    // Reused from one object to the next when `parse_options::references` is set.
+    std::vector<uint64_t> references;
+
+  private:
+    std::unique_ptr<dom::parser> dom_parser;
+    std::unique_ptr<ondemand::parser> ondemand_parser;
+};
 
 typedef struct {
-    dom::parser *parser;
+    heap_parser *parser;
 } parser_t;
 
 static void Parser_delete(void *ptr) {
@@ -19,7 +76,7 @@ static void Parser_delete(void *ptr) {
 }
 
 static size_t Parser_memsize(const void *parser) {
-    return sizeof(dom::parser); // TODO: low priority, figure the real size, e.g. internal buffers etc.
+    return sizeof(heap_parser); // TODO: low priority, figure the real size, e.g. internal buffers etc.
 }
 
 static const rb_data_type_t parser_data_type = {
@@ -31,16 +88,44 @@ static const rb_data_type_t parser_data_type = {
 static VALUE parser_allocate(VALUE klass) {
     parser_t *data;
     VALUE obj = TypedData_Make_Struct(klass, parser_t, &parser_data_type, data);
-    data->parser = new dom::parser;
+    data->parser = new heap_parser;
     return obj;
 }
 
-static inline dom::parser * get_parser(VALUE self) {
+static inline heap_parser * get_parser(VALUE self) {
     parser_t *data;
     TypedData_Get_Struct(self, parser_t, &parser_data_type, data);
     return data->parser;
 }
 
+// The GVL is released while parsing, so the same Ruby parser may be used again meanwhile, either by
+// another thread or from a block we yield to. Those get a temporary parser rather than sharing its buffers.
+class parser_lease {
+  public:
+    parser_lease(VALUE self) : parser(get_parser(self)) {
+        if (parser->busy) {
+            temporary.reset(new heap_parser);
+            parser = temporary.get();
+        }
+        parser->busy = true;
+    }
+
+    parser_lease(const parser_lease &) = delete;
+    parser_lease &operator=(const parser_lease &) = delete;
+
+    ~parser_lease() {
+        parser->busy = false;
+    }
+
+    heap_parser &operator*() const {
+        return *parser;
+    }
+
+  private:
+    heap_parser *parser;
+    std::unique_ptr<heap_parser> temporary;
+};
+
 const uint64_t digittoval[256] = {
      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
@@ -60,7 +145,7 @@ const uint64_t digittoval[256] = {
 // Inspired by https://lemire.me/blog/2019/04/17/parsing-short-hexadecimal-strings-efficiently/
 // Ruby addresses in heap dump are hexadecimal strings "0x000000000000"...0xffffffffffff".
 // The format being fairly stable allow for faster parsing. It should be equivalent to String#to_i(16).
-static inline uint64_t parse_address(const char * address, const long size) {
+static inline uint64_t parse_address_scalar(const char * address, const long size) {
     assert(address[0] == '0');
     assert(address[1] == 'x');
 
@@ -72,16 +157,72 @@ static inline uint64_t parse_address(const char * address, const long size) {
     return value;
 }
 
+static const size_t ADDRESS_DIGITS = 16;
+
+// Decode the 16 hexadecimal digits at `digits` at once, the first one being the most significant.
+// Each ASCII digit is mapped to its value with `(c & 0xF) + 9 * bit6(c)`, which works for both
+// `0-9`, `a-f` and `A-F`, then nibbles are packed pairwise into bytes.
+#if defined(__SSE2__) && defined(__x86_64__)
+static inline uint64_t decode_hex_digits(const char *digits) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(digits));
+    const __m128i low_nibbles = _mm_set1_epi8(0x0F);
+    const __m128i letters = _mm_and_si128(_mm_srli_epi16(chunk, 6), _mm_set1_epi8(1));
+    __m128i nibbles = _mm_add_epi8(_mm_and_si128(chunk, low_nibbles), _mm_add_epi8(_mm_slli_epi16(letters, 3), letters));
+    nibbles = _mm_and_si128(nibbles, low_nibbles);
+
+    // Each 16 bits lane holds two digits, the most significant in its low byte.
+    const __m128i pairs = _mm_or_si128(
+        _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x000F)), 4),
+        _mm_srli_epi16(nibbles, 8)
+    );
+    const __m128i bytes = _mm_packus_epi16(pairs, pairs);
+    return __builtin_bswap64(static_cast<uint64_t>(_mm_cvtsi128_si64(bytes)));
+}
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Same as above, 8 digits at a time in a general purpose register, e.g. on ARM.
+static inline uint32_t decode_hex_digits_swar(const char *digits) {
+    uint64_t chunk;
+    memcpy(&chunk, digits, sizeof(chunk));
+    const uint64_t letters = (chunk >> 6) & 0x0101010101010101;
+    uint64_t value = ((chunk & 0x0F0F0F0F0F0F0F0F) + 9 * letters) & 0x0F0F0F0F0F0F0F0F;
+    value = ((value & 0x000F000F000F000F) << 4) | ((value >> 8) & 0x000F000F000F000F);
+    value = (value | (value >> 8)) & 0x0000FFFF0000FFFF;
+    value = (value | (value >> 16)) & 0x00000000FFFFFFFF;
+    return __builtin_bswap32(static_cast<uint32_t>(value));
+}
+
+static inline uint64_t decode_hex_digits(const char *digits) {
+    return (static_cast<uint64_t>(decode_hex_digits_swar(digits)) << 32) | decode_hex_digits_swar(digits + 8);
+}
+#else
+#define HEAP_PROFILER_SCALAR_ADDRESSES 1
+#endif
+
+// Parse an address that is followed by at least 16 readable bytes, which is the case for all
+// the strings simdjson returns since its string buffers are padded. The digits are decoded
+// as if the address had 16 of them, and whatever follows the actual digits is shifted out.
+static inline uint64_t parse_address(const char * address, const long size) {
+#ifdef HEAP_PROFILER_SCALAR_ADDRESSES
+    return parse_address_scalar(address, size);
+#else
+    const size_t digits = size - 2;
+    if (size <= 2 || digits > ADDRESS_DIGITS) {
+        return parse_address_scalar(address, size);
+    }
+    return decode_hex_digits(address + 2) >> (4 * (ADDRESS_DIGITS - digits));
+#endif
+}
+
 static inline int64_t parse_address(std::string_view address) {
     return parse_address(address.data(), address.size());
 }
 
-static inline int64_t parse_dom_address(dom::element element) {
-    std::string_view address;
-    if (element.get(address)) {
-        return 0; // ROOT object
+// Parse many padded addresses, e.g. a whole `references` array. They're independent from each
+// other, so decoding them in a tight loop lets the CPU overlap them.
+static inline void parse_addresses(const std::string_view *addresses, size_t count, uint64_t *output) {
+    for (size_t index = 0; index < count; index++) {
+        output[index] = parse_address(addresses[index]);
     }
-    return parse_address(address);
 }
 
 static inline VALUE make_symbol(std::string_view string) {
@@ -102,234 +243,5370 @@ static inline VALUE make_string(std::string_view string) {
     }
 # endif
 
-static VALUE rb_heap_build_index(VALUE self, VALUE path, VALUE batch_size) {
-    Check_Type(path, T_STRING);
-    Check_Type(batch_size, T_FIXNUM);
-    dom::parser *parser = get_parser(self);
-    dom::document_stream objects;
+// A flattened view of the handful of fields we extract from each dump line.
+// String views either point into the parser buffers, in which case they are only valid
+// until the next document is parsed, or into a `string_arena` owned by a shard.
+// Absent string fields have a null `data()`.
+struct heap_object {
+    std::string_view type;
+    std::string_view imemo_type;
+    std::string_view _struct;
+    std::string_view value;
+    std::string_view edge_name;
+    std::string_view name;
+    std::string_view file;
+    std::string_view root; // The kind of ROOT objects, e.g. `vm` or `machine_context`.
+    uint64_t address = 0; // ROOT objects don't have an address
+    uint64_t class_address = 0;
+    uint64_t memsize = 0;
+    uint64_t line = 0;
+    uint64_t reference = 0;
+    // All the references of the object, only filled if set. See `parse_options::references`.
+    std::vector<uint64_t> *references = nullptr;
+    int64_t generation = -1;
+    bool has_class = false;
+    bool has_line = false;
+    bool has_shared = false;
+    bool shared = false;
+};
 
-    VALUE string_index = rb_hash_new();
-    VALUE class_index = rb_hash_new();
+static inline bool present(std::string_view string) {
+    return string.data() != nullptr;
+}
+
+// Clear `result` before loading the next object into it, keeping its `references` buffer if any.
+static inline void reset_heap_object(heap_object &result) {
+    std::vector<uint64_t> *references = result.references;
+    result = heap_object();
+    if (references) {
+        references->clear();
+        result.references = references;
+    }
+}
 
-    try {
-        auto error = parser->load_many(RSTRING_PTR(path), FIX2INT(batch_size)).get(objects);
-        if (error != SUCCESS) {
-            rb_raise(rb_eHeapProfilerError, "%s", error_message(error));
+// Append-only storage for strings that have to outlive the parser buffers they were read from.
+// Memory is allocated in blocks that are never moved, so returned views stay valid.
+class string_arena {
+  public:
+    std::string_view copy(std::string_view string) {
+        if (!present(string)) {
+            return string;
+        }
+        if (string.size() > available) {
+            block_size = std::max(string.size(), BLOCK_SIZE);
+            blocks.emplace_back(new char[block_size]);
+            cursor = blocks.back().get();
+            available = block_size;
         }
+        memcpy(cursor, string.data(), string.size());
+        std::string_view copy(cursor, string.size());
+        cursor += string.size();
+        available -= string.size();
+        return copy;
+    }
 
-        for (dom::object object : objects) {
-            std::string_view type;
-            if (object["type"].get(type)) {
-                continue;
-            }
+    // Types, files etc are extremely repetitive, so we only store them once.
+    std::string_view intern(std::string_view string) {
+        if (!present(string)) {
+            return string;
+        }
+        auto existing = interned.find(string);
+        if (existing != interned.end()) {
+            return *existing;
+        }
+        std::string_view copied = copy(string);
+        interned.insert(copied);
+        return copied;
+    }
 
-            if (type == "STRING") {
-                std::string_view value;
-                if (!object["value"].get(value)) {
-                    VALUE address = INT2FIX(parse_dom_address(object["address"]));
-                    VALUE string = make_string(value);
-                    rb_hash_aset(string_index, address, string);
-                }
-            } else if (type == "CLASS" || type == "MODULE") {
-                VALUE address = INT2FIX(parse_dom_address(object["address"]));
-                VALUE class_name = Qfalse;
+    // Invalidate all the returned views, but keep the last block around to be reused.
+    void clear() {
+        interned.clear();
+        if (blocks.empty()) {
+            return;
+        }
+        std::unique_ptr<char[]> last = std::move(blocks.back());
+        blocks.clear();
+        blocks.push_back(std::move(last));
+        cursor = blocks.back().get();
+        available = block_size;
+    }
+
+  private:
+    static const size_t BLOCK_SIZE = 1024 * 1024;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::unordered_set<std::string_view> interned;
+    char *cursor = nullptr;
+    size_t available = 0;
+    size_t block_size = 0;
+};
 
-                std::string_view name;
-                if (!object["name"].get(name)) {
-                    class_name = dedup_string(name);
-                } else {
-                    std::string_view file;
-                    uint64_t line;
+// Maps the few distinct values of a field, e.g. `type`, to the Ruby object `make` created for them,
+// so the symbol or fstring tables are only looked up once per value rather than once per object.
+// It's a small open addressing table, with linear probing, kept at most half full.
+//
+// Created objects are referenced from a Ruby array, so they can't be collected or moved by
+// compaction while the cache is in use, which the caller ensures with RB_GC_GUARD.
+class value_cache {
+  public:
+    VALUE values;
 
-                    if (!object["file"].get(file) && !object["line"].get(line)) {
-                        std::string buffer = "<Class ";
-                        buffer += file;
-                        buffer += ":";
-                        buffer += std::to_string(line);
-                        buffer += ">";
-                        class_name = dedup_string(buffer);
-                    }
-                }
+    value_cache(VALUE (*make)(std::string_view)) : values(rb_ary_new()), make(make), slots(16) {}
 
-                if (RTEST(class_name)) {
-                    rb_hash_aset(class_index, address, class_name);
-                }
+    VALUE fetch(std::string_view key) {
+        size_t hash = std::hash<std::string_view>()(key);
+        size_t index = find(hash, key);
+        if (slots[index].value < 0) {
+            VALUE value = make(key);
+            slots[index] = { arena.copy(key), hash, RARRAY_LEN(values) };
+            rb_ary_push(values, value);
+            if (2 * RARRAY_LEN(values) > static_cast<long>(slots.size())) {
+                grow();
             }
+            return value;
         }
-    } catch (simdjson::simdjson_error error) {
-        if (error.error() == CAPACITY) {
-            rb_raise(rb_eHeapProfilerCapacityError, "The parser batch size is too small to parse this heap dump");
-        } else {
-            rb_raise(rb_eHeapProfilerError, "exc: %s", error.what());
+        return RARRAY_AREF(values, slots[index].value);
+    }
+
+  private:
+    struct slot {
+        std::string_view key;
+        size_t hash = 0;
+        long value = -1;
+    };
+
+    VALUE (*make)(std::string_view);
+    std::vector<slot> slots;
+    string_arena arena;
+
+    // The slot holding `key`, or the empty slot where it should be inserted.
+    size_t find(size_t hash, std::string_view key) const {
+        size_t mask = slots.size() - 1;
+        size_t index = hash & mask;
+        while (slots[index].value >= 0 && (slots[index].hash != hash || slots[index].key != key)) {
+            index = (index + 1) & mask;
         }
+        return index;
     }
 
-    VALUE return_value = rb_ary_new();
-    rb_ary_push(return_value, class_index);
-    rb_ary_push(return_value, string_index);
-    return return_value;
-}
+    void grow() {
+        std::vector<slot> previous(2 * slots.size());
+        previous.swap(slots);
+        for (const slot &entry : previous) {
+            if (entry.value >= 0) {
+                slots[find(entry.hash, entry.key)] = entry;
+            }
+        }
+    }
+};
 
-static VALUE rb_heap_parse_address(VALUE self, VALUE address) {
-    Check_Type(address, T_STRING);
-    return INT2FIX(parse_address(RSTRING_PTR(address), RSTRING_LEN(address)));
+// The Ruby values created while yielding the objects of a dump.
+struct object_cache {
+    value_cache symbols = value_cache(make_symbol);
+    value_cache files = value_cache(dedup_string);
+};
+
+// Optional string fields are only set when present and actually strings, otherwise they stay empty.
+static inline void load_dom_string(dom::object object, std::string_view key, std::string_view &result) {
+    std::string_view value;
+    if (!object[key].get(value)) {
+        result = value;
+    }
 }
 
-static VALUE make_ruby_object(dom::object object)
-{
-    VALUE hash = rb_hash_new();
+static void load_dom_object(dom::object object, heap_object &result) {
+    reset_heap_object(result);
 
     std::string_view type;
     if (!object["type"].get(type)) {
-        rb_hash_aset(hash, sym_type, make_symbol(type));
+        result.type = type;
     }
 
     std::string_view address;
     if (!object["address"].get(address)) {
-        rb_hash_aset(hash, sym_address, INT2FIX(parse_address(address)));
+        result.address = parse_address(address);
     }
 
     std::string_view _class;
     if (type != "IMEMO") {
         // IMEMO "class" field can sometime be junk
         if (!object["class"].get(_class)) {
-            rb_hash_aset(hash, sym_class, INT2FIX(parse_address(_class)));
+            result.class_address = parse_address(_class);
+            result.has_class = true;
         }
     }
 
     uint64_t memsize;
-    if (object["memsize"].get(memsize)) {
-        // ROOT object
-        rb_hash_aset(hash, sym_memsize, INT2FIX(0));
-    } else {
-        rb_hash_aset(hash, sym_memsize, INT2FIX(memsize));
+    if (!object["memsize"].get(memsize)) {
+        result.memsize = memsize;
     }
 
     if (type == "IMEMO") {
-        std::string_view imemo_type;
-        if (!object["imemo_type"].get(imemo_type)) {
-            rb_hash_aset(hash, sym_imemo_type, make_symbol(imemo_type));
-        }
+        load_dom_string(object, "imemo_type", result.imemo_type);
     } else if (type == "DATA") {
-        std::string_view _struct;
-        if (!object["struct"].get(_struct)) {
-            rb_hash_aset(hash, sym_struct, make_symbol(_struct));
-        }
+        load_dom_string(object, "struct", result._struct);
     } else if (type == "STRING") {
-        std::string_view value;
-        if (!object["value"].get(value)) {
-            rb_hash_aset(hash, sym_value, make_string(value));
-        }
+        load_dom_string(object, "value", result.value);
 
         bool shared;
         if (!object["shared"].get(shared)) {
-            rb_hash_aset(hash, sym_shared, shared ? Qtrue : Qnil);
+            result.has_shared = true;
+            result.shared = shared;
             if (shared) {
-                VALUE references = rb_ary_new();
-                dom::array reference_elements(object["references"]);
-                for (dom::element reference_element : reference_elements) {
-                    std::string_view reference;
-                    if (!reference_element.get(reference)) {
-                        rb_ary_push(references, INT2FIX(parse_address(reference)));
+                // Shared strings only ever reference their shared root.
+                dom::array references;
+                if (!object["references"].get(references)) {
+                    for (dom::element reference_element : references) {
+                        std::string_view reference;
+                        if (!reference_element.get(reference)) {
+                            result.reference = parse_address(reference);
+                            break;
+                        }
                     }
                 }
-                rb_hash_aset(hash, sym_references, references);
             }
         }
     } else if (type == "SHAPE") {
-        std::string_view edge_name;
-        if (!object["edge_name"].get(edge_name)) {
-            rb_hash_aset(hash, sym_edge_name, make_string(edge_name));
-        }
+        load_dom_string(object, "edge_name", result.edge_name);
+    } else if (type == "CLASS" || type == "MODULE") {
+        load_dom_string(object, "name", result.name);
+    } else if (type == "ROOT") {
+        load_dom_string(object, "root", result.root);
     }
 
-    std::string_view file;
-    if (!object["file"].get(file)) {
-        rb_hash_aset(hash, sym_file, dedup_string(file));
+    if (result.references) {
+        dom::array references;
+        if (!object["references"].get(references)) {
+            for (dom::element reference_element : references) {
+                std::string_view reference;
+                if (!reference_element.get(reference)) {
+                    result.references->push_back(parse_address(reference));
+                }
+            }
+        }
     }
 
+    load_dom_string(object, "file", result.file);
+
     uint64_t line;
     if (!object["line"].get(line)) {
-        rb_hash_aset(hash, sym_line, INT2FIX(line));
+        result.line = line;
+        result.has_line = true;
     }
 
-    return hash;
+    int64_t generation;
+    if (!object["generation"].get(generation)) {
+        result.generation = generation;
+    }
 }
 
-static VALUE rb_heap_load_many(VALUE self, VALUE arg, VALUE since, VALUE batch_size)
-{
-    Check_Type(arg, T_STRING);
-    Check_Type(batch_size, T_FIXNUM);
+// Loaders that walk the fields in document order can't know the type of the object until they've
+// seen it, so they extract all the fields they know, and then drop those `load_dom_object` wouldn't
+// extract for that type.
+static void restrict_to_type(heap_object &result) {
+    if (result.type == "IMEMO") {
+        // IMEMO "class" field can sometime be junk
+        result.class_address = 0;
+        result.has_class = false;
+    } else {
+        result.imemo_type = std::string_view();
+    }
+    if (result.type != "DATA") {
+        result._struct = std::string_view();
+    }
+    if (result.type != "STRING") {
+        result.value = std::string_view();
+        result.has_shared = result.shared = false;
+    }
+    if (!result.shared) {
+        result.reference = 0;
+    }
+    if (result.type != "SHAPE") {
+        result.edge_name = std::string_view();
+    }
+    if (result.type != "CLASS" && result.type != "MODULE") {
+        result.name = std::string_view();
+    }
+    if (result.type != "ROOT") {
+        result.root = std::string_view();
+    }
+}
+
+// On Demand only parses the values we actually read, so rather than looking up each key,
+// we walk the fields once in document order and skip everything else, e.g. `references` and `flags`.
+//
+// `document` is either a document of a stream, or a standalone one, see `each_ondemand_object`.
+// A field we extract with an unexpected type fails the whole object, see `field_error`.
+template <typename Document>
+static error_code load_ondemand_object(Document &&document, heap_object &result) {
+    reset_heap_object(result);
+
+    ondemand::object object;
+    auto error = document.get_object().get(object);
+    if (error) {
+        return error;
+    }
+
+    for (auto field_result : object) {
+        ondemand::field field;
+        if ((error = std::move(field_result).get(field))) {
+            return error;
+        }
+        ondemand::raw_json_string key = field.key();
+        ondemand::value value = field.value();
+
+        switch (*key.raw()) {
+            case 'a':
+                if (key == "address") {
+                    std::string_view address;
+                    if (!value.get_string().get(address)) {
+                        result.address = parse_address(address);
+                    }
+                }
+                break;
+            case 'c':
+                if (key == "class") {
+                    std::string_view _class;
+                    if (!value.get_string().get(_class)) {
+                        result.class_address = parse_address(_class);
+                        result.has_class = true;
+                    }
+                }
+                break;
+            case 'e':
+                if (key == "edge_name" && (error = value.get_string().get(result.edge_name))) {
+                    return error;
+                }
+                break;
+            case 'f':
+                if (key == "file" && (error = value.get_string().get(result.file))) {
+                    return error;
+                }
+                break;
+            case 'g':
+                if (key == "generation" && (error = value.get_int64().get(result.generation))) {
+                    return error;
+                }
+                break;
+            case 'i':
+                if (key == "imemo_type" && (error = value.get_string().get(result.imemo_type))) {
+                    return error;
+                }
+                break;
+            case 'l':
+                if (key == "line" && !value.get_uint64().get(result.line)) {
+                    result.has_line = true;
+                }
+                break;
+            case 'm':
+                if (key == "memsize" && (error = value.get_uint64().get(result.memsize))) {
+                    return error;
+                }
+                break;
+            case 'n':
+                if (key == "name" && (error = value.get_string().get(result.name))) {
+                    return error;
+                }
+                break;
+            case 'r':
+                if (key == "root") {
+                    if ((error = value.get_string().get(result.root))) {
+                        return error;
+                    }
+                    break;
+                }
+                // `references` can be huge, e.g. on ROOT objects, but shared strings
+                // only ever reference their shared root, so unless all of them are needed we stop there.
+                if (key == "references" && (result.references || result.type == "STRING")) {
+                    ondemand::array references;
+                    if (!value.get_array().get(references)) {
+                        bool first = true;
+                        for (auto reference_element : references) {
+                            std::string_view reference;
+                            if (!reference_element.get_string().get(reference)) {
+                                uint64_t address = parse_address(reference);
+                                if (first) {
+                                    result.reference = address;
+                                }
+                                if (result.references) {
+                                    result.references->push_back(address);
+                                }
+                            }
+                            if (!result.references) {
+                                break;
+                            }
+                            first = false;
+                        }
+                    }
+                }
+                break;
+            case 's':
+                if (key == "struct") {
+                    if ((error = value.get_string().get(result._struct))) {
+                        return error;
+                    }
+                } else if (key == "shared" && !value.get_bool().get(result.shared)) {
+                    result.has_shared = true;
+                }
+                break;
+            case 't':
+                if (key == "type" && (error = value.get_string().get(result.type))) {
+                    return error;
+                }
+                break;
+            case 'v':
+                if (key == "value" && (error = value.get_string().get(result.value))) {
+                    return error;
+                }
+                break;
+        }
+    }
+
+    restrict_to_type(result);
+    return SUCCESS;
+}
+
+// ObjectSpace.dump_all writes one flat JSON object per line, always formatted the same way, e.g.
+//
+//   {"address":"0x7f921e88a8f8", "type":"STRING", "class":"0x7f921e8b8190", "value":"foo", ... "memsize":40, "flags":{"wb_protected":true}}
+//
+// with no nesting beside the `references` array of addresses and the `flags` object of booleans.
+// This scanner only accepts that exact layout, directly in the dump buffer: it doesn't build
+// anything for the fields we don't extract, and skips `references` at once. Strings are returned as is,
+// so a line with escape sequences in a string we extract, or anything unexpected, is rejected and
+// parsed with simdjson instead.
+//
+// Since the dump buffer is padded, we check a single character at a time without bound checks:
+// a line cut short by the end of the buffer stops on the padding, and is rejected once scanned.
+class line_scanner {
+  public:
+    line_scanner(std::string_view buffer) : cursor(buffer.data()), end(buffer.data() + buffer.size()) {}
+
+    bool done() const {
+        return cursor >= end;
+    }
+
+    // Scan the next line, without searching for its end beforehand. When it's rejected,
+    // the caller is expected to call `skip_line`.
+    bool scan(heap_object &result) {
+        reset_heap_object(result);
+        line = cursor;
+        first_reference = std::string_view();
+
+        if (*cursor++ != '{') {
+            return false;
+        }
+        if (*cursor != '}') {
+            do {
+                if (!scan_field(result)) {
+                    return false;
+                }
+            } while (separator());
+        }
+        if (*cursor++ != '}') {
+            return false;
+        }
+        if (cursor < end && *cursor == '\n') {
+            cursor++;
+        } else if (cursor != end) {
+            return false;
+        }
 
-    dom::parser *parser = get_parser(self);
-    dom::document_stream objects;
-    try {
-        auto error = parser->load_many(RSTRING_PTR(arg), FIX2INT(batch_size)).get(objects);
-        if (error != SUCCESS) {
-            rb_raise(rb_eHeapProfilerError, "%s", error_message(error));
+        if (present(first_reference)) {
+            result.reference = parse_address(first_reference);
         }
+        restrict_to_type(result);
+        return true;
+    }
+
+    // Return the line `scan` just rejected, and move to the next one.
+    std::string_view skip_line() {
+        const char *newline = static_cast<const char *>(memchr(line, '\n', end - line));
+        cursor = newline ? newline + 1 : end;
+        return std::string_view(line, cursor - line);
+    }
+
+  private:
+    const char *cursor;
+    const char *end;
+    const char *line = nullptr;
+    std::string_view first_reference;
 
-        int64_t generation = -1;
-        if (RTEST(since)) {
-            Check_Type(since, T_FIXNUM);
-            generation = FIX2INT(since);
+    // Fields are separated by a comma, and most of the time a space.
+    bool separator() {
+        if (*cursor != ',') {
+            return false;
         }
+        cursor += cursor[1] == ' ' ? 2 : 1;
+        return true;
+    }
 
-        for (dom::element object : objects) {
-            int64_t object_generation;
-            if (generation > -1 && object["generation"].get(object_generation) || object_generation < generation) {
-                continue;
+    bool scan_field(heap_object &result) {
+        std::string_view key;
+        if (!scan_string(key) || *cursor++ != ':') {
+            return false;
+        }
+
+        switch (key.size()) {
+            case 4:
+                if (key == "type") {
+                    return scan_string_field(result.type);
+                } else if (key == "file") {
+                    return scan_string_field(result.file);
+                } else if (key == "line") {
+                    return scan_uint_field(result.line, result.has_line);
+                } else if (key == "name") {
+                    return scan_string_field(result.name);
+                } else if (key == "root") {
+                    return scan_string_field(result.root);
+                }
+                break;
+            case 5:
+                if (key == "class") {
+                    std::string_view _class;
+                    if (!scan_string_field(_class)) {
+                        return false;
+                    }
+                    if (present(_class)) {
+                        result.class_address = parse_address(_class);
+                        result.has_class = true;
+                    }
+                    return true;
+                } else if (key == "value") {
+                    return scan_string_field(result.value);
+                }
+                break;
+            case 6:
+                if (key == "struct") {
+                    return scan_string_field(result._struct);
+                } else if (key == "shared") {
+                    return scan_bool_field(result.shared, result.has_shared);
+                }
+                break;
+            case 7:
+                if (key == "address") {
+                    std::string_view address;
+                    if (!scan_string_field(address)) {
+                        return false;
+                    }
+                    if (present(address)) {
+                        result.address = parse_address(address);
+                    }
+                    return true;
+                } else if (key == "memsize") {
+                    bool has_memsize;
+                    return scan_uint_field(result.memsize, has_memsize);
+                }
+                break;
+            case 9:
+                if (key == "edge_name") {
+                    return scan_string_field(result.edge_name);
+                }
+                break;
+            case 10:
+                if (key == "imemo_type") {
+                    return scan_string_field(result.imemo_type);
+                } else if (key == "generation") {
+                    bool has_generation;
+                    uint64_t generation;
+                    if (!scan_uint_field(generation, has_generation)) {
+                        return false;
+                    }
+                    if (has_generation) {
+                        result.generation = generation;
+                    }
+                    return true;
+                } else if (key == "references") {
+                    return scan_references(result);
+                }
+                break;
+        }
+        return skip_value();
+    }
+
+    // The extracting functions leave the field absent when its value has another type,
+    // like the simdjson getters do.
+    bool scan_string_field(std::string_view &string) {
+        if (*cursor == '"') {
+            return scan_string(string);
+        }
+        return skip_value();
+    }
+
+    bool scan_uint_field(uint64_t &number, bool &present) {
+        present = false;
+        if (*cursor >= '0' && *cursor <= '9') {
+            return present = scan_uint(number);
+        }
+        return skip_value();
+    }
+
+    bool scan_bool_field(bool &value, bool &present) {
+        if (match_literal("true")) {
+            return value = present = true;
+        } else if (match_literal("false")) {
+            value = false;
+            return present = true;
+        }
+        return skip_value();
+    }
+
+    // Unless all the references are needed, only the first address matters, see `load_dom_object`.
+    // The rest are skipped at once since addresses can't contain brackets.
+    bool scan_references(heap_object &result) {
+        if (*cursor != '[') {
+            return skip_value();
+        }
+        cursor++;
+        if (result.references) {
+            if (*cursor == ']') {
+                cursor++;
+                return true;
+            }
+            do {
+                std::string_view reference;
+                if (*cursor != '"' || !scan_string(reference)) {
+                    return false;
+                }
+                if (!present(first_reference)) {
+                    first_reference = reference;
+                }
+                result.references->push_back(parse_address(reference));
+            } while (separator());
+            return *cursor++ == ']';
+        }
+        if (*cursor == '"') {
+            if (!scan_string(first_reference)) {
+                return false;
             }
+        } else if (*cursor != ']') {
+            return false;
+        }
+        if (cursor >= end) {
+            return false;
+        }
+        const char *closing = static_cast<const char *>(memchr(cursor, ']', end - cursor));
+        size_t length = closing ? closing - cursor : 0;
+        if (!closing || memchr(cursor, '\n', length) || memchr(cursor, '[', length) || memchr(cursor, '{', length)) {
+            return false;
+        }
+        cursor = closing + 1;
+        return true;
+    }
 
-            std::string_view property;
-            if (!object["file"].get(property) && property == "__hprof") {
-                continue;
+    // Strings are searched 64 bytes at a time: each block is loaded once, and the positions of its quotes,
+    // backslashes and newlines kept in a bit mask, so finding the next one, usually in the same block since most
+    // strings are short keys or addresses, is just a couple of bit operations.
+    const char *block = nullptr;
+    uint64_t delimiters = 0;
+
+    void load_block(const char *start) {
+        block = start;
+#if defined(__SSE2__) && defined(__x86_64__)
+        const __m128i quotes = _mm_set1_epi8('"');
+        const __m128i backslashes = _mm_set1_epi8('\\');
+        const __m128i newlines = _mm_set1_epi8('\n');
+        delimiters = 0;
+        for (int offset = 0; offset < 64; offset += 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(start + offset));
+            const uint32_t mask = _mm_movemask_epi8(_mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quotes), _mm_cmpeq_epi8(chunk, backslashes)),
+                _mm_cmpeq_epi8(chunk, newlines)
+            ));
+            delimiters |= static_cast<uint64_t>(mask) << offset;
+        }
+#else
+        delimiters = 0;
+        for (int offset = 0; offset < 64; offset++) {
+            char character = start[offset];
+            if (character == '"' || character == '\\' || character == '\n') {
+                delimiters |= 1ULL << offset;
             }
-            if (!object["struct"].get(property) && property == "ObjectTracing/allocation_info_tracer") {
-                continue;
+        }
+#endif
+    }
+
+    // Find the first quote, backslash or newline from `position`. Reading whole blocks past the end
+    // of the line is fine since the buffer is padded, and we never load a block starting past its end.
+    const char *find_string_delimiter(const char *position) {
+        if (position < block || position >= block + 64) {
+            if (position >= end) {
+                return nullptr;
+            }
+            load_block(position);
+        }
+        uint64_t mask = delimiters & (~0ULL << (position - block));
+        while (!mask) {
+            if (block + 64 >= end) {
+                return nullptr;
             }
+            load_block(block + 64);
+            mask = delimiters;
+        }
+        position = block + __builtin_ctzll(mask);
+        return position < end ? position : nullptr;
+    }
+
+    // Strings without any escape sequence.
+    bool scan_string(std::string_view &string) {
+        if (*cursor != '"') {
+            return false;
+        }
+        cursor++;
+        const char *closing = find_string_delimiter(cursor);
+        if (!closing || *closing != '"') {
+            return false;
+        }
+        string = std::string_view(cursor, closing - cursor);
+        cursor = closing + 1;
+        return true;
+    }
 
-            rb_yield(make_ruby_object(object));
+    bool skip_string() {
+        cursor++; // opening quote
+        while (true) {
+            const char *delimiter = find_string_delimiter(cursor);
+            if (!delimiter || *delimiter == '\n') {
+                return false;
+            }
+            cursor = delimiter + 1;
+            if (*delimiter == '"') {
+                return true;
+            }
+            cursor++; // escaped character
         }
+    }
 
-        return Qnil;
-    } catch (simdjson::simdjson_error error) {
-        if (error.error() == CAPACITY) {
-            rb_raise(rb_eHeapProfilerCapacityError, "The parser batch size is too small to parse this heap dump");
-        } else {
-            rb_raise(rb_eHeapProfilerError, "exc: %s", error.what());
+    // Leave anything but small positive integers, e.g. floats, leading zeros or overflows, to simdjson.
+    bool scan_uint(uint64_t &number) {
+        const char *start = cursor;
+        uint64_t value = 0;
+        while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+            value = value * 10 + (*cursor - '0');
+            cursor++;
+        }
+        size_t digits = cursor - start;
+        if (digits == 0 || digits > 18 || (digits > 1 && *start == '0')) {
+            return false;
+        }
+        if (*cursor == '.' || *cursor == 'e' || *cursor == 'E') {
+            return false;
+        }
+        number = value;
+        return true;
+    }
+
+    bool match_literal(std::string_view literal) {
+        if (memcmp(cursor, literal.data(), literal.size()) == 0) {
+            cursor += literal.size();
+            return true;
+        }
+        return false;
+    }
+
+    bool skip_scalar() {
+        switch (*cursor) {
+            case '"':
+                return skip_string();
+            case 't':
+                return match_literal("true");
+            case 'f':
+                return match_literal("false");
+            case 'n':
+                return match_literal("null");
+            default:
+                uint64_t number;
+                return scan_uint(number);
+        }
+    }
+
+    // Scalars, and arrays or objects of scalars, like `flags`.
+    bool skip_value() {
+        if (*cursor == '[') {
+            cursor++;
+            if (*cursor != ']') {
+                do {
+                    if (!skip_scalar()) {
+                        return false;
+                    }
+                } while (separator());
+            }
+            return *cursor++ == ']';
+        }
+
+        if (*cursor == '{') {
+            cursor++;
+            if (*cursor != '}') {
+                do {
+                    if (*cursor != '"' || !skip_string() || *cursor++ != ':' || !skip_scalar()) {
+                        return false;
+                    }
+                } while (separator());
+            }
+            return *cursor++ == '}';
         }
+
+        return skip_scalar();
+    }
+};
+
+// ObjectSpace.dump_all itself allocates a few objects, we need to exclude them from the reports.
+static inline bool skip_object(const heap_object &object, int64_t since) {
+    if (since > -1 && object.generation < since) {
+        return true;
     }
+    if (object.file == "__hprof") {
+        return true;
+    }
+    if (object._struct == "ObjectTracing/allocation_info_tracer") {
+        return true;
+    }
+    return false;
 }
 
-extern "C" {
-    void Init_heap_profiler(void) {
-        sym_type = ID2SYM(rb_intern("type"));
-        sym_class = ID2SYM(rb_intern("class"));
-        sym_address = ID2SYM(rb_intern("address"));
-        sym_edge_name = ID2SYM(rb_intern("edge_name"));
-        sym_value = ID2SYM(rb_intern("value"));
-        sym_memsize = ID2SYM(rb_intern("memsize"));
-        sym_struct = ID2SYM(rb_intern("struct"));
-        sym_imemo_type = ID2SYM(rb_intern("imemo_type"));
-        sym_file = ID2SYM(rb_intern("file"));
-        sym_line = ID2SYM(rb_intern("line"));
-        sym_shared = ID2SYM(rb_intern("shared"));
-        sym_references = ID2SYM(rb_intern("references"));
-        id_uminus = rb_intern("-@");
+static VALUE make_ruby_object(const heap_object &object, object_cache &cache)
+{
+    VALUE hash = rb_hash_new();
 
-        VALUE rb_mHeapProfiler = rb_const_get(rb_cObject, rb_intern("HeapProfiler"));
+    if (present(object.type)) {
+        rb_hash_aset(hash, sym_type, cache.symbols.fetch(object.type));
+    }
 
-        rb_eHeapProfilerError = rb_const_get(rb_mHeapProfiler, rb_intern("Error"));
-        rb_global_variable(&rb_eHeapProfilerError);
+    if (object.address) {
+        rb_hash_aset(hash, sym_address, INT2FIX(object.address));
+    }
 
-        rb_eHeapProfilerCapacityError = rb_const_get(rb_mHeapProfiler, rb_intern("CapacityError"));
-        rb_global_variable(&rb_eHeapProfilerCapacityError);
+    if (object.has_class) {
+        rb_hash_aset(hash, sym_class, INT2FIX(object.class_address));
+    }
+
+    rb_hash_aset(hash, sym_memsize, INT2FIX(object.memsize));
+
+    if (present(object.imemo_type)) {
+        rb_hash_aset(hash, sym_imemo_type, cache.symbols.fetch(object.imemo_type));
+    }
+    if (present(object._struct)) {
+        rb_hash_aset(hash, sym_struct, cache.symbols.fetch(object._struct));
+    }
+    if (present(object.value)) {
+        rb_hash_aset(hash, sym_value, make_string(object.value));
+    }
+    if (object.has_shared) {
+        rb_hash_aset(hash, sym_shared, object.shared ? Qtrue : Qnil);
+        if (object.shared) {
+            VALUE references = rb_ary_new();
+            if (object.reference) {
+                rb_ary_push(references, INT2FIX(object.reference));
+            }
+            rb_hash_aset(hash, sym_references, references);
+        }
+    }
+    if (present(object.edge_name)) {
+        rb_hash_aset(hash, sym_edge_name, make_string(object.edge_name));
+    }
+
+    if (present(object.file)) {
+        rb_hash_aset(hash, sym_file, cache.files.fetch(object.file));
+    }
+
+    if (object.has_line) {
+        rb_hash_aset(hash, sym_line, INT2FIX(object.line));
+    }
+
+    return hash;
+}
+
+// Both document streams fail with CAPACITY when a single document doesn't fit in a batch,
+// e.g. the ROOT `references` lines of a large heap. They may also end early without any error,
+// when a batch starts with the newline ending the previous document and can't fit the next one.
+// Rather than failing, or silently dropping the rest of the dump, we parse the line the stream
+// stopped at on its own, letting the parser grow to fit it, and resume the stream after it.
+// Since all our buffers are padded, the bytes following the line can safely serve as its padding.
+static size_t stream_stop(std::string_view buffer, error_code error, size_t truncated_bytes, size_t last_document) {
+    if (error == CAPACITY) {
+        return buffer.size() - truncated_bytes;
+    }
+    if (last_document == std::string_view::npos) {
+        return 0;
+    }
+    size_t end = buffer.find('\n', last_document);
+    return end == std::string_view::npos ? buffer.size() : end + 1;
+}
+
+// Move `buffer` past the line starting at `position`, and return it, or an empty line
+// if there is nothing but whitespace left.
+static std::string_view unparsed_line(std::string_view &buffer, size_t position) {
+    buffer.remove_prefix(position);
+    size_t start = buffer.find_first_not_of(" \t\r\n");
+    if (start == std::string_view::npos) {
+        buffer.remove_prefix(buffer.size());
+        return buffer;
+    }
+    buffer.remove_prefix(start);
+    size_t end = buffer.find('\n');
+    std::string_view line = end == std::string_view::npos ? buffer : buffer.substr(0, end + 1);
+    buffer.remove_prefix(line.size());
+    return line;
+}
+
+template <typename Callback>
+static error_code each_dom_object(dom::parser &parser, std::string_view buffer, size_t batch_size, Callback callback) {
+    while (!buffer.empty()) {
+        dom::document_stream objects;
+        auto error = parser.parse_many(buffer.data(), buffer.size(), batch_size).get(objects);
+        if (error) {
+            return error;
+        }
+
+        size_t last_document = std::string_view::npos;
+        for (auto document = objects.begin(); document != objects.end(); ++document) {
+            dom::object object;
+            if ((error = (*document).get(object))) {
+                break;
+            }
+            if (!callback(object)) {
+                return SUCCESS;
+            }
+            last_document = document.current_index();
+        }
+        if (error && error != CAPACITY) {
+            return error;
+        }
+
+        std::string_view line = unparsed_line(buffer, stream_stop(buffer, error, objects.truncated_bytes(), last_document));
+        if (line.empty()) {
+            break;
+        }
+        dom::object object;
+        if ((error = parser.parse(line.data(), line.size(), false).get(object))) {
+            return error;
+        }
+        if (!callback(object)) {
+            return SUCCESS;
+        }
+    }
+    return SUCCESS;
+}
+
+// Unlike `load_dom_object`, `load_ondemand_object` can't simply skip a field of an unexpected type, e.g. a null
+// `file`, since it may have set part of it already. It fails instead, and the line is loaded with the DOM parser.
+static inline bool field_error(error_code error) {
+    return error == INCORRECT_TYPE || error == NUMBER_ERROR || error == NUMBER_OUT_OF_RANGE;
+}
+
+static error_code load_dom_line(dom::parser &parser, std::string_view line, heap_object &object) {
+    dom::object element;
+    auto error = parser.parse(line.data(), line.size(), false).get(element);
+    if (!error) {
+        load_dom_object(element, object);
+    }
+    return error;
+}
+
+template <typename Callback>
+static error_code each_ondemand_object(ondemand::parser &parser, dom::parser &fallback, std::string_view buffer, size_t batch_size,
+    heap_object &object, Callback callback) {
+    while (!buffer.empty()) {
+        ondemand::document_stream objects;
+        auto error = parser.iterate_many(buffer.data(), buffer.size(), batch_size).get(objects);
+        if (error) {
+            return error;
+        }
+
+        size_t last_document = std::string_view::npos;
+        for (auto document = objects.begin(); document != objects.end(); ++document) {
+            if ((error = load_ondemand_object(*document, object)) && field_error(error)) {
+                std::string_view line = buffer.substr(document.current_index());
+                error = load_dom_line(fallback, line.substr(0, line.find('\n')), object);
+            }
+            if (error) {
+                break;
+            }
+            if (!callback(object)) {
+                return SUCCESS;
+            }
+            last_document = document.current_index();
+        }
+        if (error && error != CAPACITY) {
+            return error;
+        }
+
+        std::string_view line = unparsed_line(buffer, stream_stop(buffer, error, objects.truncated_bytes(), last_document));
+        if (line.empty()) {
+            break;
+        }
+        ondemand::document document;
+        if ((error = parser.iterate(line.data(), line.size(), line.size() + SIMDJSON_PADDING).get(document))) {
+            return error;
+        }
+        if ((error = load_ondemand_object(document, object)) && field_error(error)) {
+            error = load_dom_line(fallback, line, object);
+        }
+        if (error) {
+            return error;
+        }
+        if (!callback(object)) {
+            return SUCCESS;
+        }
+    }
+    return SUCCESS;
+}
+
+// Return the first lines of `buffer` up to about `size` bytes, always ending on a line boundary.
+static std::string_view take_lines(std::string_view buffer, size_t size) {
+    if (buffer.size() <= size) {
+        return buffer;
+    }
+    size_t end = buffer.find('\n', size - 1);
+    return end == std::string_view::npos ? buffer : buffer.substr(0, end + 1);
+}
+
+static inline bool blank(std::string_view line) {
+    return line.find_first_not_of(" \t\r\n") == std::string_view::npos;
+}
+
+// Scan each line with `line_scanner`, and only parse with simdjson those it rejects.
+//
+// simdjson validates the encoding of whole documents which the scanner doesn't, so we validate
+// each batch before scanning it, while it's still in cache, and batches with invalid UTF-8 are
+// entirely left to simdjson, so that they fail the same way.
+template <typename Callback>
+static error_code each_scanned_object(dom::parser &parser, std::string_view buffer, size_t batch_size, heap_object &object,
+    Callback callback) {
+    bool more = true;
+    while (more && !buffer.empty()) {
+        std::string_view batch = take_lines(buffer, batch_size);
+        buffer.remove_prefix(batch.size());
+
+        if (!validate_utf8(batch.data(), batch.size())) {
+            auto error = each_dom_object(parser, batch, batch_size, [&](dom::object element) {
+                load_dom_object(element, object);
+                return more = callback(object);
+            });
+            if (error) {
+                return error;
+            }
+            continue;
+        }
+
+        line_scanner scanner(batch);
+        while (more && !scanner.done()) {
+            if (!scanner.scan(object)) {
+                std::string_view line = scanner.skip_line();
+                if (blank(line)) {
+                    continue;
+                }
+                dom::object element;
+                auto error = parser.parse(line.data(), line.size(), false).get(element);
+                if (error) {
+                    return error;
+                }
+                load_dom_object(element, object);
+            }
+            more = callback(object);
+        }
+    }
+    return SUCCESS;
+}
+
+struct parse_options {
+    size_t batch_size;
+    size_t threads;
+    parser_api api;
+    // Whether to collect all the references of each object, rather than just the first one of shared strings.
+    bool references = false;
+};
+
+template <typename Callback>
+static error_code each_heap_object(heap_parser &parser, const parse_options &options, std::string_view buffer, Callback callback) {
+    heap_object object;
+    if (options.references) {
+        object.references = &parser.references;
+    }
+
+    if (options.api == API_ONDEMAND) {
+        return each_ondemand_object(parser.ondemand(), parser.dom(), buffer, options.batch_size, object, callback);
+    } else if (options.api == API_SCANNER) {
+        return each_scanned_object(parser.dom(), buffer, options.batch_size, object, callback);
+    }
+
+    return each_dom_object(parser.dom(), buffer, options.batch_size, [&](dom::object element) {
+        load_dom_object(element, object);
+        return callback(object);
+    });
+}
+
+// Parsing runs without the GVL, so other Ruby threads, e.g. the other requests of a threaded server,
+// keep running meanwhile. The Ruby thread that released it only reacquires it to create Ruby objects,
+// and to handle interrupts like Ctrl-C or Thread#raise, which the parsing loops `check` for regularly.
+//
+// A Ruby exception would skip the destructors of the native state, so they are caught with `rb_protect`,
+// parsing stops, and the caller is expected to resume them with `rb_jump_tag(state)` once unwound.
+class released_gvl {
+  public:
+    int state = 0;
+
+    // Run `function()` without the GVL. Must be called from the Ruby thread, holding the GVL.
+    template <typename Function>
+    void run(Function function) {
+        bool done = false;
+        auto body = [&]() {
+            function();
+            done = true;
+        };
+        // The function isn't called at all if an interrupt is already pending, so we handle it first.
+        while (!done && !stopped()) {
+            rb_thread_call_without_gvl2(invoke<decltype(body)>, &body, unblock, this);
+            if (!done) {
+                interrupted = false;
+                auto check_interrupts = []() { rb_thread_check_ints(); };
+                protect(check_interrupts);
+            }
+        }
+    }
+
+    // Run a blocking system call, e.g. opening a FIFO, which waits for a writer, without the GVL so other threads,
+    // possibly that writer, can make progress. Interrupts stop the call with EINTR and are handled like in `run`,
+    // so `function()` is retried until it returns true, unless they raised. Must be called from the Ruby thread, holding the GVL.
+    template <typename Function>
+    void blocking(Function function) {
+        bool done = false;
+        auto body = [&]() {
+            done = function();
+        };
+        while (!done && !stopped()) {
+            rb_thread_call_without_gvl2(invoke<decltype(body)>, &body, RUBY_UBF_IO, nullptr);
+            if (!done) {
+                auto check_interrupts = []() { rb_thread_check_ints(); };
+                protect(check_interrupts);
+            }
+        }
+    }
+
+    // Run `function()` with the GVL, from the Ruby thread within `run`. Returns false if it raised.
+    template <typename Function>
+    bool with_gvl(Function function) {
+        auto body = [&]() {
+            protect(function);
+        };
+        rb_thread_call_with_gvl(invoke<decltype(body)>, &body);
+        return !stopped();
+    }
+
+    // Whether parsing should go on. Only the Ruby thread can handle interrupts, shard threads
+    // simply stop once it raised.
+    bool check(bool ruby_thread) {
+        if (ruby_thread && interrupted.load(std::memory_order_relaxed)) {
+            interrupted = false;
+            with_gvl([]() { rb_thread_check_ints(); });
+        }
+        return !stopped();
+    }
+
+    bool stopped() const {
+        return raised.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<bool> interrupted{false};
+    std::atomic<bool> raised{false};
+
+    template <typename Function>
+    void protect(Function &function) {
+        rb_protect(invoke_protected<Function>, reinterpret_cast<VALUE>(&function), &state);
+        if (state) {
+            raised = true;
+        }
+    }
+
+    template <typename Function>
+    static void *invoke(void *function) {
+        (*static_cast<Function *>(function))();
+        return nullptr;
+    }
+
+    template <typename Function>
+    static VALUE invoke_protected(VALUE function) {
+        (*reinterpret_cast<Function *>(function))();
+        return Qnil;
+    }
+
+    static void unblock(void *gvl) {
+        static_cast<released_gvl *>(gvl)->interrupted = true;
+    }
+};
+
+// Pipes are polled in slices of this duration, so that interrupts are handled while waiting for data.
+static const int POLL_TIMEOUT_MS = 100;
+
+// Shards are parsed in windows of this size, after which their pages are released.
+static const size_t WINDOW_SIZE = 64 * 1024 * 1024;
+
+// A read-only view of a heap dump. When possible regular files are memory mapped rather than
+// read into one big heap buffer, so pages are loaded lazily as the parser goes through them,
+// and released once parsed, keeping the resident memory roughly constant regardless of the dump size.
+//
+// Pipes and other non seekable files are read through a fixed size buffer instead, which the parser
+// consumes one window of complete lines at a time. They can't be split in shards.
+class dump_input {
+  public:
+    dump_input() = default;
+    dump_input(const dump_input &) = delete;
+    dump_input &operator=(const dump_input &) = delete;
+
+#ifdef HAVE_SYS_MMAN_H
+    ~dump_input() {
+        if (address) {
+            munmap(address, mapped_size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // If an interrupt raised meanwhile, `gvl` is stopped and the dump is left unloaded.
+    error_code load(const char *path, released_gvl &gvl) {
+        int file = -1;
+        // Opening a FIFO blocks until a writer opens it too.
+        gvl.blocking([&]() {
+            file = open(path, O_RDONLY);
+            return file >= 0 || errno != EINTR;
+        });
+        if (file < 0) {
+            return IO_ERROR;
+        }
+
+        struct stat status;
+        if (fstat(file, &status) != 0 || S_ISDIR(status.st_mode)) {
+            close(file);
+            return IO_ERROR;
+        }
+        if (!S_ISREG(status.st_mode)) {
+            fd = file;
+            return SUCCESS;
+        }
+
+        size = status.st_size;
+        if (size == 0) {
+            close(file);
+            return SUCCESS;
+        }
+
+        // simdjson may read up to SIMDJSON_PADDING bytes past the end of the input. Past the end
+        // of the file the last page is zero filled, but if the file size is a multiple of the page size
+        // there is no such slack, so we reserve an anonymous mapping large enough for the padding,
+        // and map the file on top of it.
+        mapped_size = round_to_page(size + SIMDJSON_PADDING);
+        void *region = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            close(file);
+            return MEMALLOC;
+        }
+        address = static_cast<char *>(region);
+
+        region = mmap(address, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, 0);
+        close(file);
+        if (region == MAP_FAILED) {
+            return IO_ERROR;
+        }
+        madvise(address, size, MADV_SEQUENTIAL);
+        return SUCCESS;
+    }
+
+    bool seekable() const {
+        return fd < 0;
+    }
+
+    std::string_view data() const {
+        return std::string_view(address, size);
+    }
+
+    // Call `callback(window)` with consecutive windows of complete lines from `range`, or from the
+    // stream if the dump isn't seekable, until it returns false. The GVL must be released.
+    //
+    // Streams are buffered in twice the batch size, which leaves room for at least one more
+    // document after moving a partial line back to the start of the buffer. Larger lines grow the buffer.
+    template <typename Callback>
+    error_code each_window(std::string_view range, size_t batch_size, released_gvl &gvl, Callback callback) {
+        if (seekable()) {
+            while (!range.empty()) {
+                std::string_view window = take_lines(range, WINDOW_SIZE);
+                bool more = callback(window);
+                release(window);
+                if (!more) {
+                    break;
+                }
+                range.remove_prefix(window.size());
+            }
+            return SUCCESS;
+        }
+
+        size_t capacity = 2 * batch_size;
+        std::unique_ptr<char[]> buffer(new char[capacity + SIMDJSON_PADDING]());
+        size_t length = 0;
+        bool eof = false;
+        while (true) {
+            while (!eof && length < capacity) {
+                struct pollfd input = { fd, POLLIN, 0 };
+                int ready = poll(&input, 1, POLL_TIMEOUT_MS);
+                if (!gvl.check(true)) {
+                    return SUCCESS;
+                }
+                if (ready <= 0) {
+                    if (ready == 0 || errno == EINTR) {
+                        continue;
+                    }
+                    return IO_ERROR;
+                }
+
+                ssize_t bytes_read = read(fd, buffer.get() + length, capacity - length);
+                if (bytes_read < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return IO_ERROR;
+                }
+                eof = bytes_read == 0;
+                length += bytes_read;
+            }
+            if (length == 0) {
+                return SUCCESS;
+            }
+
+            std::string_view available(buffer.get(), length);
+            size_t end = eof ? length : available.rfind('\n') + 1;
+            if (end == 0) {
+                // A single line doesn't fit in the buffer, grow it until it does.
+                std::unique_ptr<char[]> larger(new char[2 * capacity + SIMDJSON_PADDING]());
+                memcpy(larger.get(), buffer.get(), length);
+                buffer = std::move(larger);
+                capacity *= 2;
+                continue;
+            }
+            if (!callback(available.substr(0, end))) {
+                return SUCCESS;
+            }
+
+            memmove(buffer.get(), available.data() + end, length - end);
+            length -= end;
+        }
+    }
+
+  private:
+    char *address = nullptr;
+    size_t size = 0;
+    size_t mapped_size = 0;
+    int fd = -1;
+
+    static size_t page_size() {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    static size_t round_to_page(size_t size) {
+        return (size + page_size() - 1) & ~(page_size() - 1);
+    }
+
+    // Let the kernel reclaim the pages of a range we're done parsing. Only pages entirely
+    // within the range are released, and they would simply be read again if accessed.
+    void release(std::string_view range) {
+        uintptr_t start = round_to_page(reinterpret_cast<uintptr_t>(range.data()));
+        uintptr_t end = reinterpret_cast<uintptr_t>(range.data() + range.size()) & ~(page_size() - 1);
+        if (end > start) {
+            madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
+        }
+    }
+#else
+    error_code load(const char *path, released_gvl &gvl) {
+        return padded_string::load(path).get(buffer);
+    }
+
+    bool seekable() const {
+        return true;
+    }
+
+    std::string_view data() const {
+        return buffer;
+    }
+
+    template <typename Callback>
+    error_code each_window(std::string_view range, size_t batch_size, released_gvl &gvl, Callback callback) {
+        callback(range);
+        return SUCCESS;
+    }
+
+  private:
+    padded_string buffer;
+#endif
+};
+
+// Parse a shard of the dump without the GVL, either from the Ruby thread or a shard thread.
+template <typename Callback>
+static error_code each_heap_object(heap_parser &parser, const parse_options &options, dump_input &dump, std::string_view shard,
+    released_gvl &gvl, bool ruby_thread, Callback callback) {
+    error_code error = SUCCESS;
+    auto window_error = dump.each_window(shard, options.batch_size, gvl, [&](std::string_view window) {
+        bool more = true;
+        error = each_heap_object(parser, options, window, [&](heap_object &object) {
+            return more = gvl.check(ruby_thread) && callback(object);
+        });
+        return more && !error;
+    });
+    return error ? error : window_error;
+}
+
+// Parsing a shard in its own thread requires its own parser, and each of them allocates
+// buffers proportional to the batch size, so we avoid creating shards that are too small.
+static const size_t MINIMUM_SHARD_SIZE = 4 * 1024 * 1024;
+
+// Split the dump in up to `count` contiguous shards, each ending on a line boundary.
+// Since all shards are views into the same padded dump, simdjson can safely read past
+// the end of each of them.
+static std::vector<std::string_view> split_shards(const dump_input &dump, size_t count) {
+    std::string_view buffer = dump.data();
+    if (!dump.seekable()) {
+        count = 1;
+    }
+    size_t max_count = buffer.size() / MINIMUM_SHARD_SIZE + 1;
+    if (count > max_count) {
+        count = max_count;
+    }
+
+    std::vector<std::string_view> shards;
+    size_t start = 0;
+    for (size_t index = 1; index <= count && (index == 1 || start < buffer.size()); index++) {
+        size_t end = buffer.size();
+        if (index < count) {
+            end = buffer.find('\n', std::max(start, buffer.size() / count * index));
+            end = end == std::string_view::npos ? buffer.size() : end + 1;
+        }
+        shards.push_back(buffer.substr(start, end - start));
+        start = end;
+    }
+    return shards;
+}
+
+// Run `function(shard_index, parser)` for each shard, the first one on the calling Ruby thread
+// with the Ruby owned parser, the others in their own thread with a dedicated parser.
+template <typename Function>
+static void run_sharded(heap_parser &parser, size_t count, Function function) {
+    std::vector<std::thread> threads;
+    for (size_t index = 1; index < count; index++) {
+        threads.emplace_back([&function, index]() {
+            heap_parser shard_parser;
+            function(index, shard_parser);
+        });
+    }
+    function(0, parser);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+static void raise_parse_error(error_code error) {
+    if (error == CAPACITY) {
+        rb_raise(rb_eHeapProfilerCapacityError, "A document of this heap dump exceeds the parser maximum capacity");
+    } else {
+        rb_raise(rb_eHeapProfilerError, "%s", error_message(error));
+    }
+}
+
+static parse_options get_parse_options(VALUE batch_size, VALUE threads, VALUE api) {
+    Check_Type(batch_size, T_FIXNUM);
+    Check_Type(threads, T_FIXNUM);
+    Check_Type(api, T_SYMBOL);
+
+    parse_options options;
+    options.batch_size = FIX2INT(batch_size);
+    options.threads = FIX2LONG(threads) < 1 ? 1 : FIX2LONG(threads);
+    if (api == sym_dom) {
+        options.api = API_DOM;
+    } else if (api == sym_ondemand) {
+        options.api = API_ONDEMAND;
+    } else if (api == sym_scanner) {
+        options.api = API_SCANNER;
+    } else {
+        rb_raise(rb_eArgError, "Unknown parser API: %" PRIsVALUE, rb_inspect(api));
+    }
+    return options;
+}
+
+static int64_t get_generation(VALUE since) {
+    if (RTEST(since)) {
+        Check_Type(since, T_FIXNUM);
+        return FIX2INT(since);
+    }
+    return -1;
+}
+
+// The string index is only needed to resolve the value of shared strings, which are usually
+// a small fraction of all strings. Since their root may come before or after them in the dump,
+// we keep all values natively while parsing, and only create Ruby strings for referenced ones.
+struct index_shard {
+    std::vector<std::pair<uint64_t, std::string>> classes;
+    std::vector<std::pair<uint64_t, std::string_view>> strings;
+    std::vector<uint64_t> shared_roots;
+    string_arena values;
+    error_code error = SUCCESS;
+
+    void process(const heap_object &object) {
+        if (object.type == "STRING") {
+            if (present(object.value)) {
+                strings.emplace_back(object.address, values.copy(object.value));
+            } else if (object.shared && object.reference) {
+                shared_roots.push_back(object.reference);
+            }
+        } else if (object.type == "CLASS" || object.type == "MODULE") {
+            if (present(object.name)) {
+                classes.emplace_back(object.address, object.name);
+            } else if (present(object.file) && object.has_line) {
+                std::string buffer = "<Class ";
+                buffer += object.file;
+                buffer += ":";
+                buffer += std::to_string(object.line);
+                buffer += ">";
+                classes.emplace_back(object.address, std::move(buffer));
+            }
+        }
+    }
+};
+
+// Maps class addresses to their names. Dumps can hold hundreds of thousands of classes, so rather than
+// a Ruby Hash of Integer to String, addresses are kept in an open addressing table of 16 bytes slots,
+// with linear probing, pointing to names stored back to back in a single buffer.
+class class_names {
+  public:
+    void insert(uint64_t address, std::string_view name) {
+        if (2 * (entries.size() + 1) > slots.size()) {
+            grow();
+        }
+        size_t index = find(address);
+        if (!slots[index].id) {
+            entries.push_back({ address, 0, 0 });
+            slots[index] = { address, entries.size() };
+        }
+        entry &target = entries[slots[index].id - 1];
+        target.offset = names.size();
+        target.length = name.size();
+        names.append(name);
+    }
+
+    bool lookup(uint64_t address, std::string_view &name) const {
+        if (slots.empty()) {
+            return false;
+        }
+        const slot &found = slots[find(address)];
+        if (!found.id) {
+            return false;
+        }
+        name = name_of(entries[found.id - 1]);
+        return true;
+    }
+
+    // Call `callback(address, name)` for each class, in insertion order.
+    template <typename Callback>
+    void each(Callback callback) const {
+        for (const entry &class_entry : entries) {
+            callback(class_entry.address, name_of(class_entry));
+        }
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    size_t memsize() const {
+        return sizeof(class_names) + slots.capacity() * sizeof(slot) + entries.capacity() * sizeof(entry) + names.capacity();
+    }
+
+  private:
+    struct slot {
+        uint64_t address;
+        size_t id; // One-based index in `entries`, 0 for empty slots.
+    };
+
+    struct entry {
+        uint64_t address;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    std::vector<slot> slots;
+    std::vector<entry> entries;
+    std::string names;
+
+    std::string_view name_of(const entry &class_entry) const {
+        return std::string_view(names.data() + class_entry.offset, class_entry.length);
+    }
+
+    // Addresses are aligned, so their low bits alone would collide a lot.
+    size_t find(uint64_t address) const {
+        size_t mask = slots.size() - 1;
+        size_t index = (address * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+        while (slots[index].id && slots[index].address != address) {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    void grow() {
+        std::vector<slot> previous(slots.empty() ? 64 : 2 * slots.size());
+        previous.swap(slots);
+        for (const slot &entry : previous) {
+            if (entry.id) {
+                slots[find(entry.address)] = entry;
+            }
+        }
+    }
+};
+
+static void ClassIndex_delete(void *index) {
+    delete static_cast<class_names *>(index);
+}
+
+static size_t ClassIndex_memsize(const void *index) {
+    return static_cast<const class_names *>(index)->memsize();
+}
+
+static const rb_data_type_t class_index_data_type = {
+    "ClassIndex",
+    { 0, ClassIndex_delete, ClassIndex_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE class_index_allocate(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &class_index_data_type, new class_names);
+}
+
+static inline class_names * get_class_index(VALUE self) {
+    class_names *index;
+    TypedData_Get_Struct(self, class_names, &class_index_data_type, index);
+    return index;
+}
+
+static VALUE rb_heap_class_index_size(VALUE self) {
+    return SIZET2NUM(get_class_index(self)->size());
+}
+
+// The name of the class at `address`, or nil if it isn't known.
+static VALUE rb_heap_class_index_lookup(VALUE self, VALUE address) {
+    Check_Type(address, T_FIXNUM);
+    std::string_view name;
+    if (!get_class_index(self)->lookup(FIX2ULONG(address), name)) {
+        return Qnil;
+    }
+    return dedup_string(name);
+}
+
+static VALUE rb_heap_class_index_each(VALUE self) {
+    RETURN_ENUMERATOR(self, 0, 0);
+    get_class_index(self)->each([](uint64_t address, std::string_view name) {
+        rb_yield_values(2, INT2FIX(address), dedup_string(name));
+    });
+    return self;
+}
+
+// Shards are merged in file order, so the result is identical to a sequential parse.
+static void fill_index(const std::vector<index_shard> &shards, VALUE class_index, VALUE string_index) {
+    std::unordered_set<uint64_t> shared_roots;
+    for (const index_shard &shard : shards) {
+        shared_roots.insert(shard.shared_roots.begin(), shard.shared_roots.end());
+    }
+
+    for (const index_shard &shard : shards) {
+        if (!shared_roots.empty()) {
+            for (auto &entry : shard.strings) {
+                if (shared_roots.count(entry.first)) {
+                    rb_hash_aset(string_index, INT2FIX(entry.first), make_string(entry.second));
+                }
+            }
+        }
+        for (auto &entry : shard.classes) {
+            get_class_index(class_index)->insert(entry.first, entry.second);
+        }
+    }
+}
+
+static VALUE rb_heap_build_index(VALUE self, VALUE path, VALUE batch_size, VALUE threads, VALUE api) {
+    Check_Type(path, T_STRING);
+    parse_options options = get_parse_options(batch_size, threads, api);
+
+    VALUE string_index = rb_hash_new();
+    VALUE class_index = class_index_allocate(rb_cHeapProfilerClassIndex);
+
+    error_code error;
+    released_gvl gvl;
+    {
+        dump_input dump;
+        if (!(error = dump.load(RSTRING_PTR(path), gvl))) {
+            std::vector<std::string_view> shards = split_shards(dump, options.threads);
+            std::vector<index_shard> results(shards.size());
+
+            parser_lease parser(self);
+            gvl.run([&]() {
+                run_sharded(*parser, shards.size(), [&](size_t index, heap_parser &shard_parser) {
+                    index_shard &shard = results[index];
+                    shard.error = each_heap_object(shard_parser, options, dump, shards[index], gvl, index == 0, [&](heap_object &object) {
+                        shard.process(object);
+                        return true;
+                    });
+                });
+            });
+
+            for (index_shard &shard : results) {
+                if ((error = shard.error)) {
+                    break;
+                }
+            }
+            if (!error && !gvl.state) {
+                fill_index(results, class_index, string_index);
+            }
+        }
+    }
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+
+    VALUE return_value = rb_ary_new();
+    rb_ary_push(return_value, class_index);
+    rb_ary_push(return_value, string_index);
+    return return_value;
+}
+
+// Indexes can be saved in a sidecar file next to their dump, so that later analyses of the same dump
+// don't have to parse it again to resolve class names and shared strings. The sidecar is a header,
+// followed by fixed size entries for classes then strings, and the names and values they point to.
+//
+// A sidecar is only valid for the dump it was built from: its device and inode, size, modification
+// time to the nanosecond, and a hash of its first and last bytes. Hashing the whole dump would cost about as much as indexing it again.
+static const char INDEX_CACHE_MAGIC[8] = { 'H', 'P', 'I', 'D', 'X', 0, 0, 0 };
+static const uint32_t INDEX_CACHE_VERSION = 2;
+static const size_t INDEX_CACHE_HASHED_BYTES = 64 * 1024;
+
+// What identifies the dump a sidecar was built from.
+struct dump_fingerprint {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t hash;
+
+    bool operator==(const dump_fingerprint &other) const {
+        return device == other.device && inode == other.inode && size == other.size && mtime == other.mtime &&
+               mtime_nsec == other.mtime_nsec && hash == other.hash;
+    }
+};
+
+struct index_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    dump_fingerprint dump;
+    uint64_t class_count;
+    uint64_t string_count;
+    uint64_t data_size;
+};
+
+struct index_cache_entry {
+    uint64_t address;
+    uint32_t offset;
+    uint32_t length;
+};
+
+#ifdef HAVE_SYS_MMAN_H
+static inline uint64_t fnv1a(const char *data, size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static bool read_at(int file, std::string &buffer, size_t size, off_t offset) {
+    buffer.resize(size);
+    size_t read = 0;
+    while (read < size) {
+        ssize_t count = pread(file, &buffer[read], size - read, offset + read);
+        if (count <= 0) {
+            return false;
+        }
+        read += count;
+    }
+    return true;
+}
+
+// Identify the dump at `path`. Only regular files can be cached.
+static bool fingerprint_dump(const char *path, dump_fingerprint &fingerprint) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+
+    struct stat status;
+    bool success = fstat(file, &status) == 0 && S_ISREG(status.st_mode);
+    if (success) {
+        fingerprint.device = status.st_dev;
+        fingerprint.inode = status.st_ino;
+        fingerprint.size = status.st_size;
+        fingerprint.mtime = status.st_mtime;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+        fingerprint.mtime_nsec = status.st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+        fingerprint.mtime_nsec = status.st_mtimespec.tv_nsec;
+#else
+        fingerprint.mtime_nsec = 0;
+#endif
+
+        size_t head = std::min<size_t>(fingerprint.size, INDEX_CACHE_HASHED_BYTES);
+        size_t tail = std::min<size_t>(fingerprint.size - head, INDEX_CACHE_HASHED_BYTES);
+        std::string buffer;
+        fingerprint.hash = 0xCBF29CE484222325ULL;
+        success = read_at(file, buffer, head, 0);
+        if (success) {
+            fingerprint.hash = fnv1a(buffer.data(), head, fingerprint.hash);
+            success = read_at(file, buffer, tail, fingerprint.size - tail);
+            fingerprint.hash = fnv1a(buffer.data(), tail, fingerprint.hash);
+        }
+    }
+    close(file);
+    return success;
+}
+
+// Map the whole sidecar at `path` read-only, or return `MAP_FAILED` if it isn't a regular file of at least `minimum_size` bytes.
+static void * map_sidecar(const char *path, size_t minimum_size, size_t &size) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return MAP_FAILED;
+    }
+    struct stat status;
+    void *address = MAP_FAILED;
+    if (fstat(file, &status) == 0 && S_ISREG(status.st_mode) && static_cast<size_t>(status.st_size) >= minimum_size) {
+        size = status.st_size;
+        address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    return address;
+}
+
+static bool valid_index_cache(const index_cache_header &header, const dump_fingerprint &expected, size_t size) {
+    if (memcmp(header.magic, INDEX_CACHE_MAGIC, sizeof(header.magic)) || header.version != INDEX_CACHE_VERSION ||
+        !(header.dump == expected)) {
+        return false;
+    }
+    size_t entries = (size - sizeof(header)) / sizeof(index_cache_entry);
+    if (header.class_count > entries || header.string_count > entries - header.class_count) {
+        return false;
+    }
+    return sizeof(header) + (header.class_count + header.string_count) * sizeof(index_cache_entry) + header.data_size == size;
+}
+
+struct index_cache_writer {
+    std::vector<index_cache_entry> entries;
+    std::string data;
+    bool overflow = false;
+
+    void add(uint64_t address, std::string_view value) {
+        if (data.size() + value.size() > UINT32_MAX) {
+            overflow = true;
+            return;
+        }
+        entries.push_back({ address, static_cast<uint32_t>(data.size()), static_cast<uint32_t>(value.size()) });
+        data.append(value);
+    }
+};
+
+static int add_cached_string(VALUE address, VALUE value, VALUE writer) {
+    if (FIXNUM_P(address) && RB_TYPE_P(value, T_STRING)) {
+        reinterpret_cast<index_cache_writer *>(writer)->add(FIX2ULONG(address), std::string_view(RSTRING_PTR(value), RSTRING_LEN(value)));
+    }
+    return ST_CONTINUE;
+}
+
+// Write `parts` to a temporary file first, and then move it to `path`, so that concurrent readers never see a partial sidecar.
+static bool write_sidecar(VALUE path, const std::initializer_list<std::string_view> &parts) {
+    // Several threads of the same process may write the same sidecar, so each gets its own temporary file.
+    std::string temporary_path(RSTRING_PTR(path), RSTRING_LEN(path));
+    temporary_path += ".XXXXXX";
+
+    int file = mkstemp(&temporary_path[0]);
+    if (file < 0) {
+        return false;
+    }
+    bool success = fchmod(file, 0644) == 0;
+    for (std::string_view part : parts) {
+        while (success && !part.empty()) {
+            ssize_t count = write(file, part.data(), part.size());
+            success = count > 0;
+            if (success) {
+                part.remove_prefix(count);
+            }
+        }
+    }
+    success = close(file) == 0 && success && rename(temporary_path.c_str(), RSTRING_PTR(path)) == 0;
+    if (!success) {
+        unlink(temporary_path.c_str());
+    }
+    return success;
+}
+#endif
+
+// The index saved in `cache_path` for the dump at `path`, or nil if it's missing or stale.
+static VALUE rb_heap_load_index_cache(VALUE self, VALUE path, VALUE cache_path) {
+    Check_Type(path, T_STRING);
+    Check_Type(cache_path, T_STRING);
+#ifdef HAVE_SYS_MMAN_H
+    dump_fingerprint expected;
+    if (!fingerprint_dump(RSTRING_PTR(path), expected)) {
+        return Qnil;
+    }
+
+    size_t size;
+    void *address = map_sidecar(RSTRING_PTR(cache_path), sizeof(index_cache_header), size);
+    if (address == MAP_FAILED) {
+        return Qnil;
+    }
+
+    const char *cache = static_cast<const char *>(address);
+    index_cache_header header;
+    memcpy(&header, cache, sizeof(header));
+
+    VALUE return_value = Qnil;
+    if (valid_index_cache(header, expected, size)) {
+        const index_cache_entry *entries = reinterpret_cast<const index_cache_entry *>(cache + sizeof(header));
+        const index_cache_entry *strings = entries + header.class_count;
+        const index_cache_entry *end = strings + header.string_count;
+        std::string_view data(reinterpret_cast<const char *>(end), header.data_size);
+
+        bool valid = true;
+        for (const index_cache_entry *entry = entries; entry < end; entry++) {
+            valid &= static_cast<uint64_t>(entry->offset) + entry->length <= data.size();
+        }
+        if (valid) {
+            VALUE class_index = class_index_allocate(rb_cHeapProfilerClassIndex);
+            class_names *classes = get_class_index(class_index);
+            for (const index_cache_entry *entry = entries; entry < strings; entry++) {
+                classes->insert(entry->address, data.substr(entry->offset, entry->length));
+            }
+            VALUE string_index = rb_hash_new();
+            for (const index_cache_entry *entry = strings; entry < end; entry++) {
+                rb_hash_aset(string_index, INT2FIX(entry->address), make_string(data.substr(entry->offset, entry->length)));
+            }
+
+            return_value = rb_ary_new();
+            rb_ary_push(return_value, class_index);
+            rb_ary_push(return_value, string_index);
+        }
+    }
+    munmap(address, size);
+    return return_value;
+#else
+    return Qnil;
+#endif
+}
+
+// Save the index of the dump at `path` to `cache_path`. Returns false if it couldn't be saved.
+static VALUE rb_heap_save_index_cache(VALUE self, VALUE path, VALUE cache_path, VALUE class_index, VALUE string_index) {
+    Check_Type(path, T_STRING);
+    Check_Type(cache_path, T_STRING);
+    Check_Type(string_index, T_HASH);
+    class_names *classes = get_class_index(class_index);
+#ifdef HAVE_SYS_MMAN_H
+    index_cache_header header;
+    if (!fingerprint_dump(RSTRING_PTR(path), header.dump)) {
+        return Qfalse;
+    }
+    memcpy(header.magic, INDEX_CACHE_MAGIC, sizeof(header.magic));
+    header.version = INDEX_CACHE_VERSION;
+    header.reserved = 0;
+
+    index_cache_writer writer;
+    classes->each([&](uint64_t address, std::string_view name) {
+        writer.add(address, name);
+    });
+    header.class_count = writer.entries.size();
+    rb_hash_foreach(string_index, add_cached_string, reinterpret_cast<VALUE>(&writer));
+    header.string_count = writer.entries.size() - header.class_count;
+    header.data_size = writer.data.size();
+    if (writer.overflow) {
+        return Qfalse;
+    }
+
+    return write_sidecar(cache_path, {
+        std::string_view(reinterpret_cast<const char *>(&header), sizeof(header)),
+        std::string_view(reinterpret_cast<const char *>(writer.entries.data()), writer.entries.size() * sizeof(index_cache_entry)),
+        writer.data,
+    }) ? Qtrue : Qfalse;
+#else
+    return Qfalse;
+#endif
+}
+
+// Ruby strings aren't padded, so they are copied in padded buffers before being parsed.
+static VALUE rb_heap_parse_address(VALUE self, VALUE address) {
+    Check_Type(address, T_STRING);
+    long size = RSTRING_LEN(address);
+    if (size > static_cast<long>(2 + ADDRESS_DIGITS)) {
+        return INT2FIX(parse_address_scalar(RSTRING_PTR(address), size));
+    }
+    char buffer[2 + 2 * ADDRESS_DIGITS];
+    memcpy(buffer, RSTRING_PTR(address), size);
+    return INT2FIX(parse_address(buffer, size));
+}
+
+static VALUE rb_heap_parse_addresses(VALUE self, VALUE addresses) {
+    Check_Type(addresses, T_ARRAY);
+    long count = RARRAY_LEN(addresses);
+
+    std::string buffer;
+    for (long index = 0; index < count; index++) {
+        VALUE address = RARRAY_AREF(addresses, index);
+        Check_Type(address, T_STRING);
+        buffer.append(RSTRING_PTR(address), RSTRING_LEN(address));
+    }
+    buffer.append(SIMDJSON_PADDING, '\0');
+
+    std::vector<std::string_view> views;
+    views.reserve(count);
+    const char *cursor = buffer.data();
+    for (long index = 0; index < count; index++) {
+        long size = RSTRING_LEN(RARRAY_AREF(addresses, index));
+        views.emplace_back(cursor, size);
+        cursor += size;
+    }
+
+    std::vector<uint64_t> values(count);
+    parse_addresses(views.data(), count, values.data());
+
+    VALUE result = rb_ary_new_capa(count);
+    for (uint64_t value : values) {
+        rb_ary_push(result, INT2FIX(value));
+    }
+    return result;
+}
+
+// Run `function(index)` for each index from 0 to `count`, the first one on the calling thread.
+template <typename Function>
+static void run_parallel(size_t count, Function function) {
+    std::vector<std::thread> threads;
+    for (size_t index = 1; index < count; index++) {
+        threads.emplace_back([&function, index]() { function(index); });
+    }
+    function(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+// Slices smaller than this aren't worth sorting in their own thread.
+static const size_t MINIMUM_RADIX_SLICE = 64 * 1024;
+
+// Sort `values` by their `uint64_t` key, with a stable least significant digit radix sort, 8 bits at a time.
+// Digits all keys share, like the high bytes of addresses from the same heap, are skipped entirely.
+//
+// Each pass is spread over up to `threads` contiguous slices: each thread counts the digits of its slice,
+// then scatters it to the offsets that precede it for each digit, which keeps the sort stable.
+template <typename T, typename Key>
+static void radix_sort(std::vector<T> &values, size_t threads, Key key) {
+    if (values.size() < 2) {
+        return;
+    }
+    uint64_t all_ones = ~0ULL, any_ones = 0;
+    for (const T &value : values) {
+        all_ones &= key(value);
+        any_ones |= key(value);
+    }
+    uint64_t varying = all_ones ^ any_ones;
+
+    size_t count = std::max<size_t>(1, std::min(threads, values.size() / MINIMUM_RADIX_SLICE));
+    size_t slice = (values.size() + count - 1) / count;
+    std::vector<T> buffer(values.size());
+    std::vector<std::array<size_t, 256>> offsets(count);
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        if (!((varying >> shift) & 0xFF)) {
+            continue;
+        }
+        run_parallel(count, [&](size_t index) {
+            std::array<size_t, 256> &histogram = offsets[index];
+            histogram.fill(0);
+            size_t end = std::min(values.size(), (index + 1) * slice);
+            for (size_t position = index * slice; position < end; position++) {
+                histogram[(key(values[position]) >> shift) & 0xFF]++;
+            }
+        });
+
+        size_t total = 0;
+        for (size_t digit = 0; digit < 256; digit++) {
+            for (auto &histogram : offsets) {
+                size_t digit_count = histogram[digit];
+                histogram[digit] = total;
+                total += digit_count;
+            }
+        }
+
+        run_parallel(count, [&](size_t index) {
+            std::array<size_t, 256> &next = offsets[index];
+            size_t end = std::min(values.size(), (index + 1) * slice);
+            for (size_t position = index * slice; position < end; position++) {
+                buffer[next[(key(values[position]) >> shift) & 0xFF]++] = values[position];
+            }
+        });
+        values.swap(buffer);
+    }
+}
+
+// The sorted addresses of the objects of a dump, to find which objects of another dump it doesn't contain.
+// A dump holds millions of objects, so a flat vector of 8 bytes per address is a lot more compact,
+// and faster to build, than a Ruby Set or Hash.
+class address_set {
+  public:
+    std::vector<uint64_t> addresses;
+
+    bool contains(uint64_t address) const {
+        return std::binary_search(addresses.begin(), addresses.end(), address);
+    }
+
+    // Fill the set with the addresses collected by each shard, releasing them along the way.
+    void fill(std::vector<std::vector<uint64_t>> &shards, size_t threads) {
+        size_t count = 0;
+        for (auto &shard : shards) {
+            count += shard.size();
+        }
+        addresses.reserve(count);
+        for (auto &shard : shards) {
+            addresses.insert(addresses.end(), shard.begin(), shard.end());
+            std::vector<uint64_t>().swap(shard);
+        }
+        radix_sort(addresses, threads, [](uint64_t address) { return address; });
+        addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+        addresses.shrink_to_fit();
+    }
+
+    size_t memsize() const {
+        return sizeof(address_set) + addresses.capacity() * sizeof(uint64_t);
+    }
+};
+
+static void AddressSet_delete(void *set) {
+    delete static_cast<address_set *>(set);
+}
+
+static size_t AddressSet_memsize(const void *set) {
+    return static_cast<const address_set *>(set)->memsize();
+}
+
+static const rb_data_type_t address_set_data_type = {
+    "AddressSet",
+    { 0, AddressSet_delete, AddressSet_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE address_set_allocate(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &address_set_data_type, new address_set);
+}
+
+static inline address_set * get_address_set(VALUE self) {
+    address_set *set;
+    TypedData_Get_Struct(self, address_set, &address_set_data_type, set);
+    return set;
+}
+
+static VALUE rb_heap_address_set_size(VALUE self) {
+    return SIZET2NUM(get_address_set(self)->addresses.size());
+}
+
+static VALUE rb_heap_address_set_include(VALUE self, VALUE address) {
+    if (!RB_INTEGER_TYPE_P(address)) {
+        return Qfalse;
+    }
+    return get_address_set(self)->contains(NUM2ULL(address)) ? Qtrue : Qfalse;
+}
+
+// The addresses of this set that aren't in `other`, e.g. those of the objects allocated between two dumps.
+static VALUE rb_heap_address_set_difference(VALUE self, VALUE other) {
+    const address_set &set = *get_address_set(self);
+    const address_set &excluded = *get_address_set(other);
+    VALUE result = address_set_allocate(rb_cHeapProfilerAddressSet);
+    std::vector<uint64_t> &addresses = get_address_set(result)->addresses;
+    std::set_difference(set.addresses.begin(), set.addresses.end(), excluded.addresses.begin(), excluded.addresses.end(),
+        std::back_inserter(addresses));
+    addresses.shrink_to_fit();
+    return result;
+}
+
+static VALUE rb_heap_addresses_set(VALUE self, VALUE path, VALUE batch_size, VALUE threads, VALUE api) {
+    Check_Type(path, T_STRING);
+    parse_options options = get_parse_options(batch_size, threads, api);
+
+    VALUE set = address_set_allocate(rb_cHeapProfilerAddressSet);
+    address_set &addresses = *get_address_set(set);
+
+    error_code error;
+    released_gvl gvl;
+    {
+        dump_input dump;
+        if (!(error = dump.load(RSTRING_PTR(path), gvl))) {
+            std::vector<std::string_view> shards = split_shards(dump, options.threads);
+            std::vector<std::vector<uint64_t>> results(shards.size());
+            std::vector<error_code> errors(shards.size(), SUCCESS);
+
+            parser_lease parser(self);
+            gvl.run([&]() {
+                run_sharded(*parser, shards.size(), [&](size_t index, heap_parser &shard_parser) {
+                    std::vector<uint64_t> &shard = results[index];
+                    errors[index] = each_heap_object(shard_parser, options, dump, shards[index], gvl, index == 0, [&](heap_object &object) {
+                        if (object.address) {
+                            shard.push_back(object.address);
+                        }
+                        return true;
+                    });
+                });
+                if (!gvl.stopped()) {
+                    addresses.fill(results, options.threads);
+                }
+            });
+
+            for (error_code shard_error : errors) {
+                if ((error = shard_error)) {
+                    break;
+                }
+            }
+        }
+    }
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+    return set;
+}
+
+// Lines written by ObjectSpace.dump_all start with the address of their object, if they have one.
+static const std::string_view LINE_ADDRESS_PREFIX = "{\"address\":\"";
+
+// The address a dump line starts with, or 0, e.g. for ROOT lines. The address must be followed
+// by at least 16 readable bytes, which the padding of `dump_input` guarantees.
+static inline uint64_t line_address(std::string_view line) {
+    if (line.compare(0, LINE_ADDRESS_PREFIX.size(), LINE_ADDRESS_PREFIX) != 0) {
+        return 0;
+    }
+    const char *address = line.data() + LINE_ADDRESS_PREFIX.size();
+    const char *end = static_cast<const char *>(memchr(address, '"', line.data() + line.size() - address));
+    if (!end || end - address < 3 || address[0] != '0' || address[1] != 'x') {
+        return 0;
+    }
+    return parse_address(address, end - address);
+}
+
+// Call `callback(line)` for each line of `buffer`, including its newline, until it returns false.
+template <typename Callback>
+static bool each_line(std::string_view buffer, Callback callback) {
+    while (!buffer.empty()) {
+        size_t end = buffer.find('\n');
+        std::string_view line = buffer.substr(0, end == std::string_view::npos ? buffer.size() : end + 1);
+        buffer.remove_prefix(line.size());
+        if (!callback(line)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Output is handed to Ruby in chunks of about this size.
+static const size_t DIFF_CHUNK_SIZE = 1024 * 1024;
+
+// Buffers lines written to a Ruby IO from within `released_gvl::run`, so that the GVL is only reacquired once per chunk.
+class io_writer {
+  public:
+    io_writer(VALUE io, released_gvl &gvl) : io(io), gvl(gvl) {}
+
+    // Returns false if writing raised.
+    bool write(std::string_view line) {
+        chunk.append(line);
+        return chunk.size() < DIFF_CHUNK_SIZE || flush();
+    }
+
+    bool flush() {
+        if (chunk.empty() || gvl.stopped()) {
+            return !gvl.stopped();
+        }
+        bool written = gvl.with_gvl([&]() { rb_io_write(io, make_string(chunk)); });
+        chunk.clear();
+        return written;
+    }
+
+  private:
+    VALUE io;
+    released_gvl &gvl;
+    std::string chunk;
+};
+
+// Write to `io` the lines of the dump at `path` whose address isn't in `other`, in order, and return how many.
+// Lines aren't parsed, only their address is, so this mostly runs as fast as the dump can be read.
+static VALUE rb_heap_diff(VALUE self, VALUE path, VALUE other, VALUE io, VALUE batch_size) {
+    Check_Type(path, T_STRING);
+    Check_Type(batch_size, T_FIXNUM);
+    const address_set &excluded = *get_address_set(other);
+
+    size_t count = 0;
+    error_code error;
+    released_gvl gvl;
+    {
+        dump_input dump;
+        io_writer output(io, gvl);
+        if (!(error = dump.load(RSTRING_PTR(path), gvl))) {
+            gvl.run([&]() {
+                error = dump.each_window(dump.data(), FIX2INT(batch_size), gvl, [&](std::string_view window) {
+                    return each_line(window, [&](std::string_view line) {
+                        if (!gvl.check(true)) {
+                            return false;
+                        }
+                        uint64_t address = line_address(line);
+                        if (address && excluded.contains(address)) {
+                            return true;
+                        }
+                        count++;
+                        return output.write(line);
+                    });
+                });
+                if (!error) {
+                    output.flush();
+                }
+            });
+        }
+    }
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+    return SIZET2NUM(count);
+}
+
+// The address of a dump line, and where it starts in the dump.
+struct addressed_line {
+    uint64_t address;
+    uint64_t offset;
+};
+
+// The lines of `dump` that have an address, collected in parallel shards. The GVL must be released.
+static std::vector<addressed_line> addressed_lines(dump_input &dump, const parse_options &options, released_gvl &gvl) {
+    std::vector<std::string_view> shards = split_shards(dump, options.threads);
+    std::vector<std::vector<addressed_line>> results(shards.size());
+    const char *start = dump.data().data();
+
+    run_parallel(shards.size(), [&](size_t index) {
+        std::vector<addressed_line> &shard = results[index];
+        dump.each_window(shards[index], options.batch_size, gvl, [&](std::string_view window) {
+            return each_line(window, [&](std::string_view line) {
+                if (uint64_t address = line_address(line)) {
+                    shard.push_back({ address, static_cast<uint64_t>(line.data() - start) });
+                }
+                return gvl.check(index == 0);
+            });
+        });
+    });
+
+    std::vector<addressed_line> lines;
+    for (auto &shard : results) {
+        lines.insert(lines.end(), shard.begin(), shard.end());
+        std::vector<addressed_line>().swap(shard);
+    }
+    return lines;
+}
+
+// Write to `io`, in dump order, the lines of `dump` starting at `offsets`. Returns false if writing raised.
+static bool write_lines(const dump_input &dump, std::vector<uint64_t> &offsets, VALUE io, released_gvl &gvl, size_t threads) {
+    radix_sort(offsets, threads, [](uint64_t offset) { return offset; });
+    std::string_view data = dump.data();
+    io_writer output(io, gvl);
+    for (uint64_t offset : offsets) {
+        size_t end = data.find('\n', offset);
+        if (!output.write(data.substr(offset, end == std::string_view::npos ? std::string_view::npos : end + 1 - offset))) {
+            return false;
+        }
+    }
+    return output.flush();
+}
+
+// Compare two dumps with a merge-join of their lines sorted by address, rather than with a set of either one's addresses.
+// It takes 16 bytes per object of both dumps, and finds which objects of `after_path` were `added` since `before_path`,
+// which ones were `removed`, and which ones were `retained`. Their lines are written in dump order to the given
+// IOs, if any, and the number of each is returned. Lines without an address, like ROOT ones, are ignored.
+static VALUE rb_heap_compare(VALUE self, VALUE before_path, VALUE after_path, VALUE added_io, VALUE removed_io, VALUE retained_io,
+    VALUE batch_size, VALUE threads) {
+    Check_Type(before_path, T_STRING);
+    Check_Type(after_path, T_STRING);
+    parse_options options = get_parse_options(batch_size, threads, sym_dom);
+
+    size_t added_count = 0, removed_count = 0, retained_count = 0;
+    bool streamed = false;
+    error_code error;
+    released_gvl gvl;
+    {
+        dump_input before, after;
+        if (!(error = before.load(RSTRING_PTR(before_path), gvl)) && !(error = after.load(RSTRING_PTR(after_path), gvl))) {
+            streamed = !before.seekable() || !after.seekable();
+        }
+        if (!error && !streamed) {
+            gvl.run([&]() {
+                std::vector<addressed_line> before_lines = addressed_lines(before, options, gvl);
+                std::vector<addressed_line> after_lines = addressed_lines(after, options, gvl);
+                if (gvl.stopped()) {
+                    return;
+                }
+                auto address_of = [](const addressed_line &line) { return line.address; };
+                radix_sort(before_lines, options.threads, address_of);
+                radix_sort(after_lines, options.threads, address_of);
+
+                std::vector<uint64_t> added, removed, retained;
+                size_t before_index = 0, after_index = 0;
+                while (before_index < before_lines.size() || after_index < after_lines.size()) {
+                    if (after_index == after_lines.size() ||
+                        (before_index < before_lines.size() && before_lines[before_index].address < after_lines[after_index].address)) {
+                        removed.push_back(before_lines[before_index++].offset);
+                    } else if (before_index == before_lines.size() || after_lines[after_index].address < before_lines[before_index].address) {
+                        added.push_back(after_lines[after_index++].offset);
+                    } else {
+                        retained.push_back(after_lines[after_index++].offset);
+                        before_index++;
+                    }
+                }
+                std::vector<addressed_line>().swap(before_lines);
+                std::vector<addressed_line>().swap(after_lines);
+
+                added_count = added.size();
+                removed_count = removed.size();
+                retained_count = retained.size();
+                if (!NIL_P(added_io)) {
+                    write_lines(after, added, added_io, gvl, options.threads);
+                }
+                if (!NIL_P(removed_io) && !gvl.stopped()) {
+                    write_lines(before, removed, removed_io, gvl, options.threads);
+                }
+                if (!NIL_P(retained_io) && !gvl.stopped()) {
+                    write_lines(after, retained, retained_io, gvl, options.threads);
+                }
+            });
+        }
+    }
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+    if (streamed) {
+        rb_raise(rb_eArgError, "Only regular files can be compared");
+    }
+
+    VALUE result = rb_hash_new();
+    rb_hash_aset(result, sym_added, SIZET2NUM(added_count));
+    rb_hash_aset(result, sym_removed, SIZET2NUM(removed_count));
+    rb_hash_aset(result, sym_retained, SIZET2NUM(retained_count));
+    return result;
+}
+
+static const uint32_t NO_NODE = UINT32_MAX;
+
+// The dense ids of the groups an object belongs to, only tracked to aggregate retained memory, see `retention_keys`.
+// Class names and gems are only known once all class keys and files are, see `assign_groups`.
+enum retention_grouping {
+    RETAINED_BY_CLASS,
+    RETAINED_BY_FILE,
+    RETAINED_BY_LOCATION,
+    RETAINED_BY_GEM,
+    RETENTION_GROUPINGS,
+};
+typedef std::array<uint32_t, RETENTION_GROUPINGS> group_ids;
+static const uint32_t NO_GROUP = UINT32_MAX;
+static const group_ids NO_GROUPS = { NO_GROUP, NO_GROUP, NO_GROUP, NO_GROUP };
+
+// The object graph of a dump, in compressed sparse row form. Nodes are numbered densely in address order,
+// node 0 standing for the VM roots, i.e. the references of all the ROOT lines. The references of node `n` are
+// the nodes `edges[offsets[n]]` up to `edges[offsets[n + 1]]` excluded, so edges only take 4 bytes each,
+// and nodes 24 for their address, memsize and offset. References to objects missing from the dump are dropped.
+class object_graph {
+  public:
+    std::vector<uint64_t> addresses;
+    std::vector<uint64_t> memsizes;
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> edges;
+    std::vector<group_ids> groups; // Only filled when grouped, see `build_graph`.
+    // By node, once computed, see `compute_retention`. Unreachable nodes have no dominator.
+    std::vector<uint32_t> dominators;
+    std::vector<uint64_t> retained;
+
+    size_t size() const {
+        return addresses.size();
+    }
+
+    // The node of the object at `address`, or `NO_NODE` if it isn't in the dump.
+    uint32_t node(uint64_t address) const {
+        auto found = std::lower_bound(addresses.begin(), addresses.end(), address);
+        return found != addresses.end() && *found == address ? found - addresses.begin() : NO_NODE;
+    }
+
+    template <typename Callback>
+    void each_reference(uint32_t node, Callback callback) const {
+        for (uint64_t edge = offsets[node]; edge < offsets[node + 1]; edge++) {
+            callback(edges[edge]);
+        }
+    }
+
+    size_t memsize() const {
+        return sizeof(object_graph) + (addresses.capacity() + memsizes.capacity() + offsets.capacity()) * sizeof(uint64_t) +
+            (edges.capacity() + dominators.capacity()) * sizeof(uint32_t) + groups.capacity() * sizeof(group_ids) +
+            retained.capacity() * sizeof(uint64_t);
+    }
+};
+
+// The objects of a shard and their references, as parsed. References are kept by blocks of addresses, so that
+// once all the objects of the dump are known, each block can be resolved to nodes and released in turn. Blocks
+// take 32MB, which malloc always maps on their own, so that they're given back to the system once released.
+struct graph_shard {
+    static const size_t REFERENCE_BLOCK_SIZE = 1 << 22;
+
+    struct object {
+        uint64_t address;
+        uint64_t memsize;
+        uint64_t references_end; // They start where those of the previous object end.
+        uint64_t position; // Where its first edge goes in `object_graph::edges`.
+        uint32_t node;
+        uint32_t edge_count;
+    };
+
+    std::vector<object> objects;
+    std::vector<group_ids> groups; // By object, only when grouped.
+    std::vector<std::vector<uint64_t>> references;
+    std::vector<uint32_t> nodes; // The node of each reference once resolved, or `NO_NODE`.
+    uint64_t reference_count = 0;
+    error_code error = SUCCESS;
+
+    void process(const heap_object &object) {
+        if (object.address || object.type == "ROOT") {
+            for (uint64_t address : *object.references) {
+                if (references.empty() || references.back().size() == REFERENCE_BLOCK_SIZE) {
+                    references.emplace_back();
+                    references.back().reserve(REFERENCE_BLOCK_SIZE);
+                }
+                references.back().push_back(address);
+            }
+            reference_count += object.references->size();
+            objects.push_back({ object.address, object.memsize, reference_count, 0, NO_NODE, 0 });
+        }
+    }
+
+    void process(const heap_object &object, const group_ids &object_groups) {
+        if (object.address || object.type == "ROOT") {
+            process(object);
+            groups.push_back(object_groups);
+        }
+    }
+};
+
+// Build `graph` from the parsed shards, without the GVL, with the groups of each node if `grouped`.
+// Returns false if it has too many nodes to be numbered.
+static bool build_graph(object_graph &graph, std::vector<graph_shard> &shards, size_t threads, bool grouped = false) {
+    std::vector<uint64_t> &addresses = graph.addresses;
+    addresses.push_back(0);
+    for (graph_shard &shard : shards) {
+        for (auto &object : shard.objects) {
+            addresses.push_back(object.address);
+        }
+    }
+    radix_sort(addresses, threads, [](uint64_t address) { return address; });
+    addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+    addresses.shrink_to_fit();
+    if (addresses.size() >= NO_NODE) {
+        return false;
+    }
+
+    // Only 4 bytes per reference are left once resolved, before `graph.edges` takes as much again.
+    run_parallel(shards.size(), [&](size_t index) {
+        graph_shard &shard = shards[index];
+        shard.nodes.reserve(shard.reference_count);
+        for (std::vector<uint64_t> &block : shard.references) {
+            for (uint64_t address : block) {
+                shard.nodes.push_back(graph.node(address));
+            }
+            std::vector<uint64_t>().swap(block);
+        }
+        std::vector<std::vector<uint64_t>>().swap(shard.references);
+
+        uint64_t start = 0;
+        for (auto &object : shard.objects) {
+            object.node = graph.node(object.address);
+            for (uint64_t reference = start; reference < object.references_end; reference++) {
+                object.edge_count += shard.nodes[reference] != NO_NODE;
+            }
+            start = object.references_end;
+        }
+    });
+
+    // Objects are laid out in dump order, and the ROOT lines of all shards merged into node 0.
+    graph.memsizes.assign(graph.size(), 0);
+    graph.offsets.assign(graph.size() + 1, 0);
+    if (grouped) {
+        graph.groups.assign(graph.size(), NO_GROUPS);
+    }
+    for (graph_shard &shard : shards) {
+        for (size_t index = 0; index < shard.objects.size(); index++) {
+            const auto &object = shard.objects[index];
+            graph.memsizes[object.node] += object.memsize;
+            graph.offsets[object.node + 1] += object.edge_count;
+            if (grouped && shard.groups[index] != NO_GROUPS) {
+                graph.groups[object.node] = shard.groups[index];
+            }
+        }
+        std::vector<group_ids>().swap(shard.groups);
+    }
+    for (size_t node = 0; node < graph.size(); node++) {
+        graph.offsets[node + 1] += graph.offsets[node];
+    }
+    std::vector<uint64_t> next(graph.offsets.begin(), graph.offsets.end() - 1);
+    for (graph_shard &shard : shards) {
+        for (auto &object : shard.objects) {
+            object.position = next[object.node];
+            next[object.node] += object.edge_count;
+        }
+    }
+
+    graph.edges.resize(graph.offsets.back());
+    run_parallel(shards.size(), [&](size_t index) {
+        graph_shard &shard = shards[index];
+        uint64_t start = 0;
+        for (auto &object : shard.objects) {
+            uint64_t position = object.position;
+            for (uint64_t reference = start; reference < object.references_end; reference++) {
+                if (shard.nodes[reference] != NO_NODE) {
+                    graph.edges[position++] = shard.nodes[reference];
+                }
+            }
+            start = object.references_end;
+        }
+        std::vector<graph_shard::object>().swap(shard.objects);
+        std::vector<uint32_t>().swap(shard.nodes);
+    });
+    return true;
+}
+
+static void ObjectGraph_delete(void *graph) {
+    delete static_cast<object_graph *>(graph);
+}
+
+static size_t ObjectGraph_memsize(const void *graph) {
+    return static_cast<const object_graph *>(graph)->memsize();
+}
+
+static const rb_data_type_t object_graph_data_type = {
+    "ObjectGraph",
+    { 0, ObjectGraph_delete, ObjectGraph_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE object_graph_allocate(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &object_graph_data_type, new object_graph);
+}
+
+static inline object_graph * get_object_graph(VALUE self) {
+    object_graph *graph;
+    TypedData_Get_Struct(self, object_graph, &object_graph_data_type, graph);
+    return graph;
+}
+
+static inline uint32_t get_node(const object_graph &graph, VALUE address) {
+    return RB_INTEGER_TYPE_P(address) ? graph.node(NUM2ULL(address)) : NO_NODE;
+}
+
+static VALUE rb_heap_object_graph_size(VALUE self) {
+    return SIZET2NUM(get_object_graph(self)->size());
+}
+
+static VALUE rb_heap_object_graph_edge_count(VALUE self) {
+    return SIZET2NUM(get_object_graph(self)->edges.size());
+}
+
+static VALUE rb_heap_object_graph_include(VALUE self, VALUE address) {
+    return get_node(*get_object_graph(self), address) != NO_NODE ? Qtrue : Qfalse;
+}
+
+// The memsize of the object at `address`, or nil if it isn't in the dump.
+static VALUE rb_heap_object_graph_memsize_of(VALUE self, VALUE address) {
+    const object_graph &graph = *get_object_graph(self);
+    uint32_t node = get_node(graph, address);
+    return node == NO_NODE ? Qnil : ULL2NUM(graph.memsizes[node]);
+}
+
+// The addresses the object at `address` references, or nil if it isn't in the dump. The roots are at address 0.
+static VALUE rb_heap_object_graph_references(VALUE self, VALUE address) {
+    const object_graph &graph = *get_object_graph(self);
+    uint32_t node = get_node(graph, address);
+    if (node == NO_NODE) {
+        return Qnil;
+    }
+    VALUE references = rb_ary_new_capa(graph.offsets[node + 1] - graph.offsets[node]);
+    graph.each_reference(node, [&](uint32_t reference) {
+        rb_ary_push(references, ULL2NUM(graph.addresses[reference]));
+    });
+    return references;
+}
+
+static VALUE rb_heap_object_graph(VALUE self, VALUE path, VALUE batch_size, VALUE threads, VALUE api) {
+    Check_Type(path, T_STRING);
+    parse_options options = get_parse_options(batch_size, threads, api);
+    options.references = true;
+
+    VALUE result = object_graph_allocate(rb_cHeapProfilerObjectGraph);
+    object_graph &graph = *get_object_graph(result);
+
+    bool too_large = false;
+    error_code error;
+    released_gvl gvl;
+    {
+        dump_input dump;
+        if (!(error = dump.load(RSTRING_PTR(path), gvl))) {
+            std::vector<std::string_view> shards = split_shards(dump, options.threads);
+            std::vector<graph_shard> results(shards.size());
+
+            parser_lease parser(self);
+            gvl.run([&]() {
+                run_sharded(*parser, shards.size(), [&](size_t index, heap_parser &shard_parser) {
+                    graph_shard &shard = results[index];
+                    shard.error = each_heap_object(shard_parser, options, dump, shards[index], gvl, index == 0, [&](heap_object &object) {
+                        shard.process(object);
+                        return true;
+                    });
+                });
+                for (graph_shard &shard : results) {
+                    if ((error = shard.error)) {
+                        return;
+                    }
+                }
+                if (!gvl.stopped()) {
+                    too_large = !build_graph(graph, results, options.threads);
+                }
+            });
+        }
+    }
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+    if (too_large) {
+        rb_raise(rb_eHeapProfilerCapacityError, "This heap dump has too many objects to build its graph");
+    }
+    return result;
+}
+
+// The referrers of each object of a dump, i.e. its object graph with the edges reversed, to find out why objects
+// are retained. It also keeps the class of each object, where its line starts in the dump, and the kind of root
+// that references it if any, e.g. `vm`, so that queries are answered without parsing the dump again.
+//
+// It's laid out the way it's saved in its sidecar, e.g. `allocated.heap.hpref`: a header, arrays by node in
+// address order, node 0 being the roots, the objects referenced by ROOT lines, and the kinds of roots separated
+// by newlines. A saved index is memory mapped rather than read, so a query only loads the pages it touches.
+static const char REFERRER_INDEX_MAGIC[8] = { 'H', 'P', 'R', 'E', 'F', 0, 0, 0 };
+static const uint32_t REFERRER_INDEX_VERSION = 2;
+static const uint64_t NO_LINE = UINT64_MAX;
+
+struct referrer_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    dump_fingerprint dump;
+    uint64_t node_count;
+    uint64_t edge_count;
+    uint64_t root_count;
+    uint64_t names_size;
+};
+
+// An object referenced by a ROOT line, and the kind of that root, as an index in `referrer_index::root_names`.
+struct root_entry {
+    uint32_t node;
+    uint32_t name;
+};
+
+static inline uint64_t align_to_words(uint64_t size) {
+    return (size + 7) & ~uint64_t(7);
+}
+
+class referrer_index {
+  public:
+    referrer_index_header header = {};
+    const uint64_t *addresses = nullptr;
+    const uint64_t *classes = nullptr; // 0 for objects without a class.
+    const uint64_t *lines = nullptr; // `NO_LINE` for the roots.
+    // The referrers of node `n` are `referrers[offsets[n]]` up to `referrers[offsets[n + 1]]` excluded, in node order.
+    const uint64_t *offsets = nullptr;
+    const uint32_t *referrers = nullptr;
+    const root_entry *roots = nullptr; // By node, only the first root of each object is kept.
+    std::vector<std::string_view> root_names;
+
+    referrer_index() = default;
+    referrer_index(const referrer_index &) = delete;
+    referrer_index &operator=(const referrer_index &) = delete;
+
+    ~referrer_index() {
+#ifdef HAVE_SYS_MMAN_H
+        if (mapping) {
+            munmap(mapping, data.size());
+        }
+#endif
+    }
+
+    size_t size() const {
+        return header.node_count;
+    }
+
+    // Allocate and attach the zeroed storage of an index with the given layout, see `build_referrer_index`.
+    char * allocate(const referrer_index_header &layout) {
+        storage.assign(align_to_words(layout_size(layout)) / sizeof(uint64_t), 0);
+        char *data = reinterpret_cast<char *>(storage.data());
+        memcpy(data, &layout, sizeof(layout));
+        attach(data, layout_size(layout));
+        return data;
+    }
+
+    // Use the index saved in `data`, which stays mapped until the index is deleted.
+    bool map(void *data, size_t size) {
+        mapping = data;
+        return attach(static_cast<const char *>(data), size);
+    }
+
+    // Point into `layout`, a header followed by the arrays it describes. Returns false if their sizes don't add up.
+    bool attach(const char *layout, size_t size) {
+        data = std::string_view(layout, size);
+        if (size < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, layout, sizeof(header));
+        // Bounding the counts by the size first, so that the layout size can't overflow.
+        if (header.node_count == 0 || header.node_count > size || header.edge_count > size || header.root_count > size ||
+            header.names_size > size || layout_size(header) != size) {
+            return false;
+        }
+
+        const char *cursor = layout + sizeof(header);
+        auto take = [&](uint64_t bytes) {
+            const char *start = cursor;
+            cursor += align_to_words(bytes);
+            return start;
+        };
+        addresses = reinterpret_cast<const uint64_t *>(take(header.node_count * sizeof(uint64_t)));
+        classes = reinterpret_cast<const uint64_t *>(take(header.node_count * sizeof(uint64_t)));
+        lines = reinterpret_cast<const uint64_t *>(take(header.node_count * sizeof(uint64_t)));
+        offsets = reinterpret_cast<const uint64_t *>(take((header.node_count + 1) * sizeof(uint64_t)));
+        referrers = reinterpret_cast<const uint32_t *>(take(header.edge_count * sizeof(uint32_t)));
+        roots = reinterpret_cast<const root_entry *>(take(header.root_count * sizeof(root_entry)));
+
+        std::string_view names(cursor, header.names_size);
+        root_names.clear();
+        while (!names.empty()) {
+            size_t end = std::min(names.find('\n'), names.size());
+            root_names.push_back(names.substr(0, end));
+            names.remove_prefix(std::min(end + 1, names.size()));
+        }
+        return true;
+    }
+
+    // The whole index, as saved in its sidecar.
+    std::string_view layout() const {
+        return data;
+    }
+
+    size_t memsize() const {
+        return sizeof(referrer_index) + storage.capacity() * sizeof(uint64_t) + root_names.capacity() * sizeof(std::string_view);
+    }
+
+    // The node of the object at `address`, or `NO_NODE` if it isn't in the dump.
+    uint32_t node(uint64_t address) const {
+        const uint64_t *end = addresses + size();
+        const uint64_t *found = std::lower_bound(addresses, end, address);
+        return found != end && *found == address ? found - addresses : NO_NODE;
+    }
+
+    // Saved indexes are only checked as they are read, so that loading them doesn't have to go through them.
+    template <typename Callback>
+    void each_referrer(uint32_t node, Callback callback) const {
+        uint64_t start = offsets[node], end = offsets[node + 1];
+        if (start > end || end > header.edge_count) {
+            return;
+        }
+        for (uint64_t edge = start; edge < end; edge++) {
+            if (referrers[edge] < size()) {
+                callback(referrers[edge]);
+            }
+        }
+    }
+
+    // The kind of the first ROOT line that references `node`, if any.
+    const std::string_view * root_name(uint32_t node) const {
+        const root_entry *end = roots + header.root_count;
+        const root_entry *found = std::lower_bound(roots, end, node, [](const root_entry &entry, uint32_t node) { return entry.node < node; });
+        if (found == end || found->node != node || found->name >= root_names.size()) {
+            return nullptr;
+        }
+        return &root_names[found->name];
+    }
+
+    // The shortest chain of references from the roots to any of `targets`, from the object a root references
+    // down to the target, or nothing if none is reachable. It's a breadth-first search over the referrers of the
+    // targets, so it only visits the objects they are reachable from, and stops at the first one a root references.
+    std::vector<uint32_t> retention_path(const std::vector<uint32_t> &targets) const {
+        std::unordered_map<uint32_t, uint32_t> next; // The node one step closer to the targets.
+        std::vector<uint32_t> queue;
+        for (uint32_t target : targets) {
+            if (target != 0 && next.emplace(target, NO_NODE).second) {
+                queue.push_back(target);
+            }
+        }
+
+        for (size_t index = 0; index < queue.size(); index++) {
+            uint32_t node = queue[index];
+            bool rooted = false;
+            each_referrer(node, [&](uint32_t referrer) {
+                if (referrer == 0) {
+                    rooted = true;
+                } else if (next.emplace(referrer, node).second) {
+                    queue.push_back(referrer);
+                }
+            });
+            if (rooted) {
+                std::vector<uint32_t> path;
+                for (uint32_t step = node; step != NO_NODE; step = next[step]) {
+                    path.push_back(step);
+                }
+                return path;
+            }
+        }
+        return {};
+    }
+
+  private:
+    std::vector<uint64_t> storage;
+    void *mapping = nullptr;
+    std::string_view data;
+
+    static uint64_t layout_size(const referrer_index_header &header) {
+        return sizeof(header) + align_to_words((header.node_count * 4 + 1) * sizeof(uint64_t)) +
+            align_to_words(header.edge_count * sizeof(uint32_t)) + align_to_words(header.root_count * sizeof(root_entry)) + header.names_size;
+    }
+};
+
+// What a shard collects for its referrer index, besides its object graph.
+struct referrer_shard {
+    std::vector<std::pair<uint64_t, uint64_t>> classes; // By address.
+    std::vector<std::pair<uint64_t, uint32_t>> roots; // The addresses ROOT lines reference, and their kind in `root_names`.
+    std::vector<std::string> root_names;
+
+    void process(const heap_object &object) {
+        if (object.address && object.has_class) {
+            classes.emplace_back(object.address, object.class_address);
+        } else if (object.type == "ROOT") {
+            auto found = std::find(root_names.begin(), root_names.end(), object.root);
+            uint32_t name = found - root_names.begin();
+            if (found == root_names.end()) {
+                root_names.emplace_back(object.root);
+            }
+            for (uint64_t address : *object.references) {
+                roots.emplace_back(address, name);
+            }
+        }
+    }
+};
+
+// Fill `index` from the graph of a dump, the classes and roots its shards collected, and its addressed `lines`,
+// in dump order. The graph is released as it's transposed. The GVL must be released.
+static void build_referrer_index(referrer_index &index, object_graph &graph, std::vector<referrer_shard> &shards,
+    const std::vector<addressed_line> &lines) {
+    std::string names;
+    std::vector<root_entry> roots;
+    std::vector<std::string> root_names;
+    for (referrer_shard &shard : shards) {
+        std::vector<uint32_t> ids;
+        for (const std::string &name : shard.root_names) {
+            ids.push_back(std::find(root_names.begin(), root_names.end(), name) - root_names.begin());
+            if (ids.back() == root_names.size()) {
+                root_names.push_back(name);
+                names.append(name);
+                names.push_back('\n');
+            }
+        }
+        for (auto &root : shard.roots) {
+            uint32_t node = graph.node(root.first);
+            if (node != NO_NODE && node != 0) {
+                roots.push_back({ node, ids[root.second] });
+            }
+        }
+        std::vector<std::pair<uint64_t, uint32_t>>().swap(shard.roots);
+    }
+    std::stable_sort(roots.begin(), roots.end(), [](const root_entry &left, const root_entry &right) { return left.node < right.node; });
+    roots.erase(std::unique(roots.begin(), roots.end(), [](const root_entry &left, const root_entry &right) { return left.node == right.node; }), roots.end());
+
+    referrer_index_header layout = {};
+    memcpy(layout.magic, REFERRER_INDEX_MAGIC, sizeof(layout.magic));
+    layout.version = REFERRER_INDEX_VERSION;
+    layout.node_count = graph.size();
+    layout.edge_count = graph.edges.size();
+    layout.root_count = roots.size();
+    layout.names_size = names.size();
+
+    char *data = index.allocate(layout);
+    uint64_t *addresses = const_cast<uint64_t *>(index.addresses);
+    uint64_t *classes = const_cast<uint64_t *>(index.classes);
+    uint64_t *line_offsets = const_cast<uint64_t *>(index.lines);
+    uint64_t *offsets = const_cast<uint64_t *>(index.offsets);
+    uint32_t *referrers = const_cast<uint32_t *>(index.referrers);
+
+    std::copy(graph.addresses.begin(), graph.addresses.end(), addresses);
+    for (referrer_shard &shard : shards) {
+        for (auto &object : shard.classes) {
+            uint32_t node = graph.node(object.first);
+            if (node != NO_NODE) {
+                classes[node] = object.second;
+            }
+        }
+        std::vector<std::pair<uint64_t, uint64_t>>().swap(shard.classes);
+    }
+    std::fill(line_offsets, line_offsets + graph.size(), NO_LINE);
+    for (const addressed_line &line : lines) {
+        uint32_t node = graph.node(line.address);
+        if (node != NO_NODE && line_offsets[node] == NO_LINE) {
+            line_offsets[node] = line.offset;
+        }
+    }
+
+    // Referrers are laid out in node order, so the roots come first.
+    for (uint32_t edge : graph.edges) {
+        offsets[edge + 1]++;
+    }
+    for (size_t node = 0; node < graph.size(); node++) {
+        offsets[node + 1] += offsets[node];
+    }
+    std::vector<uint64_t> next(offsets, offsets + graph.size());
+    for (uint32_t node = 0; node < graph.size(); node++) {
+        graph.each_reference(node, [&](uint32_t reference) {
+            referrers[next[reference]++] = node;
+        });
+    }
+    graph = object_graph();
+
+    std::copy(roots.begin(), roots.end(), const_cast<root_entry *>(index.roots));
+    memcpy(data + index.layout().size() - names.size(), names.data(), names.size());
+    index.attach(data, index.layout().size());
+}
+
+static void ReferrerIndex_delete(void *index) {
+    delete static_cast<referrer_index *>(index);
+}
+
+static size_t ReferrerIndex_memsize(const void *index) {
+    return static_cast<const referrer_index *>(index)->memsize();
+}
+
+static const rb_data_type_t referrer_index_data_type = {
+    "ReferrerIndex",
+    { 0, ReferrerIndex_delete, ReferrerIndex_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE referrer_index_allocate(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &referrer_index_data_type, new referrer_index);
+}
+
+static inline referrer_index * get_referrer_index(VALUE self) {
+    referrer_index *index;
+    TypedData_Get_Struct(self, referrer_index, &referrer_index_data_type, index);
+    return index;
+}
+
+static inline uint32_t get_node(const referrer_index &index, VALUE address) {
+    return RB_INTEGER_TYPE_P(address) ? index.node(NUM2ULL(address)) : NO_NODE;
+}
+
+static VALUE rb_heap_referrer_index_size(VALUE self) {
+    return SIZET2NUM(get_referrer_index(self)->size());
+}
+
+// The addresses of the objects referencing the object at `address`, or nil if it isn't in the dump.
+// Objects referenced by ROOT lines are referenced by address 0.
+static VALUE rb_heap_referrer_index_referrers(VALUE self, VALUE address) {
+    const referrer_index &index = *get_referrer_index(self);
+    uint32_t node = get_node(index, address);
+    if (node == NO_NODE) {
+        return Qnil;
+    }
+    VALUE referrers = rb_ary_new();
+    index.each_referrer(node, [&](uint32_t referrer) {
+        rb_ary_push(referrers, ULL2NUM(index.addresses[referrer]));
+    });
+    return referrers;
+}
+
+// Where the line of the object at `address` starts in the dump, or nil if it isn't in the dump.
+static VALUE rb_heap_referrer_index_line_offset(VALUE self, VALUE address) {
+    const referrer_index &index = *get_referrer_index(self);
+    uint32_t node = get_node(index, address);
+    return node == NO_NODE || index.lines[node] == NO_LINE ? Qnil : ULL2NUM(index.lines[node]);
+}
+
+// The kind of the first ROOT line referencing the object at `address`, e.g. "vm", or nil if none does.
+static VALUE rb_heap_referrer_index_root_of(VALUE self, VALUE address) {
+    const referrer_index &index = *get_referrer_index(self);
+    uint32_t node = get_node(index, address);
+    const std::string_view *name = node == NO_NODE ? nullptr : index.root_name(node);
+    return name ? make_string(*name) : Qnil;
+}
+
+static VALUE make_retention_path(const referrer_index &index, const std::vector<uint32_t> &targets) {
+    std::vector<uint32_t> path = index.retention_path(targets);
+    if (path.empty()) {
+        return Qnil;
+    }
+    VALUE addresses = rb_ary_new_capa(path.size());
+    for (uint32_t node : path) {
+        rb_ary_push(addresses, ULL2NUM(index.addresses[node]));
+    }
+    return addresses;
+}
+
+// The addresses of the shortest chain of references from a ROOT line to one of the objects at `addresses`,
+// starting with the object the root references and ending with the target. Nil if none is reachable.
+static VALUE rb_heap_referrer_index_retention_path(VALUE self, VALUE addresses) {
+    Check_Type(addresses, T_ARRAY);
+    const referrer_index &index = *get_referrer_index(self);
+    std::vector<uint32_t> targets;
+    for (long i = 0; i < RARRAY_LEN(addresses); i++) {
+        uint32_t node = get_node(index, RARRAY_AREF(addresses, i));
+        if (node != NO_NODE) {
+            targets.push_back(node);
+        }
+    }
+    return make_retention_path(index, targets);
+}
+
+// Same as `retention_path`, to the closest instance of any of the classes at `class_addresses`.
+static VALUE rb_heap_referrer_index_retention_path_to_instances(VALUE self, VALUE class_addresses) {
+    Check_Type(class_addresses, T_ARRAY);
+    const referrer_index &index = *get_referrer_index(self);
+    std::unordered_set<uint64_t> classes;
+    for (long i = 0; i < RARRAY_LEN(class_addresses); i++) {
+        VALUE address = RARRAY_AREF(class_addresses, i);
+        if (RB_INTEGER_TYPE_P(address)) {
+            classes.insert(NUM2ULL(address));
+        }
+    }
+    std::vector<uint32_t> targets;
+    for (uint32_t node = 1; node < index.size(); node++) {
+        if (index.classes[node] && classes.count(index.classes[node])) {
+            targets.push_back(node);
+        }
+    }
+    return make_retention_path(index, targets);
+}
+
+static VALUE rb_heap_referrer_index(VALUE self, VALUE path, VALUE batch_size, VALUE threads, VALUE api) {
+    Check_Type(path, T_STRING);
+    parse_options options = get_parse_options(batch_size, threads, api);
+    options.references = true;
+
+    VALUE result = referrer_index_allocate(rb_cHeapProfilerReferrerIndex);
+    referrer_index &index = *get_referrer_index(result);
+
+    bool too_large = false, streamed = false;
+    error_code error;
+    released_gvl gvl;
+    {
+        dump_input dump;
+        if (!(error = dump.load(RSTRING_PTR(path), gvl)) && !(streamed = !dump.seekable())) {
+            std::vector<std::string_view> shards = split_shards(dump, options.threads);
+            std::vector<graph_shard> graphs(shards.size());
+            std::vector<referrer_shard> results(shards.size());
+
+            parser_lease parser(self);
+            gvl.run([&]() {
+                run_sharded(*parser, shards.size(), [&](size_t index, heap_parser &shard_parser) {
+                    graph_shard &shard = graphs[index];
+                    shard.error = each_heap_object(shard_parser, options, dump, shards[index], gvl, index == 0, [&](heap_object &object) {
+                        shard.process(object);
+                        results[index].process(object);
+                        return true;
+                    });
+                });
+                for (graph_shard &shard : graphs) {
+                    if ((error = shard.error)) {
+                        return;
+                    }
+                }
+                if (gvl.stopped()) {
+                    return;
+                }
+                object_graph graph;
+                if ((too_large = !build_graph(graph, graphs, options.threads))) {
+                    return;
+                }
+                std::vector<addressed_line> lines = addressed_lines(dump, options, gvl);
+                if (!gvl.stopped()) {
+                    build_referrer_index(index, graph, results, lines);
+                }
+            });
+        }
+    }
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+    if (streamed) {
+        rb_raise(rb_eArgError, "Only regular files can be indexed");
+    }
+    if (too_large) {
+        rb_raise(rb_eHeapProfilerCapacityError, "This heap dump has too many objects to build its graph");
+    }
+    return result;
+}
+
+// The referrer index saved in `cache_path` for the dump at `path`, or nil if it's missing or stale.
+static VALUE rb_heap_load_referrer_index(VALUE self, VALUE path, VALUE cache_path) {
+    Check_Type(path, T_STRING);
+    Check_Type(cache_path, T_STRING);
+#ifdef HAVE_SYS_MMAN_H
+    dump_fingerprint expected;
+    if (!fingerprint_dump(RSTRING_PTR(path), expected)) {
+        return Qnil;
+    }
+
+    size_t size;
+    void *address = map_sidecar(RSTRING_PTR(cache_path), sizeof(referrer_index_header), size);
+    if (address == MAP_FAILED) {
+        return Qnil;
+    }
+    referrer_index_header header;
+    memcpy(&header, address, sizeof(header));
+    if (memcmp(header.magic, REFERRER_INDEX_MAGIC, sizeof(header.magic)) || header.version != REFERRER_INDEX_VERSION ||
+        !(header.dump == expected)) {
+        munmap(address, size);
+        return Qnil;
+    }
+
+    VALUE result = referrer_index_allocate(rb_cHeapProfilerReferrerIndex);
+    if (!get_referrer_index(result)->map(address, size)) {
+        return Qnil;
+    }
+    return result;
+#else
+    return Qnil;
+#endif
+}
+
+// Save `index`, built from the dump at `path`, to `cache_path`. Returns false if it couldn't be saved.
+static VALUE rb_heap_save_referrer_index(VALUE self, VALUE path, VALUE cache_path, VALUE index) {
+    Check_Type(path, T_STRING);
+    Check_Type(cache_path, T_STRING);
+    std::string_view layout = get_referrer_index(index)->layout();
+#ifdef HAVE_SYS_MMAN_H
+    referrer_index_header header = get_referrer_index(index)->header;
+    if (layout.size() < sizeof(header) || !fingerprint_dump(RSTRING_PTR(path), header.dump)) {
+        return Qfalse;
+    }
+    return write_sidecar(cache_path, {
+        std::string_view(reinterpret_cast<const char *>(&header), sizeof(header)),
+        layout.substr(sizeof(header)),
+    }) ? Qtrue : Qfalse;
+#else
+    return Qfalse;
+#endif
+}
+
+// Parsed objects waiting to be yielded, with copies of the strings that would otherwise be
+// overwritten by the parser.
+struct objects_shard {
+    std::vector<heap_object> objects;
+    string_arena strings;
+    error_code error = SUCCESS;
+
+    void push(heap_object object) {
+        object.type = strings.intern(object.type);
+        object.imemo_type = strings.intern(object.imemo_type);
+        object._struct = strings.intern(object._struct);
+        object.file = strings.intern(object.file);
+        object.name = strings.copy(object.name);
+        object.value = strings.copy(object.value);
+        object.edge_name = strings.intern(object.edge_name);
+        objects.push_back(object);
+    }
+
+    void clear() {
+        objects.clear();
+        strings.clear();
+    }
+};
+
+// Without sharding, objects are yielded by batches of this size, each time reacquiring the GVL.
+static const size_t YIELD_BATCH_SIZE = 1024;
+
+// With sharding, the dump is parsed by rounds of a window of about this many bytes per shard, so that only
+// that much of it is held as native records at a time, however large it is.
+static const size_t YIELD_ROUND_SIZE = 4 * 1024 * 1024;
+
+// Remove the next `count` windows of about `size` bytes from `buffer`, each ending at the end of a line.
+static std::vector<std::string_view> next_windows(std::string_view &buffer, size_t count, size_t size) {
+    std::vector<std::string_view> windows;
+    while (windows.size() < count && !buffer.empty()) {
+        size_t end = buffer.size();
+        if (size < buffer.size()) {
+            end = buffer.find('\n', size - 1);
+            end = end == std::string_view::npos ? buffer.size() : end + 1;
+        }
+        windows.push_back(buffer.substr(0, end));
+        buffer.remove_prefix(end);
+    }
+    return windows;
+}
+
+static VALUE rb_heap_load_many(VALUE self, VALUE arg, VALUE since, VALUE batch_size, VALUE threads, VALUE api)
+{
+    Check_Type(arg, T_STRING);
+    parse_options options = get_parse_options(batch_size, threads, api);
+    int64_t generation = get_generation(since);
+
+    error_code error;
+    released_gvl gvl;
+    object_cache cache;
+    {
+        dump_input dump;
+        if (!(error = dump.load(RSTRING_PTR(arg), gvl))) {
+            std::vector<std::string_view> shards = split_shards(dump, options.threads);
+            std::vector<objects_shard> results(shards.size());
+            parser_lease parser(self);
+
+            if (shards.size() <= 1) {
+                objects_shard &batch = results[0];
+                auto yield_batch = [&]() {
+                    for (const heap_object &object : batch.objects) {
+                        rb_yield(make_ruby_object(object, cache));
+                    }
+                };
+                gvl.run([&]() {
+                    error = each_heap_object(*parser, options, dump, shards[0], gvl, true, [&](heap_object &object) {
+                        if (skip_object(object, generation)) {
+                            return true;
+                        }
+                        batch.push(object);
+                        if (batch.objects.size() < YIELD_BATCH_SIZE) {
+                            return true;
+                        }
+                        bool more = gvl.with_gvl(yield_batch);
+                        batch.clear();
+                        return more;
+                    });
+                    if (!error && !gvl.stopped()) {
+                        gvl.with_gvl(yield_batch);
+                    }
+                });
+            } else {
+                // Ruby objects can only be created from the Ruby thread, so each round, the next windows of the dump
+                // are parsed in parallel into compact native records, and then yielded in file order.
+                std::string_view rest = dump.data();
+                std::vector<heap_parser> shard_parsers(results.size() - 1);
+                auto yield_round = [&]() {
+                    for (objects_shard &shard : results) {
+                        if ((error = shard.error)) {
+                            return;
+                        }
+                        for (const heap_object &object : shard.objects) {
+                            rb_yield(make_ruby_object(object, cache));
+                        }
+                    }
+                };
+                gvl.run([&]() {
+                    while (!rest.empty() && !error && !gvl.stopped()) {
+                        std::vector<std::string_view> windows = next_windows(rest, results.size(), YIELD_ROUND_SIZE);
+                        for (objects_shard &shard : results) {
+                            shard.clear();
+                        }
+                        run_parallel(windows.size(), [&](size_t index) {
+                            objects_shard &shard = results[index];
+                            heap_parser &shard_parser = index == 0 ? *parser : shard_parsers[index - 1];
+                            shard.error = each_heap_object(shard_parser, options, dump, windows[index], gvl, index == 0, [&](heap_object &object) {
+                                if (!skip_object(object, generation)) {
+                                    shard.push(object);
+                                }
+                                return true;
+                            });
+                        });
+                        if (!gvl.stopped()) {
+                            gvl.with_gvl(yield_round);
+                        }
+                    }
+                });
+            }
+        }
+    }
+
+    RB_GC_GUARD(cache.symbols.values);
+    RB_GC_GUARD(cache.files.values);
+
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+    return Qnil;
+}
+
+struct object_stats {
+    uint64_t count = 0;
+    uint64_t memsize = 0;
+
+    inline void add(uint64_t object_memsize) {
+        count++;
+        memsize += object_memsize;
+    }
+
+    inline void merge(const object_stats &other) {
+        count += other.count;
+        memsize += other.memsize;
+    }
+};
+
+// Everything `Index#guess_class` needs to resolve a class name, so names can be
+// resolved once per distinct key rather than once per object.
+struct class_key {
+    std::string_view type;
+    std::string_view imemo_type;
+    std::string_view _struct;
+    uint64_t class_address;
+    bool has_class;
+
+    bool operator==(const class_key &other) const {
+        return type == other.type && imemo_type == other.imemo_type && _struct == other._struct &&
+            class_address == other.class_address && has_class == other.has_class;
+    }
+};
+
+struct class_key_hash {
+    size_t operator()(const class_key &key) const {
+        std::hash<std::string_view> hash;
+        return hash(key.type) ^ (hash(key.imemo_type) << 1) ^ (hash(key._struct) << 2) ^ std::hash<uint64_t>()(key.class_address);
+    }
+};
+
+struct location_key {
+    std::string_view file;
+    uint64_t line;
+};
+
+// Locations are packed into a single integer, the id of their file in the high half and their line in the low
+// one, so that they can be counted without hashing nor copying their file again for each table.
+typedef uint64_t packed_location;
+
+static const packed_location NO_LOCATION = UINT64_MAX;
+
+static packed_location pack_location(uint32_t file, uint64_t line) {
+    return static_cast<uint64_t>(file) << 32 | static_cast<uint32_t>(line);
+}
+
+// Dense ids for the files of objects, interned to an arena.
+class file_ids {
+  public:
+    std::vector<std::string_view> names; // By file id.
+
+    uint32_t id(std::string_view file, string_arena &arena) {
+        auto found = ids.find(file);
+        if (found != ids.end()) {
+            return found->second;
+        }
+        names.push_back(arena.intern(file));
+        return ids.emplace(names.back(), names.size() - 1).first->second;
+    }
+
+    // The ids in this table of the files of `other`.
+    std::vector<uint32_t> merge(const file_ids &other, string_arena &arena) {
+        std::vector<uint32_t> remap;
+        remap.reserve(other.names.size());
+        for (std::string_view file : other.names) {
+            remap.push_back(id(file, arena));
+        }
+        return remap;
+    }
+
+    location_key unpack(packed_location location) const {
+        return { names[location >> 32], location & UINT32_MAX };
+    }
+
+  private:
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+// `location` with its file id rewritten by `remap`, as returned by `file_ids::merge`.
+static packed_location remap_location(packed_location location, const std::vector<uint32_t> &remap) {
+    return pack_location(remap[location >> 32], location & UINT32_MAX);
+}
+
+// Object stats keyed by integers, such as packed locations, in a flat open addressing table kept at most half full.
+// UINT64_MAX isn't a valid key.
+class stats_table {
+  public:
+    object_stats & operator[](uint64_t key) {
+        if (2 * (count + 1) > slots.size()) {
+            grow();
+        }
+        size_t index = find(slots, key);
+        if (slots[index].key == EMPTY) {
+            slots[index].key = key;
+            count++;
+        }
+        return slots[index].stats;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Call `callback(key, stats)` for each key, in no particular order.
+    template <typename Callback>
+    void each(Callback callback) const {
+        for (const slot &entry : slots) {
+            if (entry.key != EMPTY) {
+                callback(entry.key, entry.stats);
+            }
+        }
+    }
+
+  private:
+    static const uint64_t EMPTY = UINT64_MAX;
+
+    struct slot {
+        uint64_t key = EMPTY;
+        object_stats stats;
+    };
+
+    std::vector<slot> slots;
+    size_t count = 0;
+
+    // Keys are made of small dense ids, so they're mixed like addresses in `class_names`.
+    static size_t find(const std::vector<slot> &table, uint64_t key) {
+        size_t mask = table.size() - 1;
+        size_t index = (key * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+        while (table[index].key != EMPTY && table[index].key != key) {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    void grow() {
+        std::vector<slot> previous(std::max<size_t>(16, 2 * slots.size()));
+        previous.swap(slots);
+        for (const slot &entry : previous) {
+            if (entry.key != EMPTY) {
+                slots[find(slots, entry.key)] = entry;
+            }
+        }
+    }
+};
+
+// The heaviest keys of a stream in bounded memory, with the Space-Saving algorithm: at most `capacity` keys are
+// counted, and once they all are, a new key takes the counter with the lowest `metric`, whose stats it inherits
+// as its error. Estimates of `metric` are thus never below the true value, and at most their error above it, and
+// any key whose true value exceeds the lowest estimate is counted. The other metric is only a rough estimate.
+//
+// Summaries of shards are merged by adding the lowest estimate of a full summary, which any key it doesn't
+// count may have reached, to the keys of the other summary it doesn't count, so that the bounds still hold.
+//
+// Counters are kept in a min-heap of their estimates, which holds a copy of them so that it can be reordered
+// without reading the counters, and found by key through an open addressing table of their hashes. `Hash` must
+// hash the keys the same way as what they're looked up with, e.g. `string_prefix` keys and their `lookup`.
+template <typename Key, typename Hash = std::hash<Key>>
+class space_saving {
+  public:
+    struct counter {
+        Key key;
+        object_stats stats;
+        object_stats error;
+    };
+
+    std::vector<counter> counters; // In no particular order.
+
+    space_saving(size_t capacity, uint64_t object_stats::*metric) : capacity(capacity), metric(metric) {}
+
+    template <typename Lookup>
+    void add(const Lookup &key, uint64_t memsize) {
+        size_t hash = Hash()(key);
+        if (2 * (counters.size() + 1) > slots.size() && counters.size() < capacity) {
+            grow_slots();
+        }
+        size_t slot = find(key, hash);
+        size_t index;
+        if (slots[slot].index) {
+            index = slots[slot].index - 1;
+        } else if (counters.size() < capacity) {
+            index = counters.size();
+            counters.push_back({ Key(key), object_stats(), object_stats() });
+            slots[slot] = { hash, index + 1 };
+            positions.push_back(heap.size());
+            heap.push_back({ 0, index });
+            sift_up(positions[index]);
+        } else {
+            index = heap[0].index;
+            erase(index);
+            counters[index].key = key;
+            counters[index].error = counters[index].stats;
+            slots[find(key, hash)] = { hash, index + 1 };
+        }
+        counters[index].stats.add(memsize);
+        heap[positions[index]].estimate = counters[index].stats.*metric;
+        sift_down(positions[index]);
+    }
+
+    // Merge the counters of `other`, whose keys are rewritten to ours by `remap`, e.g. packed locations.
+    template <typename Remap>
+    void merge(const space_saving &other, Remap remap) {
+        object_stats own_floor = floor(), other_floor = other.floor();
+        size_t own_size = counters.size();
+        std::vector<bool> counted(own_size);
+        for (const counter &entry : other.counters) {
+            Key key = remap(entry.key);
+            size_t slot = slots.empty() ? 0 : find(key, Hash()(key));
+            if (!slots.empty() && slots[slot].index) {
+                counter &own = counters[slots[slot].index - 1];
+                counted[slots[slot].index - 1] = true;
+                own.stats.merge(entry.stats);
+                own.error.merge(entry.error);
+            } else {
+                counters.push_back({ key, own_floor, own_floor });
+                counters.back().stats.merge(entry.stats);
+                counters.back().error.merge(entry.error);
+            }
+        }
+        for (size_t index = 0; index < own_size; index++) {
+            if (!counted[index]) {
+                counters[index].stats.merge(other_floor);
+                counters[index].error.merge(other_floor);
+            }
+        }
+        if (counters.size() > capacity) {
+            std::nth_element(counters.begin(), counters.begin() + capacity, counters.end(), [this](const counter &a, const counter &b) {
+                return a.stats.*metric > b.stats.*metric;
+            });
+            counters.resize(capacity);
+        }
+        rebuild();
+    }
+
+  private:
+    struct slot_entry {
+        size_t hash;
+        size_t index; // One-based counter index, 0 for empty slots.
+    };
+
+    struct heap_entry {
+        uint64_t estimate;
+        size_t index;
+    };
+
+    size_t capacity;
+    uint64_t object_stats::*metric;
+    std::vector<slot_entry> slots; // Kept at most half full.
+    int slot_bits = 0;
+    std::vector<heap_entry> heap; // The lowest estimate first.
+    std::vector<size_t> positions; // Heap position by counter index.
+
+    object_stats floor() const {
+        return counters.size() < capacity ? object_stats() : counters[heap[0].index].stats;
+    }
+
+    // Keys such as packed locations hash to themselves, so hashes are mixed like addresses in `class_names`.
+    size_t ideal_slot(size_t hash) const {
+        return (hash * 0x9E3779B97F4A7C15ULL) >> (64 - slot_bits);
+    }
+
+    // The slot of `key`, or the empty slot it would take.
+    template <typename Lookup>
+    size_t find(const Lookup &key, size_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t slot = ideal_slot(hash);
+        while (slots[slot].index && !(slots[slot].hash == hash && counters[slots[slot].index - 1].key == key)) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    // Remove the slot of counter `index`, shifting back the slots after it that would no longer be found.
+    void erase(size_t index) {
+        size_t mask = slots.size() - 1;
+        size_t slot = ideal_slot(Hash()(counters[index].key));
+        while (slots[slot].index != index + 1) {
+            slot = (slot + 1) & mask;
+        }
+        for (size_t next = (slot + 1) & mask; slots[next].index; next = (next + 1) & mask) {
+            size_t ideal = ideal_slot(slots[next].hash);
+            if (((next - ideal) & mask) >= ((next - slot) & mask)) {
+                slots[slot] = slots[next];
+                slot = next;
+            }
+        }
+        slots[slot] = { 0, 0 };
+    }
+
+    void grow_slots() {
+        slot_bits = std::max(slot_bits + 1, 4);
+        std::vector<slot_entry> previous(size_t(1) << slot_bits, slot_entry { 0, 0 });
+        previous.swap(slots);
+        for (const slot_entry &entry : previous) {
+            if (entry.index) {
+                size_t slot = ideal_slot(entry.hash);
+                while (slots[slot].index) {
+                    slot = (slot + 1) & (slots.size() - 1);
+                }
+                slots[slot] = entry;
+            }
+        }
+    }
+
+    bool lighter(size_t a, size_t b) const {
+        return heap[a].estimate < heap[b].estimate;
+    }
+
+    void swap(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        positions[heap[a].index] = a;
+        positions[heap[b].index] = b;
+    }
+
+    void sift_up(size_t position) {
+        while (position > 0 && lighter(position, (position - 1) / 2)) {
+            swap(position, (position - 1) / 2);
+            position = (position - 1) / 2;
+        }
+    }
+
+    void sift_down(size_t position) {
+        while (true) {
+            size_t lightest = position;
+            for (size_t child = 2 * position + 1; child <= 2 * position + 2 && child < heap.size(); child++) {
+                if (lighter(child, lightest)) {
+                    lightest = child;
+                }
+            }
+            if (lightest == position) {
+                return;
+            }
+            swap(position, lightest);
+            position = lightest;
+        }
+    }
+
+    void rebuild() {
+        slots.clear();
+        slot_bits = 0;
+        while (2 * counters.size() > (size_t(1) << slot_bits)) {
+            slot_bits++;
+        }
+        slot_bits = std::max(slot_bits, 4);
+        slots.assign(size_t(1) << slot_bits, slot_entry { 0, 0 });
+        heap.resize(counters.size());
+        positions.resize(counters.size());
+        for (size_t index = 0; index < counters.size(); index++) {
+            size_t hash = Hash()(counters[index].key);
+            slots[find(counters[index].key, hash)] = { hash, index + 1 };
+            heap[index] = { counters[index].stats.*metric, index };
+            positions[index] = index;
+        }
+        for (size_t position = heap.size() / 2; position-- > 0;) {
+            sift_down(position);
+        }
+    }
+};
+
+// The strings counted by the approximate string report are only kept up to this many bytes, so that its sketch
+// stays within a fixed size however large the strings of a dump are.
+static const size_t APPROXIMATE_STRING_BYTES = 128;
+
+// A string value, by hash like `string_location`, for the approximate string report, and what's kept of it to
+// report it: its first `APPROXIMATE_STRING_BYTES` bytes, cut at a character boundary and followed by "..." if longer.
+struct string_prefix {
+    size_t hash;
+    std::string value;
+
+    // The hash and value of a string being counted.
+    struct lookup {
+        size_t hash;
+        std::string_view value;
+    };
+
+    string_prefix() : hash(0) {}
+
+    string_prefix(const lookup &key) : hash(key.hash) {
+        if (key.value.size() <= APPROXIMATE_STRING_BYTES) {
+            value = key.value;
+            return;
+        }
+        size_t size = APPROXIMATE_STRING_BYTES;
+        while (size > 0 && (static_cast<unsigned char>(key.value[size]) & 0xC0) == 0x80) {
+            size--;
+        }
+        value.reserve(size + 3);
+        value.append(key.value.substr(0, size)).append("...");
+    }
+
+    bool operator==(const string_prefix &other) const {
+        return hash == other.hash;
+    }
+
+    bool operator==(const lookup &other) const {
+        return hash == other.hash;
+    }
+};
+
+struct string_prefix_hash {
+    size_t operator()(const string_prefix &key) const {
+        return key.hash;
+    }
+
+    size_t operator()(const string_prefix::lookup &key) const {
+        return key.hash;
+    }
+};
+
+// A string value, by hash, at a location, for the approximate string report. Distinct values with the same hash
+// are counted together, which is well within the error of the sketch.
+struct string_location {
+    size_t value;
+    packed_location location;
+
+    bool operator==(const string_location &other) const {
+        return value == other.value && location == other.location;
+    }
+};
+
+struct string_location_hash {
+    size_t operator()(const string_location &key) const {
+        return key.value ^ (key.location * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+// The strings of a dump grouped by value, for the string report. Dumps can hold tens of millions of distinct strings,
+// so rather than a node and a location table each, groups are stored flat and found through an open addressing
+// table of their hashes, kept at most half full, and the locations of all groups are counted in a single table
+// keyed by group and location ids.
+//
+// Values are copied once per group. Referencing them in a mapped dump instead would fault its released windows back
+// in, since ties are ordered by value.
+class string_groups {
+  public:
+    struct group {
+        std::string_view value;
+        size_t hash;
+        object_stats stats;
+    };
+
+    std::vector<group> groups;
+    std::vector<packed_location> locations; // By location id.
+
+    void add(std::string_view value, packed_location location, uint64_t memsize, string_arena &arena) {
+        uint32_t id = group_id(value, std::hash<std::string_view>()(value), arena);
+        groups[id].stats.add(memsize);
+        if (location != NO_LOCATION) {
+            counters[static_cast<uint64_t>(id) << 32 | location_id(location)].add(memsize);
+        }
+    }
+
+    // Merge the groups of `other`, copying its values to `arena` if needed. `files` maps the file ids of
+    // its locations to ours, see `file_ids::merge`.
+    void merge(const string_groups &other, string_arena &arena, const std::vector<uint32_t> &files) {
+        std::vector<uint32_t> group_ids;
+        group_ids.reserve(other.groups.size());
+        for (const group &entry : other.groups) {
+            group_ids.push_back(group_id(entry.value, entry.hash, arena));
+            groups[group_ids.back()].stats.merge(entry.stats);
+        }
+        std::vector<uint32_t> location_ids;
+        location_ids.reserve(other.locations.size());
+        for (packed_location location : other.locations) {
+            location_ids.push_back(location_id(remap_location(location, files)));
+        }
+        other.counters.each([&](uint64_t key, const object_stats &stats) {
+            counters[static_cast<uint64_t>(group_ids[key >> 32]) << 32 | location_ids[key & UINT32_MAX]].merge(stats);
+        });
+    }
+
+    // Call `callback(group_id, location, stats)` for each location of each group, in no particular order.
+    template <typename Callback>
+    void each_location(Callback callback) const {
+        counters.each([&](uint64_t key, const object_stats &stats) {
+            callback(key >> 32, locations[key & UINT32_MAX], stats);
+        });
+    }
+
+  private:
+    std::vector<uint32_t> slots; // One-based group ids, 0 for empty slots.
+    std::unordered_map<packed_location, uint32_t> location_ids;
+    stats_table counters; // By group id in the high half, and location id in the low one.
+
+    uint32_t group_id(std::string_view value, size_t hash, string_arena &arena) {
+        if (2 * (groups.size() + 1) > slots.size()) {
+            grow_slots();
+        }
+        size_t mask = slots.size() - 1;
+        size_t index = hash & mask;
+        while (uint32_t id = slots[index]) {
+            const group &candidate = groups[id - 1];
+            if (candidate.hash == hash && candidate.value == value) {
+                return id - 1;
+            }
+            index = (index + 1) & mask;
+        }
+        groups.push_back({ arena.copy(value), hash, object_stats() });
+        slots[index] = groups.size();
+        return groups.size() - 1;
+    }
+
+    void grow_slots() {
+        std::vector<uint32_t> previous(std::max<size_t>(16, 2 * slots.size()), 0);
+        previous.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (uint32_t id : previous) {
+            if (id) {
+                size_t index = groups[id - 1].hash & mask;
+                while (slots[index]) {
+                    index = (index + 1) & mask;
+                }
+                slots[index] = id;
+            }
+        }
+    }
+
+    uint32_t location_id(packed_location location) {
+        auto inserted = location_ids.emplace(location, locations.size());
+        if (inserted.second) {
+            locations.push_back(location);
+        }
+        return inserted.first->second;
+    }
+};
+
+enum aggregate_tables {
+    AGGREGATE_FILES = 1 << 0,
+    AGGREGATE_CLASSES = 1 << 1,
+    AGGREGATE_LOCATIONS = 1 << 2,
+    AGGREGATE_STRINGS = 1 << 3,
+    AGGREGATE_SHAPE_EDGES = 1 << 4,
+    AGGREGATE_INDEX = 1 << 5,
+    AGGREGATE_RETAINED = 1 << 6,
+    AGGREGATE_ADDRESSES = 1 << 7,
+    AGGREGATE_APPROXIMATE_LOCATIONS = 1 << 8,
+    AGGREGATE_APPROXIMATE_STRINGS = 1 << 9,
+};
+
+// Computes the `Analyzer` dimensions directly from the parsed records. Only the tables
+// requested are maintained, and all keys are owned by the aggregator's arena.
+class aggregator {
+  public:
+    object_stats total;
+    object_stats no_file;
+    file_ids file_names;
+    std::vector<object_stats> files; // By file id.
+    std::unordered_map<class_key, object_stats, class_key_hash> classes;
+    stats_table locations; // By packed location.
+    string_groups strings;
+    std::unordered_map<std::string_view, uint64_t> shape_edges;
+    // The approximate tables, whose sketches have `counters` counters each.
+    space_saving<packed_location> locations_by_count, locations_by_memsize;
+    space_saving<string_prefix, string_prefix_hash> approximate_strings;
+    space_saving<string_location, string_location_hash> approximate_string_locations;
+
+    aggregator(int tables, size_t counters = 0) : locations_by_count(counters, &object_stats::count),
+        locations_by_memsize(counters, &object_stats::memsize), approximate_strings(counters, &object_stats::count),
+        approximate_string_locations(counters, &object_stats::count), tables(tables) {}
+
+    void process(const heap_object &object) {
+        total.add(object.memsize);
+
+        // The file is looked up at most once, for whichever tables need it.
+        uint32_t file = UINT32_MAX;
+        auto file_id = [&]() {
+            if (file == UINT32_MAX) {
+                file = file_names.id(object.file, arena);
+            }
+            return file;
+        };
+
+        if (tables & AGGREGATE_FILES) {
+            if (present(object.file)) {
+                file_stats(file_id()).add(object.memsize);
+            } else {
+                no_file.add(object.memsize);
+            }
+        }
+
+        if (tables & AGGREGATE_CLASSES) {
+            class_key key = {
+                arena.intern(object.type), arena.intern(object.imemo_type), arena.intern(object._struct),
+                object.class_address, object.has_class,
+            };
+            classes[key].add(object.memsize);
+        }
+
+        if (tables & AGGREGATE_LOCATIONS && present(object.file) && object.has_line) {
+            locations[pack_location(file_id(), object.line)].add(object.memsize);
+        }
+
+        if (tables & AGGREGATE_STRINGS && object.type == "STRING" && present(object.value)) {
+            bool located = present(object.file) && object.has_line;
+            strings.add(object.value, located ? pack_location(file_id(), object.line) : NO_LOCATION, object.memsize, arena);
+        }
+
+        if (tables & AGGREGATE_SHAPE_EDGES && present(object.edge_name)) {
+            shape_edges[arena.intern(object.edge_name)]++;
+        }
+
+        if (tables & AGGREGATE_APPROXIMATE_LOCATIONS && present(object.file) && object.has_line) {
+            packed_location location = pack_location(file_id(), object.line);
+            locations_by_count.add(location, object.memsize);
+            locations_by_memsize.add(location, object.memsize);
+        }
+
+        if (tables & AGGREGATE_APPROXIMATE_STRINGS && object.type == "STRING" && present(object.value)) {
+            size_t hash = std::hash<std::string_view>()(object.value);
+            approximate_strings.add(string_prefix::lookup { hash, object.value }, object.memsize);
+            if (present(object.file) && object.has_line) {
+                string_location key = { hash, pack_location(file_id(), object.line) };
+                approximate_string_locations.add(key, object.memsize);
+            }
+        }
+    }
+
+    void merge(const aggregator &other) {
+        total.merge(other.total);
+        no_file.merge(other.no_file);
+        std::vector<uint32_t> remap = file_names.merge(other.file_names, arena);
+        for (size_t id = 0; id < other.files.size(); id++) {
+            file_stats(remap[id]).merge(other.files[id]);
+        }
+        for (auto &entry : other.classes) {
+            class_key key = entry.first;
+            key.type = arena.intern(key.type);
+            key.imemo_type = arena.intern(key.imemo_type);
+            key._struct = arena.intern(key._struct);
+            classes[key].merge(entry.second);
+        }
+        other.locations.each([&](packed_location location, const object_stats &stats) {
+            locations[remap_location(location, remap)].merge(stats);
+        });
+        strings.merge(other.strings, arena, remap);
+        for (auto &entry : other.shape_edges) {
+            shape_edges[arena.intern(entry.first)] += entry.second;
+        }
+        if (tables & AGGREGATE_APPROXIMATE_LOCATIONS) {
+            auto remap_key = [&](packed_location location) {
+                return remap_location(location, remap);
+            };
+            locations_by_count.merge(other.locations_by_count, remap_key);
+            locations_by_memsize.merge(other.locations_by_memsize, remap_key);
+        }
+        if (tables & AGGREGATE_APPROXIMATE_STRINGS) {
+            approximate_strings.merge(other.approximate_strings, [](const string_prefix &key) {
+                return key;
+            });
+            approximate_string_locations.merge(other.approximate_string_locations, [&](const string_location &key) {
+                return string_location { key.value, remap_location(key.location, remap) };
+            });
+        }
+    }
+
+  private:
+    int tables;
+    string_arena arena;
+
+    object_stats & file_stats(uint32_t file) {
+        if (file >= files.size()) {
+            files.resize(file + 1);
+        }
+        return files[file];
+    }
+};
+
+static std::string format_location(const location_key &location) {
+    std::string buffer(location.file);
+    buffer += ":";
+    buffer += std::to_string(location.line);
+    return buffer;
+}
+
+// The characters of a location as `format_location` would write it, without allocating it.
+class location_text {
+  public:
+    location_text(const location_key &location) : file(location.file) {
+        uint64_t line = location.line;
+        do {
+            digits[sizeof(digits) - ++digits_size] = '0' + line % 10;
+            line /= 10;
+        } while (line);
+    }
+
+    size_t size() const {
+        return file.size() + 1 + digits_size;
+    }
+
+    unsigned char operator[](size_t index) const {
+        if (index < file.size()) {
+            return file[index];
+        }
+        if (index == file.size()) {
+            return ':';
+        }
+        return digits[sizeof(digits) - digits_size + index - file.size() - 1];
+    }
+
+  private:
+    std::string_view file;
+    char digits[20];
+    size_t digits_size = 0;
+};
+
+// Whether `a` comes after `b` once formatted, so that ties are broken exactly like on the "file:line" strings.
+static bool location_after(const location_key &a, const location_key &b) {
+    size_t common = std::min(a.file.size(), b.file.size());
+    size_t index = std::mismatch(a.file.begin(), a.file.begin() + common, b.file.begin()).first - a.file.begin();
+    location_text a_text(a), b_text(b);
+    for (; index < a_text.size() && index < b_text.size(); index++) {
+        if (a_text[index] != b_text[index]) {
+            return a_text[index] > b_text[index];
+        }
+    }
+    return a_text.size() > b_text.size();
+}
+
+// Whether line `a` comes after line `b` once formatted, e.g. 9 after 10, or 100 after 10.
+static bool line_after(uint64_t a, uint64_t b) {
+    uint64_t a_scaled = a, b_scaled = b;
+    int a_digits = 1, b_digits = 1;
+    for (uint64_t rest = a; rest >= 10; rest /= 10) {
+        a_digits++;
+    }
+    for (uint64_t rest = b; rest >= 10; rest /= 10) {
+        b_digits++;
+    }
+    // Compare both numbers with as many digits, the shorter one coming first if it's a prefix of the other.
+    for (int digits = a_digits; digits < b_digits; digits++) {
+        a_scaled *= 10;
+    }
+    for (int digits = b_digits; digits < a_digits; digits++) {
+        b_scaled *= 10;
+    }
+    return a_scaled != b_scaled ? a_scaled > b_scaled : a_digits > b_digits;
+}
+
+// The `location_after` ordering of packed locations. Locations are mostly compared on ties, e.g. when most of them
+// were seen only once, so files are ranked once by their "file:" prefix rather than compared for each pair. That rank
+// decides between different files unless one contains a colon, and so could be a prefix of the other's location.
+class location_order {
+  public:
+    location_order(const file_ids &files) : files(files), ranks(files.names.size()), colons(files.names.size()) {
+        std::vector<std::string> prefixes;
+        prefixes.reserve(files.names.size());
+        for (std::string_view name : files.names) {
+            prefixes.emplace_back(name);
+            prefixes.back() += ':';
+        }
+        std::vector<uint32_t> ids(files.names.size());
+        std::iota(ids.begin(), ids.end(), 0);
+        std::sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) {
+            return prefixes[a] < prefixes[b];
+        });
+        for (size_t rank = 0; rank < ids.size(); rank++) {
+            ranks[ids[rank]] = rank;
+            colons[ids[rank]] = files.names[ids[rank]].find(':') != std::string_view::npos;
+        }
+    }
+
+    bool after(packed_location a, packed_location b) const {
+        uint32_t a_file = a >> 32, b_file = b >> 32;
+        if (a_file == b_file) {
+            return line_after(a & UINT32_MAX, b & UINT32_MAX);
+        }
+        if (!colons[a_file] && !colons[b_file]) {
+            return ranks[a_file] > ranks[b_file];
+        }
+        return location_after(files.unpack(a), files.unpack(b));
+    }
+
+  private:
+    const file_ids &files;
+    std::vector<uint32_t> ranks;
+    std::vector<bool> colons;
+};
+
+// Only keep the first `max` of `rows` in report order, sorted. Tables can have millions of rows for a few dozens
+// printed, so rather than sorting them all, they go through a heap of the best `max` rows so far, which most rows
+// are rejected from with a single comparison. Report orders are total, so the rows kept don't depend on the method.
+template <typename Row, typename Compare>
+static void select_top(std::vector<Row> &rows, size_t max, Compare compare) {
+    if (rows.size() > max) {
+        std::partial_sort(rows.begin(), rows.begin() + max, rows.end(), compare);
+        rows.resize(max);
+    } else {
+        std::sort(rows.begin(), rows.end(), compare);
+    }
+}
+
+typedef std::pair<packed_location, object_stats> location_row;
+
+// Same ordering as `Analyzer::GroupedDimension#top_n`: highest metric first, then the highest location.
+static std::vector<location_row> top_locations(std::vector<location_row> rows, const location_order &order, size_t max,
+    uint64_t object_stats::*metric) {
+    select_top(rows, max, [&](const location_row &a, const location_row &b) {
+        if (a.second.*metric != b.second.*metric) {
+            return a.second.*metric > b.second.*metric;
+        }
+        return order.after(a.first, b.first);
+    });
+    return rows;
+}
+
+static VALUE make_stats_row(VALUE key, const object_stats &stats) {
+    return rb_ary_new_from_args(3, key, ULL2NUM(stats.count), ULL2NUM(stats.memsize));
+}
+
+// Locations are only formatted here, for the rows actually returned.
+static VALUE make_location_rows(const std::vector<location_row> &rows, const file_ids &files) {
+    VALUE ary = rb_ary_new_capa(rows.size());
+    for (auto &row : rows) {
+        rb_ary_push(ary, make_stats_row(make_string(format_location(files.unpack(row.first))), row.second));
+    }
+    return ary;
+}
+
+static VALUE make_class_key(const class_key &key) {
+    VALUE hash = rb_hash_new();
+    if (present(key.type)) {
+        rb_hash_aset(hash, sym_type, make_symbol(key.type));
+    }
+    if (key.has_class) {
+        rb_hash_aset(hash, sym_class, INT2FIX(key.class_address));
+    }
+    if (present(key.imemo_type)) {
+        rb_hash_aset(hash, sym_imemo_type, make_symbol(key.imemo_type));
+    }
+    if (present(key._struct)) {
+        rb_hash_aset(hash, sym_struct, make_symbol(key._struct));
+    }
+    return hash;
+}
+
+// The dominator tree of the objects reachable from the roots of a graph: an object dominates another if
+// every path from the roots to the latter goes through it, so the memory an object retains, i.e. that
+// would be freed along with it, is its own plus that of the objects it dominates.
+//
+// Nodes are indexed by their depth-first preorder number, the roots being 0, and every node
+// comes after its immediate dominator, so sizes can be summed bottom up in a single reverse pass.
+struct dominator_tree {
+    std::vector<uint32_t> order; // The graph node of each number.
+    std::vector<uint32_t> idom; // The number of the immediate dominator of each number.
+
+    size_t size() const {
+        return order.size();
+    }
+};
+
+// The simple version of Lengauer-Tarjan, in O(m log n). Object graphs can be millions of levels deep,
+// e.g. linked lists, so both the depth-first search and the path compression are iterative.
+static void compute_dominators(const object_graph &graph, dominator_tree &tree) {
+    std::vector<uint32_t> number(graph.size(), NO_NODE);
+    std::vector<uint32_t> &order = tree.order;
+    std::vector<uint32_t> parent;
+
+    std::vector<std::pair<uint32_t, uint64_t>> stack; // Nodes being visited, and their next edge.
+    number[0] = 0;
+    order.push_back(0);
+    parent.push_back(0);
+    stack.emplace_back(0, graph.offsets[0]);
+    while (!stack.empty()) {
+        uint32_t node = stack.back().first;
+        uint64_t edge = stack.back().second;
+        if (edge == graph.offsets[node + 1]) {
+            stack.pop_back();
+            continue;
+        }
+        stack.back().second++;
+        uint32_t next = graph.edges[edge];
+        if (number[next] == NO_NODE) {
+            number[next] = order.size();
+            order.push_back(next);
+            parent.push_back(number[node]);
+            stack.emplace_back(next, graph.offsets[next]);
+        }
+    }
+    std::vector<std::pair<uint32_t, uint64_t>>().swap(stack);
+
+    // The predecessors of each reachable node, by number.
+    size_t count = order.size();
+    std::vector<uint64_t> predecessor_offsets(count + 1, 0);
+    for (uint32_t node : order) {
+        graph.each_reference(node, [&](uint32_t reference) {
+            predecessor_offsets[number[reference] + 1]++;
+        });
+    }
+    for (size_t index = 0; index < count; index++) {
+        predecessor_offsets[index + 1] += predecessor_offsets[index];
+    }
+    std::vector<uint32_t> predecessors(predecessor_offsets.back());
+    {
+        std::vector<uint64_t> next(predecessor_offsets.begin(), predecessor_offsets.end() - 1);
+        for (uint32_t node : order) {
+            graph.each_reference(node, [&](uint32_t reference) {
+                predecessors[next[number[reference]]++] = number[node];
+            });
+        }
+    }
+    std::vector<uint32_t>().swap(number);
+
+    std::vector<uint32_t> semi(count), label(count), ancestor(count, NO_NODE);
+    std::vector<uint32_t> bucket(count, NO_NODE), next_in_bucket(count, NO_NODE);
+    std::vector<uint32_t> &idom = tree.idom;
+    idom.assign(count, 0);
+    for (uint32_t index = 0; index < count; index++) {
+        semi[index] = label[index] = index;
+    }
+
+    std::vector<uint32_t> path;
+    auto eval = [&](uint32_t node) {
+        if (ancestor[node] == NO_NODE) {
+            return node;
+        }
+        for (uint32_t current = node; ancestor[ancestor[current]] != NO_NODE; current = ancestor[current]) {
+            path.push_back(current);
+        }
+        while (!path.empty()) {
+            uint32_t current = path.back();
+            path.pop_back();
+            uint32_t up = ancestor[current];
+            if (semi[label[up]] < semi[label[current]]) {
+                label[current] = label[up];
+            }
+            ancestor[current] = ancestor[up];
+        }
+        return label[node];
+    };
+
+    for (uint32_t node = count - 1; node > 0; node--) {
+        for (uint64_t edge = predecessor_offsets[node]; edge < predecessor_offsets[node + 1]; edge++) {
+            uint32_t candidate = semi[eval(predecessors[edge])];
+            if (candidate < semi[node]) {
+                semi[node] = candidate;
+            }
+        }
+        next_in_bucket[node] = bucket[semi[node]];
+        bucket[semi[node]] = node;
+
+        uint32_t node_parent = parent[node];
+        ancestor[node] = node_parent;
+        for (uint32_t pending = bucket[node_parent]; pending != NO_NODE; pending = next_in_bucket[pending]) {
+            uint32_t lowest = eval(pending);
+            idom[pending] = semi[lowest] < semi[pending] ? lowest : node_parent;
+        }
+        bucket[node_parent] = NO_NODE;
+    }
+    for (uint32_t node = 1; node < count; node++) {
+        if (idom[node] != semi[node]) {
+            idom[node] = idom[idom[node]];
+        }
+    }
+}
+
+// The memory retained by each node of `tree`, by number.
+static std::vector<uint64_t> retained_sizes(const object_graph &graph, const dominator_tree &tree) {
+    std::vector<uint64_t> retained(tree.size());
+    for (size_t node = 0; node < tree.size(); node++) {
+        retained[node] = graph.memsizes[tree.order[node]];
+    }
+    for (size_t node = tree.size() - 1; node > 0; node--) {
+        retained[tree.idom[node]] += retained[node];
+    }
+    return retained;
+}
+
+// Fill the dominators and retained sizes of the nodes of `graph`, unless they already are.
+static void compute_retention(object_graph &graph) {
+    if (!graph.retained.empty()) {
+        return;
+    }
+    dominator_tree tree;
+    compute_dominators(graph, tree);
+    std::vector<uint64_t> retained = retained_sizes(graph, tree);
+
+    graph.dominators.assign(graph.size(), NO_NODE);
+    graph.retained.assign(graph.size(), 0);
+    for (size_t node = 0; node < tree.size(); node++) {
+        graph.dominators[tree.order[node]] = tree.order[tree.idom[node]];
+        graph.retained[tree.order[node]] = retained[node];
+    }
+}
+
+// The node of `address` once the retention of `graph` is computed, or `NO_NODE` if it isn't reachable from the roots.
+static uint32_t reachable_node(VALUE self, VALUE address) {
+    object_graph &graph = *get_object_graph(self);
+    if (graph.retained.empty()) {
+        released_gvl gvl;
+        gvl.run([&]() { compute_retention(graph); });
+        if (gvl.state) {
+            rb_jump_tag(gvl.state);
+        }
+    }
+    uint32_t node = get_node(graph, address);
+    return node != NO_NODE && graph.dominators[node] != NO_NODE ? node : NO_NODE;
+}
+
+// The memory the object at `address` retains: its own and that of all the objects only reachable through it.
+// Nil if it isn't reachable from the roots. Dominators are computed on the first call.
+static VALUE rb_heap_object_graph_retained_size_of(VALUE self, VALUE address) {
+    uint32_t node = reachable_node(self, address);
+    return node == NO_NODE ? Qnil : ULL2NUM(get_object_graph(self)->retained[node]);
+}
+
+// The address of the immediate dominator of the object at `address`, i.e. the closest object every path
+// from the roots to it goes through, or 0 when only the roots do. Nil if it isn't reachable from the roots.
+static VALUE rb_heap_object_graph_dominator_of(VALUE self, VALUE address) {
+    uint32_t node = reachable_node(self, address);
+    if (node == NO_NODE || node == 0) {
+        return Qnil;
+    }
+    const object_graph &graph = *get_object_graph(self);
+    return ULL2NUM(graph.addresses[graph.dominators[node]]);
+}
+
+// Dense ids for the class keys, files and locations of objects, so that their retained memory can be
+// tracked in flat arrays while walking the dominator tree. Each shard has its own, merged once parsed.
+class retention_keys {
+  public:
+    std::vector<class_key> classes;
+    file_ids files;
+    std::vector<packed_location> locations;
+    std::vector<std::string> class_names; // Once resolved, the class groups are names rather than keys.
+    std::vector<std::string> gems;
+
+    group_ids ids(const heap_object &object) {
+        group_ids groups = NO_GROUPS;
+        groups[RETAINED_BY_CLASS] = class_id({ object.type, object.imemo_type, object._struct, object.class_address, object.has_class });
+        if (present(object.file)) {
+            uint32_t file = files.id(object.file, arena);
+            groups[RETAINED_BY_FILE] = file;
+            if (object.has_line) {
+                groups[RETAINED_BY_LOCATION] = location_id(pack_location(file, object.line));
+            }
+        }
+        return groups;
+    }
+
+    // The ids in this table of the keys of `other`, for each grouping.
+    std::array<std::vector<uint32_t>, RETENTION_GROUPINGS> merge(const retention_keys &other) {
+        std::array<std::vector<uint32_t>, RETENTION_GROUPINGS> ids;
+        for (const class_key &key : other.classes) {
+            ids[RETAINED_BY_CLASS].push_back(class_id(key));
+        }
+        ids[RETAINED_BY_FILE] = files.merge(other.files, arena);
+        for (packed_location location : other.locations) {
+            ids[RETAINED_BY_LOCATION].push_back(location_id(remap_location(location, ids[RETAINED_BY_FILE])));
+        }
+        return ids;
+    }
+
+    size_t size(int grouping) const {
+        switch (grouping) {
+            case RETAINED_BY_CLASS:
+                return named_classes ? class_names.size() : classes.size();
+            case RETAINED_BY_FILE:
+                return files.names.size();
+            case RETAINED_BY_GEM:
+                return gems.size();
+            default:
+                return locations.size();
+        }
+    }
+
+    bool named_classes = false;
+
+    // The class name id of each class key id, or NO_GROUP, given the name of each class key, empty for none.
+    std::vector<uint32_t> assign_class_names(const std::vector<std::string> &key_names) {
+        named_classes = true;
+        return intern_names(key_names, class_names);
+    }
+
+    // The gem id of each file id, or NO_GROUP, given the gem name of each file, empty for none.
+    std::vector<uint32_t> assign_gems(const std::vector<std::string> &file_gems) {
+        return intern_names(file_gems, gems);
+    }
+
+  private:
+    std::unordered_map<class_key, uint32_t, class_key_hash> class_ids;
+    std::unordered_map<packed_location, uint32_t> location_ids;
+    string_arena arena;
+
+    uint32_t class_id(class_key key) {
+        auto found = class_ids.find(key);
+        if (found != class_ids.end()) {
+            return found->second;
+        }
+        key.type = arena.intern(key.type);
+        key.imemo_type = arena.intern(key.imemo_type);
+        key._struct = arena.intern(key._struct);
+        classes.push_back(key);
+        return class_ids.emplace(key, classes.size() - 1).first->second;
+    }
+
+    uint32_t location_id(packed_location location) {
+        auto inserted = location_ids.emplace(location, locations.size());
+        if (inserted.second) {
+            locations.push_back(location);
+        }
+        return inserted.first->second;
+    }
+
+    static std::vector<uint32_t> intern_names(const std::vector<std::string> &resolved, std::vector<std::string> &names) {
+        std::unordered_map<std::string_view, uint32_t> ids;
+        std::vector<uint32_t> key_ids;
+        key_ids.reserve(resolved.size());
+        for (const std::string &name : resolved) {
+            if (name.empty()) {
+                key_ids.push_back(NO_GROUP);
+                continue;
+            }
+            auto inserted = ids.emplace(name, names.size());
+            if (inserted.second) {
+                names.push_back(name);
+            }
+            key_ids.push_back(inserted.first->second);
+        }
+        return key_ids;
+    }
+};
+
+// Rewrite the group ids of the objects of `shards` from those of their own keys to those of `keys`.
+static void merge_retention_keys(retention_keys &keys, std::vector<retention_keys> &shard_keys, std::vector<graph_shard> &shards) {
+    for (size_t index = 0; index < shards.size(); index++) {
+        auto ids = keys.merge(shard_keys[index]);
+        for (group_ids &groups : shards[index].groups) {
+            for (int grouping = 0; grouping < RETENTION_GROUPINGS; grouping++) {
+                uint32_t &group = groups[grouping];
+                if (group != NO_GROUP) {
+                    group = ids[grouping][group];
+                }
+            }
+        }
+    }
+}
+
+// Call `resolver` with `argv`, the first of which is an array of keys it maps to their names or nil.
+// It's called under `rb_protect`, so it only fills `names`, owned by the caller, with empty names for nil.
+static void resolve_names(VALUE resolver, int argc, const VALUE *argv, std::vector<std::string> &names) {
+    VALUE resolved = rb_funcallv(resolver, id_call, argc, argv);
+    Check_Type(resolved, T_ARRAY);
+    for (long index = 0; index < RARRAY_LEN(argv[0]); index++) {
+        VALUE name = rb_ary_entry(resolved, index);
+        if (NIL_P(name)) {
+            names.emplace_back();
+        } else {
+            StringValue(name);
+            names.emplace_back(RSTRING_PTR(name), RSTRING_LEN(name));
+        }
+    }
+}
+
+// Resolve the name of each class key of `keys` with `resolver`, also given the class and string indexes
+// of the dump if they were built in the same pass, nil otherwise.
+static void resolve_class_names(VALUE resolver, const retention_keys &keys, VALUE class_index, VALUE string_index,
+    std::vector<std::string> &names) {
+    VALUE classes = rb_ary_new_capa(keys.classes.size());
+    for (const class_key &key : keys.classes) {
+        rb_ary_push(classes, make_class_key(key));
+    }
+    VALUE argv[] = { classes, class_index, string_index };
+    resolve_names(resolver, 3, argv, names);
+}
+
+// Resolve the gem of each file of `keys` with `resolver`, which maps an array of paths to their gem names.
+static void resolve_gems(VALUE resolver, const retention_keys &keys, std::vector<std::string> &gems) {
+    VALUE files = rb_ary_new_capa(keys.files.names.size());
+    for (std::string_view name : keys.files.names) {
+        rb_ary_push(files, dedup_string(name));
+    }
+    resolve_names(resolver, 1, &files, gems);
+}
+
+// Set the `to` group of each object from its `from` group, e.g. its gem from its file. Like for other groupings,
+// objects dominated by another object of the same class name or gem then aren't counted twice, even if their keys differ.
+static void assign_groups(object_graph &graph, retention_grouping from, retention_grouping to, const std::vector<uint32_t> &ids) {
+    for (group_ids &groups : graph.groups) {
+        uint32_t id = groups[from];
+        groups[to] = id == NO_GROUP ? NO_GROUP : ids[id];
+    }
+}
+
+// The memory retained by each group: the sum of the retained sizes of its objects, except those dominated
+// by another object of the same group, which are already accounted for. Objects that aren't reachable
+// from the roots, i.e. garbage that wasn't collected yet, don't retain anything.
+static std::array<std::vector<uint64_t>, RETENTION_GROUPINGS> retained_by_group(const object_graph &graph, const retention_keys &keys) {
+    dominator_tree tree;
+    compute_dominators(graph, tree);
+    size_t count = tree.size();
+    std::vector<uint64_t> retained = retained_sizes(graph, tree);
+
+    // The dominator tree in compressed sparse row form, to walk it depth first.
+    std::vector<uint32_t> child_offsets(count + 1, 0), children(count > 0 ? count - 1 : 0);
+    for (size_t node = 1; node < count; node++) {
+        child_offsets[tree.idom[node] + 1]++;
+    }
+    for (size_t node = 0; node < count; node++) {
+        child_offsets[node + 1] += child_offsets[node];
+    }
+    {
+        std::vector<uint32_t> next(child_offsets.begin(), child_offsets.end() - 1);
+        for (size_t node = 1; node < count; node++) {
+            children[next[tree.idom[node]]++] = node;
+        }
+    }
+    std::vector<uint32_t>().swap(tree.idom);
+
+    // How many objects of each group are on the path from the roots to the current node.
+    std::array<std::vector<uint32_t>, RETENTION_GROUPINGS> active;
+    std::array<std::vector<uint64_t>, RETENTION_GROUPINGS> totals;
+    for (int grouping = 0; grouping < RETENTION_GROUPINGS; grouping++) {
+        active[grouping].assign(keys.size(grouping), 0);
+        totals[grouping].assign(keys.size(grouping), 0);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> stack; // Nodes being visited, and their next child.
+    stack.emplace_back(0, child_offsets[0]);
+    while (!stack.empty()) {
+        uint32_t node = stack.back().first;
+        uint32_t child = stack.back().second;
+        const group_ids &groups = graph.groups[tree.order[node]];
+        if (child == child_offsets[node + 1]) {
+            for (int grouping = 0; grouping < RETENTION_GROUPINGS; grouping++) {
+                if (groups[grouping] != NO_GROUP) {
+                    active[grouping][groups[grouping]]--;
+                }
+            }
+            stack.pop_back();
+            continue;
+        }
+        stack.back().second++;
+
+        uint32_t next = children[child];
+        const group_ids &next_groups = graph.groups[tree.order[next]];
+        for (int grouping = 0; grouping < RETENTION_GROUPINGS; grouping++) {
+            uint32_t group = next_groups[grouping];
+            if (group != NO_GROUP && active[grouping][group]++ == 0) {
+                totals[grouping][group] += retained[next];
+            }
+        }
+        stack.emplace_back(next, child_offsets[next]);
+    }
+    return totals;
+}
+
+typedef std::pair<packed_location, uint64_t> retained_row;
+
+// The `max` locations that retain the most memory, highest location first on ties like `top_locations`.
+static VALUE make_retained_locations(const retention_keys &keys, const std::vector<uint64_t> &totals, size_t max) {
+    std::vector<retained_row> rows;
+    for (size_t id = 0; id < totals.size(); id++) {
+        if (totals[id]) {
+            rows.emplace_back(keys.locations[id], totals[id]);
+        }
+    }
+    location_order order(keys.files);
+    select_top(rows, max, [&](const retained_row &a, const retained_row &b) {
+        if (a.second != b.second) {
+            return a.second > b.second;
+        }
+        return order.after(a.first, b.first);
+    });
+
+    VALUE locations = rb_ary_new_capa(rows.size());
+    for (auto &row : rows) {
+        VALUE location = make_string(format_location(keys.files.unpack(row.first)));
+        rb_ary_push(locations, rb_ary_new_from_args(2, location, ULL2NUM(row.second)));
+    }
+    return locations;
+}
+
+static VALUE make_retained_result(const retention_keys &keys, const std::array<std::vector<uint64_t>, RETENTION_GROUPINGS> &totals, size_t max) {
+    VALUE hash = rb_hash_new();
+
+    const std::vector<uint64_t> &classes_totals = totals[RETAINED_BY_CLASS];
+    VALUE classes = rb_ary_new();
+    for (size_t id = 0; id < classes_totals.size(); id++) {
+        if (classes_totals[id]) {
+            VALUE group = keys.named_classes ? make_string(keys.class_names[id]) : make_class_key(keys.classes[id]);
+            rb_ary_push(classes, rb_ary_new_from_args(2, group, ULL2NUM(classes_totals[id])));
+        }
+    }
+    rb_hash_aset(hash, sym_classes, classes);
+
+    const std::vector<uint64_t> &files_totals = totals[RETAINED_BY_FILE];
+    VALUE files = rb_ary_new();
+    for (size_t id = 0; id < files_totals.size(); id++) {
+        if (files_totals[id]) {
+            rb_ary_push(files, rb_ary_new_from_args(2, dedup_string(keys.files.names[id]), ULL2NUM(files_totals[id])));
+        }
+    }
+    rb_hash_aset(hash, sym_files, files);
+
+    rb_hash_aset(hash, sym_locations, make_retained_locations(keys, totals[RETAINED_BY_LOCATION], max));
+
+    const std::vector<uint64_t> &gems_totals = totals[RETAINED_BY_GEM];
+    VALUE gems = rb_ary_new();
+    for (size_t id = 0; id < gems_totals.size(); id++) {
+        if (gems_totals[id]) {
+            rb_ary_push(gems, rb_ary_new_from_args(2, make_string(keys.gems[id]), ULL2NUM(gems_totals[id])));
+        }
+    }
+    rb_hash_aset(hash, sym_gems, gems);
+    return hash;
+}
+
+typedef space_saving<packed_location>::counter location_counter;
+
+// The top `max` locations of `sketch` by `metric`, ordered like `top_locations`, as `[location, estimate, error]`.
+static VALUE make_approximate_locations(const space_saving<packed_location> &sketch, const file_ids &files,
+    const location_order &order, size_t max, uint64_t object_stats::*metric) {
+    std::vector<const location_counter *> rows;
+    rows.reserve(sketch.counters.size());
+    for (const location_counter &counter : sketch.counters) {
+        rows.push_back(&counter);
+    }
+    select_top(rows, max, [&](const location_counter *a, const location_counter *b) {
+        if (a->stats.*metric != b->stats.*metric) {
+            return a->stats.*metric > b->stats.*metric;
+        }
+        return order.after(a->key, b->key);
+    });
+
+    VALUE locations = rb_ary_new_capa(rows.size());
+    for (const location_counter *row : rows) {
+        VALUE location = make_string(format_location(files.unpack(row->key)));
+        rb_ary_push(locations, rb_ary_new_from_args(3, location, ULL2NUM(row->stats.*metric), ULL2NUM(row->error.*metric)));
+    }
+    return locations;
+}
+
+// The top `max` strings of the sketch by count, ordered like `Analyzer::StringDimension#top_n`, as
+// `[value, count, memsize, count_error, locations]`, with their own top locations as `[location, count, memsize, count_error]`.
+static VALUE make_approximate_strings(const aggregator &result, size_t max) {
+    typedef space_saving<string_prefix, string_prefix_hash>::counter string_counter;
+    typedef space_saving<string_location, string_location_hash>::counter string_location_counter;
+
+    std::vector<const string_counter *> rows;
+    rows.reserve(result.approximate_strings.counters.size());
+    for (const string_counter &counter : result.approximate_strings.counters) {
+        rows.push_back(&counter);
+    }
+    select_top(rows, max, [](const string_counter *a, const string_counter *b) {
+        if (a->stats.count != b->stats.count) {
+            return a->stats.count > b->stats.count;
+        }
+        return a->key.value > b->key.value;
+    });
+
+    std::unordered_map<size_t, size_t> ranks; // By value hash.
+    for (size_t rank = 0; rank < rows.size(); rank++) {
+        ranks.emplace(rows[rank]->key.hash, rank);
+    }
+    std::vector<std::vector<const string_location_counter *>> row_locations(rows.size());
+    for (const string_location_counter &counter : result.approximate_string_locations.counters) {
+        auto rank = ranks.find(counter.key.value);
+        if (rank != ranks.end()) {
+            row_locations[rank->second].push_back(&counter);
+        }
+    }
+
+    location_order order(result.file_names);
+    VALUE strings = rb_ary_new_capa(rows.size());
+    for (size_t rank = 0; rank < rows.size(); rank++) {
+        std::vector<const string_location_counter *> &locations = row_locations[rank];
+        select_top(locations, max, [&](const string_location_counter *a, const string_location_counter *b) {
+            if (a->stats.count != b->stats.count) {
+                return a->stats.count > b->stats.count;
+            }
+            return order.after(a->key.location, b->key.location);
+        });
+        VALUE location_rows = rb_ary_new_capa(locations.size());
+        for (const string_location_counter *location : locations) {
+            rb_ary_push(location_rows, rb_ary_new_from_args(4, make_string(format_location(result.file_names.unpack(location->key.location))),
+                ULL2NUM(location->stats.count), ULL2NUM(location->stats.memsize), ULL2NUM(location->error.count)));
+        }
+
+        const string_counter &row = *rows[rank];
+        rb_ary_push(strings, rb_ary_new_from_args(5, make_string(row.key.value), ULL2NUM(row.stats.count), ULL2NUM(row.stats.memsize),
+            ULL2NUM(row.error.count), location_rows));
+    }
+    return strings;
+}
+
+static VALUE make_aggregate_result(const aggregator &result, int tables, size_t max) {
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, sym_objects, ULL2NUM(result.total.count));
+    rb_hash_aset(hash, sym_memory, ULL2NUM(result.total.memsize));
+
+    if (tables & AGGREGATE_FILES) {
+        VALUE files = rb_ary_new_capa(result.files.size() + 1);
+        for (size_t id = 0; id < result.files.size(); id++) {
+            if (result.files[id].count) {
+                rb_ary_push(files, make_stats_row(dedup_string(result.file_names.names[id]), result.files[id]));
+            }
+        }
+        if (result.no_file.count) {
+            rb_ary_push(files, make_stats_row(Qnil, result.no_file));
+        }
+        rb_hash_aset(hash, sym_files, files);
+    }
+
+    if (tables & AGGREGATE_CLASSES) {
+        VALUE classes = rb_ary_new_capa(result.classes.size());
+        for (auto &entry : result.classes) {
+            rb_ary_push(classes, make_stats_row(make_class_key(entry.first), entry.second));
+        }
+        rb_hash_aset(hash, sym_classes, classes);
+    }
+
+    // Locations are only needed for display, so we only return the top ones for each metric.
+    if (tables & AGGREGATE_LOCATIONS) {
+        std::vector<location_row> rows;
+        rows.reserve(result.locations.size());
+        result.locations.each([&](packed_location location, const object_stats &stats) {
+            rows.emplace_back(location, stats);
+        });
+        location_order order(result.file_names);
+        VALUE locations = make_location_rows(top_locations(rows, order, max, &object_stats::count), result.file_names);
+        rows = top_locations(std::move(rows), order, max, &object_stats::memsize);
+        rb_ary_concat(locations, make_location_rows(rows, result.file_names));
+        rb_funcall(locations, id_uniq_bang, 0);
+        rb_hash_aset(hash, sym_locations, locations);
+    }
+
+    if (tables & AGGREGATE_STRINGS) {
+        const std::vector<string_groups::group> &groups = result.strings.groups;
+        std::vector<uint32_t> rows(groups.size());
+        std::iota(rows.begin(), rows.end(), 0);
+        // Same ordering as `Analyzer::StringDimension#top_n`.
+        select_top(rows, max, [&](uint32_t a, uint32_t b) {
+            if (groups[a].stats.count != groups[b].stats.count) {
+                return groups[a].stats.count > groups[b].stats.count;
+            }
+            return groups[a].value > groups[b].value;
+        });
+
+        // Only the locations of the top groups are gathered, in a single pass.
+        std::unordered_map<uint32_t, size_t> ranks;
+        for (size_t rank = 0; rank < rows.size(); rank++) {
+            ranks.emplace(rows[rank], rank);
+        }
+        std::vector<std::vector<location_row>> row_locations(rows.size());
+        result.strings.each_location([&](uint32_t group, packed_location location, const object_stats &stats) {
+            auto rank = ranks.find(group);
+            if (rank != ranks.end()) {
+                row_locations[rank->second].emplace_back(location, stats);
+            }
+        });
+
+        location_order order(result.file_names);
+        VALUE strings = rb_ary_new_capa(rows.size());
+        for (size_t rank = 0; rank < rows.size(); rank++) {
+            const string_groups::group &row = groups[rows[rank]];
+            VALUE string_row = make_stats_row(make_string(row.value), row.stats);
+            rb_ary_push(string_row, make_location_rows(
+                top_locations(std::move(row_locations[rank]), order, max, &object_stats::count), result.file_names));
+            rb_ary_push(strings, string_row);
+        }
+        rb_hash_aset(hash, sym_strings, strings);
+    }
+
+    // Sketches only count the heaviest keys, so they return the top ones with the bound of their error.
+    if (tables & AGGREGATE_APPROXIMATE_LOCATIONS) {
+        location_order order(result.file_names);
+        VALUE locations = rb_hash_new();
+        rb_hash_aset(locations, sym_objects, make_approximate_locations(result.locations_by_count, result.file_names, order, max,
+            &object_stats::count));
+        rb_hash_aset(locations, sym_memory, make_approximate_locations(result.locations_by_memsize, result.file_names, order, max,
+            &object_stats::memsize));
+        rb_hash_aset(hash, sym_approximate_locations, locations);
+    }
+
+    if (tables & AGGREGATE_APPROXIMATE_STRINGS) {
+        rb_hash_aset(hash, sym_approximate_strings, make_approximate_strings(result, max));
+    }
+
+    if (tables & AGGREGATE_SHAPE_EDGES) {
+        typedef std::pair<std::string_view, uint64_t> edge_row;
+        std::vector<edge_row> rows(result.shape_edges.begin(), result.shape_edges.end());
+        // Same ordering as `Analyzer::ShapeEdgeDimension#top_n`.
+        select_top(rows, max, [](const edge_row &a, const edge_row &b) {
+            if (a.second != b.second) {
+                return a.second > b.second;
+            }
+            return a.first < b.first;
+        });
+
+        VALUE shape_edges = rb_ary_new_capa(rows.size());
+        for (auto &row : rows) {
+            rb_ary_push(shape_edges, rb_ary_new_from_args(2, make_string(row.first), ULL2NUM(row.second)));
+        }
+        rb_hash_aset(hash, sym_shape_edges, shape_edges);
+    }
+
+    return hash;
+}
+
+static int get_aggregate_tables(VALUE tables) {
+    Check_Type(tables, T_ARRAY);
+    int flags = 0;
+    for (long index = 0; index < RARRAY_LEN(tables); index++) {
+        VALUE table = RARRAY_AREF(tables, index);
+        if (table == sym_files) {
+            flags |= AGGREGATE_FILES;
+        } else if (table == sym_classes) {
+            flags |= AGGREGATE_CLASSES;
+        } else if (table == sym_locations) {
+            flags |= AGGREGATE_LOCATIONS;
+        } else if (table == sym_strings) {
+            flags |= AGGREGATE_STRINGS;
+        } else if (table == sym_shape_edges) {
+            flags |= AGGREGATE_SHAPE_EDGES;
+        } else if (table == sym_index) {
+            flags |= AGGREGATE_INDEX;
+        } else if (table == sym_retained) {
+            flags |= AGGREGATE_RETAINED;
+        } else if (table == sym_addresses) {
+            flags |= AGGREGATE_ADDRESSES;
+        } else if (table == sym_approximate_locations) {
+            flags |= AGGREGATE_APPROXIMATE_LOCATIONS;
+        } else if (table == sym_approximate_strings) {
+            flags |= AGGREGATE_APPROXIMATE_STRINGS;
+        } else {
+            rb_raise(rb_eArgError, "Unknown aggregate table: %" PRIsVALUE, rb_inspect(table));
+        }
+    }
+    return flags;
+}
+
+// Sampled aggregations only parse the lines starting in a random subset of the chunks of this size, and jump over
+// the others. Nearby objects tend to be alike, since dumps list them in heap page order, so the smaller the chunks,
+// the more of them in a sample of the same size, and the narrower its confidence intervals.
+static const size_t SAMPLE_CHUNK_SIZE = 64 * 1024;
+
+// Whether chunk `number` of a dump is part of a sample at `rate`. Chunks are picked by hashing their number rather
+// than with a generator, so the same ones are picked however the dump is split in shards.
+static inline bool sampled_chunk(uint64_t number, double rate) {
+    uint64_t hash = number + 0x9e3779b97f4a7c15;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+    hash ^= hash >> 31;
+    return (hash >> 11) * 0x1.0p-53 < rate;
+}
+
+// The offset of the first line of `dump` starting at or after `position`.
+static size_t line_start(std::string_view dump, size_t position) {
+    if (position == 0 || position >= dump.size()) {
+        return std::min(position, dump.size());
+    }
+    size_t end = dump.find('\n', position - 1);
+    return end == std::string_view::npos ? dump.size() : end + 1;
+}
+
+// Call `callback(lines, sampled)` with the lines of `shard` starting in each chunk of `dump`, until it returns false.
+// Each line belongs to the chunk of its first byte, so every object is sampled with a probability of `rate`.
+template <typename Callback>
+static void each_sample_chunk(std::string_view dump, std::string_view shard, double rate, Callback callback) {
+    size_t start = shard.data() - dump.data();
+    size_t end = start + shard.size();
+    for (size_t chunk = start / SAMPLE_CHUNK_SIZE; chunk * SAMPLE_CHUNK_SIZE < end; chunk++) {
+        size_t first = line_start(dump, std::max(start, chunk * SAMPLE_CHUNK_SIZE));
+        size_t last = line_start(dump, std::min(end, (chunk + 1) * SAMPLE_CHUNK_SIZE));
+        if (first < last && !callback(dump.substr(first, last - first), sampled_chunk(chunk, rate))) {
+            return;
+        }
+    }
+}
+
+// The sums of the squared objects and memory of each sampled chunk, from which `Analyzer` estimates
+// the variance of the totals it scales up.
+struct sample_squares {
+    double count = 0;
+    double memsize = 0;
+
+    void add(const object_stats &before, const object_stats &after) {
+        double objects = after.count - before.count;
+        double memory = after.memsize - before.memsize;
+        count += objects * objects;
+        memsize += memory * memory;
+    }
+
+    void merge(const sample_squares &other) {
+        count += other.count;
+        memsize += other.memsize;
+    }
+};
+
+// The index of a sampled aggregation still needs every class name, so the chunks left out of the sample are
+// skimmed for CLASS and MODULE lines, which are the only ones parsed. Like `line_scanner`, this relies on the
+// layout of ObjectSpace.dump_all, where the type closely follows the address.
+static const size_t SKIMMED_PREFIX_SIZE = 64;
+
+static bool class_line(std::string_view line) {
+    static const std::string_view TYPE_PREFIX = "\"type\":\"";
+    size_t type = line.substr(0, SKIMMED_PREFIX_SIZE).find(TYPE_PREFIX);
+    if (type == std::string_view::npos) {
+        return false;
+    }
+    std::string_view value = line.substr(type + TYPE_PREFIX.size());
+    return value.compare(0, 6, "CLASS\"") == 0 || value.compare(0, 7, "MODULE\"") == 0;
+}
+
+static error_code skim_classes(dom::parser &parser, std::string_view lines, index_shard &index) {
+    heap_object object;
+    error_code error = SUCCESS;
+    each_line(lines, [&](std::string_view line) {
+        if (class_line(line)) {
+            dom::object element;
+            if ((error = parser.parse(line.data(), line.size(), false).get(element))) {
+                return false;
+            }
+            load_dom_object(element, object);
+            index.process(object);
+        }
+        return true;
+    });
+    return error;
+}
+
+// Objects whose address is in `survivors`, if given, e.g. the objects of an earlier dump, are also aggregated on
+// their own, in the files, classes and locations tables requested, along with the set of their addresses.
+//
+// The approximate tables are computed with sketches of `approximate` counters each, per thread.
+//
+// Given `classes`, a callable mapping an array of class keys to their names, retained memory is aggregated by class
+// name rather than by class key. It's also given the class and string indexes if the `:index` table is requested.
+// The retained memory of gems is only computed given `gems`, a callable mapping an array of file paths to their gem names.
+//
+// With a `sample` rate, only that fraction of the dump is aggregated, see `each_sample_chunk`, and the result
+// has the `:sample` rate along with the sums of squares needed to estimate the confidence of its totals.
+static VALUE rb_heap_aggregate(VALUE self, VALUE path, VALUE since, VALUE batch_size, VALUE threads, VALUE api, VALUE tables, VALUE max,
+    VALUE survivors, VALUE approximate, VALUE sample, VALUE classes, VALUE gems)
+{
+    Check_Type(path, T_STRING);
+    Check_Type(max, T_FIXNUM);
+    parse_options options = get_parse_options(batch_size, threads, api);
+    int64_t generation = get_generation(since);
+    int table_flags = get_aggregate_tables(tables);
+    size_t counters = 0;
+    if (table_flags & (AGGREGATE_APPROXIMATE_LOCATIONS | AGGREGATE_APPROXIMATE_STRINGS)) {
+        if (NIL_P(approximate) || NUM2LL(approximate) < 1) {
+            rb_raise(rb_eArgError, "approximate tables require a positive number of counters, got %" PRIsVALUE, rb_inspect(approximate));
+        }
+        counters = NUM2SIZET(approximate);
+    }
+    double rate = 0;
+    if (!NIL_P(sample)) {
+        rate = NUM2DBL(sample);
+        if (!(rate > 0 && rate <= 1)) {
+            rb_raise(rb_eArgError, "sample rate must be in (0, 1], got %" PRIsVALUE, rb_inspect(sample));
+        }
+        // Those need every object of the dump.
+        if ((table_flags & (AGGREGATE_RETAINED | AGGREGATE_ADDRESSES)) || !NIL_P(survivors)) {
+            rb_raise(rb_eArgError, "retained, addresses and survivors can't be sampled");
+        }
+    }
+    int survivor_flags = table_flags & (AGGREGATE_FILES | AGGREGATE_CLASSES | AGGREGATE_LOCATIONS);
+    // Retained memory requires the whole object graph, see `retained_by_group`.
+    options.references = table_flags & AGGREGATE_RETAINED;
+
+    const address_set *previous = NIL_P(survivors) ? nullptr : get_address_set(survivors);
+    VALUE addresses_set = table_flags & AGGREGATE_ADDRESSES ? address_set_allocate(rb_cHeapProfilerAddressSet) : Qnil;
+    VALUE survivors_set = previous ? address_set_allocate(rb_cHeapProfilerAddressSet) : Qnil;
+    address_set *addresses = NIL_P(addresses_set) ? nullptr : get_address_set(addresses_set);
+    address_set *survivor_addresses = NIL_P(survivors_set) ? nullptr : get_address_set(survivors_set);
+
+    VALUE result = Qnil;
+    VALUE class_index = Qnil, string_index = Qnil;
+    bool too_large = false;
+    bool streamed = false;
+    error_code error;
+    released_gvl gvl;
+    {
+        dump_input dump;
+        if (!(error = dump.load(RSTRING_PTR(path), gvl)) && !(streamed = rate && !dump.seekable())) {
+            std::vector<std::string_view> shards = split_shards(dump, options.threads);
+            std::vector<aggregator> results, survivor_results;
+            results.reserve(shards.size());
+            for (size_t index = 0; index < shards.size(); index++) {
+                results.emplace_back(table_flags, counters);
+                if (previous) {
+                    survivor_results.emplace_back(survivor_flags);
+                }
+            }
+            std::vector<std::vector<uint64_t>> shard_addresses(addresses ? shards.size() : 0);
+            std::vector<std::vector<uint64_t>> shard_survivors(previous ? shards.size() : 0);
+            std::vector<error_code> errors(shards.size(), SUCCESS);
+            std::vector<sample_squares> squares(rate ? shards.size() : 0);
+            // The index covers every object, since the classes of the objects we aggregate may be older than them.
+            std::vector<index_shard> indexes(table_flags & AGGREGATE_INDEX ? shards.size() : 0);
+            // Likewise the graph covers every object, but only those we aggregate have groups.
+            std::vector<graph_shard> graphs(options.references ? shards.size() : 0);
+            std::vector<retention_keys> shard_keys(graphs.size());
+            object_graph graph;
+            retention_keys keys;
+            std::vector<std::string> class_names, file_gems;
+            std::array<std::vector<uint64_t>, RETENTION_GROUPINGS> retained;
+
+            parser_lease parser(self);
+            gvl.run([&]() {
+                run_sharded(*parser, shards.size(), [&](size_t index, heap_parser &shard_parser) {
+                    auto process = [&](heap_object &object) {
+                        if (!indexes.empty()) {
+                            indexes[index].process(object);
+                        }
+                        bool skipped = skip_object(object, generation);
+                        if (!skipped) {
+                            results[index].process(object);
+                            if (addresses && object.address) {
+                                shard_addresses[index].push_back(object.address);
+                            }
+                            if (previous && object.address && previous->contains(object.address)) {
+                                survivor_results[index].process(object);
+                                shard_survivors[index].push_back(object.address);
+                            }
+                        }
+                        if (!graphs.empty()) {
+                            graphs[index].process(object, skipped ? NO_GROUPS : shard_keys[index].ids(object));
+                        }
+                        return true;
+                    };
+                    if (!rate) {
+                        errors[index] = each_heap_object(shard_parser, options, dump, shards[index], gvl, index == 0, process);
+                        return;
+                    }
+
+                    each_sample_chunk(dump.data(), shards[index], rate, [&](std::string_view lines, bool sampled) {
+                        if (sampled) {
+                            object_stats before = results[index].total;
+                            errors[index] = each_heap_object(shard_parser, options, dump, lines, gvl, index == 0, process);
+                            squares[index].add(before, results[index].total);
+                        } else if (!indexes.empty()) {
+                            error_code skim_error = SUCCESS;
+                            auto window_error = dump.each_window(lines, options.batch_size, gvl, [&](std::string_view window) {
+                                return !(skim_error = skim_classes(shard_parser.dom(), window, indexes[index]));
+                            });
+                            errors[index] = skim_error ? skim_error : window_error;
+                        }
+                        return !errors[index] && gvl.check(index == 0);
+                    });
+                });
+
+                for (size_t index = 0; index < shards.size(); index++) {
+                    if ((error = errors[index])) {
+                        break;
+                    }
+                    if (index > 0) {
+                        results[0].merge(results[index]);
+                        if (rate) {
+                            squares[0].merge(squares[index]);
+                        }
+                        if (previous) {
+                            survivor_results[0].merge(survivor_results[index]);
+                        }
+                    }
+                }
+                if (!error && !gvl.stopped()) {
+                    if (addresses) {
+                        addresses->fill(shard_addresses, options.threads);
+                    }
+                    if (previous) {
+                        survivor_addresses->fill(shard_survivors, options.threads);
+                    }
+                }
+                if (!error && !gvl.stopped() && !graphs.empty()) {
+                    merge_retention_keys(keys, shard_keys, graphs);
+                    too_large = !build_graph(graph, graphs, options.threads, true);
+                    if (!too_large && !NIL_P(classes) && gvl.with_gvl([&]() {
+                        if (!indexes.empty()) {
+                            class_index = class_index_allocate(rb_cHeapProfilerClassIndex);
+                            string_index = rb_hash_new();
+                            fill_index(indexes, class_index, string_index);
+                        }
+                        resolve_class_names(classes, keys, class_index, string_index, class_names);
+                    })) {
+                        assign_groups(graph, RETAINED_BY_CLASS, RETAINED_BY_CLASS, keys.assign_class_names(class_names));
+                    }
+                    if (!too_large && !NIL_P(gems) && !gvl.stopped() && gvl.with_gvl([&]() { resolve_gems(gems, keys, file_gems); })) {
+                        assign_groups(graph, RETAINED_BY_FILE, RETAINED_BY_GEM, keys.assign_gems(file_gems));
+                    }
+                    if (!too_large && !gvl.stopped()) {
+                        retained = retained_by_group(graph, keys);
+                    }
+                }
+            });
+            if (!error && !gvl.state && !too_large) {
+                result = make_aggregate_result(results[0], table_flags, FIX2LONG(max));
+                if (table_flags & AGGREGATE_RETAINED) {
+                    rb_hash_aset(result, sym_retained, make_retained_result(keys, retained, FIX2LONG(max)));
+                }
+                if (addresses) {
+                    rb_hash_aset(result, sym_addresses, addresses_set);
+                }
+                if (previous) {
+                    VALUE survivors_result = make_aggregate_result(survivor_results[0], survivor_flags, FIX2LONG(max));
+                    rb_hash_aset(survivors_result, sym_addresses, survivors_set);
+                    rb_hash_aset(result, sym_survivors, survivors_result);
+                }
+                if (rate) {
+                    VALUE sample_result = rb_hash_new();
+                    rb_hash_aset(sample_result, sym_rate, DBL2NUM(rate));
+                    rb_hash_aset(sample_result, sym_objects, DBL2NUM(squares[0].count));
+                    rb_hash_aset(sample_result, sym_memory, DBL2NUM(squares[0].memsize));
+                    rb_hash_aset(result, sym_sample, sample_result);
+                }
+                if (table_flags & AGGREGATE_INDEX) {
+                    if (NIL_P(class_index)) {
+                        class_index = class_index_allocate(rb_cHeapProfilerClassIndex);
+                        string_index = rb_hash_new();
+                        fill_index(indexes, class_index, string_index);
+                    }
+                    rb_hash_aset(result, sym_class_index, class_index);
+                    rb_hash_aset(result, sym_string_index, string_index);
+                }
+            }
+        }
+    }
+    if (gvl.state) {
+        rb_jump_tag(gvl.state);
+    }
+    if (error) {
+        raise_parse_error(error);
+    }
+    if (too_large) {
+        rb_raise(rb_eHeapProfilerCapacityError, "This heap dump has too many objects to build its graph");
+    }
+    if (streamed) {
+        rb_raise(rb_eArgError, "Only regular files can be sampled");
+    }
+    RB_GC_GUARD(class_index);
+    RB_GC_GUARD(string_index);
+    return result;
+}
+
+extern "C" {
+    void Init_heap_profiler(void) {
+        sym_type = ID2SYM(rb_intern("type"));
+        sym_class = ID2SYM(rb_intern("class"));
+        sym_address = ID2SYM(rb_intern("address"));
+        sym_edge_name = ID2SYM(rb_intern("edge_name"));
+        sym_value = ID2SYM(rb_intern("value"));
+        sym_memsize = ID2SYM(rb_intern("memsize"));
+        sym_struct = ID2SYM(rb_intern("struct"));
+        sym_imemo_type = ID2SYM(rb_intern("imemo_type"));
+        sym_file = ID2SYM(rb_intern("file"));
+        sym_line = ID2SYM(rb_intern("line"));
+        sym_shared = ID2SYM(rb_intern("shared"));
+        sym_references = ID2SYM(rb_intern("references"));
+        sym_objects = ID2SYM(rb_intern("objects"));
+        sym_memory = ID2SYM(rb_intern("memory"));
+        sym_files = ID2SYM(rb_intern("files"));
+        sym_classes = ID2SYM(rb_intern("classes"));
+        sym_locations = ID2SYM(rb_intern("locations"));
+        sym_strings = ID2SYM(rb_intern("strings"));
+        sym_shape_edges = ID2SYM(rb_intern("shape_edges"));
+        sym_index = ID2SYM(rb_intern("index"));
+        sym_class_index = ID2SYM(rb_intern("class_index"));
+        sym_string_index = ID2SYM(rb_intern("string_index"));
+        sym_added = ID2SYM(rb_intern("added"));
+        sym_removed = ID2SYM(rb_intern("removed"));
+        sym_retained = ID2SYM(rb_intern("retained"));
+        sym_addresses = ID2SYM(rb_intern("addresses"));
+        sym_survivors = ID2SYM(rb_intern("survivors"));
+        sym_approximate_locations = ID2SYM(rb_intern("approximate_locations"));
+        sym_approximate_strings = ID2SYM(rb_intern("approximate_strings"));
+        sym_sample = ID2SYM(rb_intern("sample"));
+        sym_rate = ID2SYM(rb_intern("rate"));
+        sym_gems = ID2SYM(rb_intern("gems"));
+        sym_dom = ID2SYM(rb_intern("dom"));
+        sym_ondemand = ID2SYM(rb_intern("ondemand"));
+        sym_scanner = ID2SYM(rb_intern("scanner"));
+        id_uminus = rb_intern("-@");
+        id_call = rb_intern("call");
+        id_uniq_bang = rb_intern("uniq!");
+
+        VALUE rb_mHeapProfiler = rb_const_get(rb_cObject, rb_intern("HeapProfiler"));
+
+        rb_eHeapProfilerError = rb_const_get(rb_mHeapProfiler, rb_intern("Error"));
+        rb_global_variable(&rb_eHeapProfilerError);
+
+        rb_eHeapProfilerCapacityError = rb_const_get(rb_mHeapProfiler, rb_intern("CapacityError"));
+        rb_global_variable(&rb_eHeapProfilerCapacityError);
+
+        VALUE rb_mHeapProfilerParser = rb_const_get(rb_mHeapProfiler, rb_intern("Parser"));
+
+        rb_cHeapProfilerClassIndex = rb_const_get(rb_mHeapProfilerParser, rb_intern("ClassIndex"));
+        rb_global_variable(&rb_cHeapProfilerClassIndex);
+        rb_define_alloc_func(rb_cHeapProfilerClassIndex, class_index_allocate);
+        rb_define_method(rb_cHeapProfilerClassIndex, "size", reinterpret_cast<VALUE (*)(...)>(rb_heap_class_index_size), 0);
+        rb_define_method(rb_cHeapProfilerClassIndex, "lookup", reinterpret_cast<VALUE (*)(...)>(rb_heap_class_index_lookup), 1);
+        rb_define_method(rb_cHeapProfilerClassIndex, "each", reinterpret_cast<VALUE (*)(...)>(rb_heap_class_index_each), 0);
+
+        rb_cHeapProfilerAddressSet = rb_const_get(rb_mHeapProfilerParser, rb_intern("AddressSet"));
+        rb_global_variable(&rb_cHeapProfilerAddressSet);
+        rb_define_alloc_func(rb_cHeapProfilerAddressSet, address_set_allocate);
+        rb_define_method(rb_cHeapProfilerAddressSet, "size", reinterpret_cast<VALUE (*)(...)>(rb_heap_address_set_size), 0);
+        rb_define_method(rb_cHeapProfilerAddressSet, "include?", reinterpret_cast<VALUE (*)(...)>(rb_heap_address_set_include), 1);
+        rb_define_method(rb_cHeapProfilerAddressSet, "-", reinterpret_cast<VALUE (*)(...)>(rb_heap_address_set_difference), 1);
+
+        rb_cHeapProfilerObjectGraph = rb_const_get(rb_mHeapProfilerParser, rb_intern("ObjectGraph"));
+        rb_global_variable(&rb_cHeapProfilerObjectGraph);
+        rb_define_alloc_func(rb_cHeapProfilerObjectGraph, object_graph_allocate);
+        rb_define_method(rb_cHeapProfilerObjectGraph, "size", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph_size), 0);
+        rb_define_method(rb_cHeapProfilerObjectGraph, "edge_count", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph_edge_count), 0);
+        rb_define_method(rb_cHeapProfilerObjectGraph, "include?", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph_include), 1);
+        rb_define_method(rb_cHeapProfilerObjectGraph, "memsize_of", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph_memsize_of), 1);
+        rb_define_method(rb_cHeapProfilerObjectGraph, "references", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph_references), 1);
+        rb_define_method(rb_cHeapProfilerObjectGraph, "retained_size_of", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph_retained_size_of), 1);
+        rb_define_method(rb_cHeapProfilerObjectGraph, "dominator_of", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph_dominator_of), 1);
+
+        rb_cHeapProfilerReferrerIndex = rb_const_get(rb_mHeapProfilerParser, rb_intern("ReferrerIndex"));
+        rb_global_variable(&rb_cHeapProfilerReferrerIndex);
+        rb_define_alloc_func(rb_cHeapProfilerReferrerIndex, referrer_index_allocate);
+        rb_define_method(rb_cHeapProfilerReferrerIndex, "size", reinterpret_cast<VALUE (*)(...)>(rb_heap_referrer_index_size), 0);
+        rb_define_method(rb_cHeapProfilerReferrerIndex, "referrers", reinterpret_cast<VALUE (*)(...)>(rb_heap_referrer_index_referrers), 1);
+        rb_define_method(rb_cHeapProfilerReferrerIndex, "line_offset", reinterpret_cast<VALUE (*)(...)>(rb_heap_referrer_index_line_offset), 1);
+        rb_define_method(rb_cHeapProfilerReferrerIndex, "root_of", reinterpret_cast<VALUE (*)(...)>(rb_heap_referrer_index_root_of), 1);
+        rb_define_method(rb_cHeapProfilerReferrerIndex, "retention_path", reinterpret_cast<VALUE (*)(...)>(rb_heap_referrer_index_retention_path), 1);
+        rb_define_method(rb_cHeapProfilerReferrerIndex, "retention_path_to_instances", reinterpret_cast<VALUE (*)(...)>(rb_heap_referrer_index_retention_path_to_instances), 1);
 
-        VALUE rb_mHeapProfilerParserNative = rb_const_get(rb_const_get(rb_mHeapProfiler, rb_intern("Parser")), rb_intern("Native"));
+        VALUE rb_mHeapProfilerParserNative = rb_const_get(rb_mHeapProfilerParser, rb_intern("Native"));
         rb_define_alloc_func(rb_mHeapProfilerParserNative, parser_allocate);
-        rb_define_method(rb_mHeapProfilerParserNative, "_build_index", reinterpret_cast<VALUE (*)(...)>(rb_heap_build_index), 2);
+        rb_define_method(rb_mHeapProfilerParserNative, "_build_index", reinterpret_cast<VALUE (*)(...)>(rb_heap_build_index), 4);
         rb_define_method(rb_mHeapProfilerParserNative, "parse_address", reinterpret_cast<VALUE (*)(...)>(rb_heap_parse_address), 1);
-        rb_define_method(rb_mHeapProfilerParserNative, "_load_many", reinterpret_cast<VALUE (*)(...)>(rb_heap_load_many), 3);
+        rb_define_method(rb_mHeapProfilerParserNative, "parse_addresses", reinterpret_cast<VALUE (*)(...)>(rb_heap_parse_addresses), 1);
+        rb_define_method(rb_mHeapProfilerParserNative, "_load_many", reinterpret_cast<VALUE (*)(...)>(rb_heap_load_many), 5);
+        rb_define_method(rb_mHeapProfilerParserNative, "_aggregate", reinterpret_cast<VALUE (*)(...)>(rb_heap_aggregate), 12);
+        rb_define_method(rb_mHeapProfilerParserNative, "_load_index_cache", reinterpret_cast<VALUE (*)(...)>(rb_heap_load_index_cache), 2);
+        rb_define_method(rb_mHeapProfilerParserNative, "_save_index_cache", reinterpret_cast<VALUE (*)(...)>(rb_heap_save_index_cache), 4);
+        rb_define_method(rb_mHeapProfilerParserNative, "_addresses_set", reinterpret_cast<VALUE (*)(...)>(rb_heap_addresses_set), 4);
+        rb_define_method(rb_mHeapProfilerParserNative, "_diff", reinterpret_cast<VALUE (*)(...)>(rb_heap_diff), 4);
+        rb_define_method(rb_mHeapProfilerParserNative, "_compare", reinterpret_cast<VALUE (*)(...)>(rb_heap_compare), 7);
+        rb_define_method(rb_mHeapProfilerParserNative, "_object_graph", reinterpret_cast<VALUE (*)(...)>(rb_heap_object_graph), 4);
+        rb_define_method(rb_mHeapProfilerParserNative, "_referrer_index", reinterpret_cast<VALUE (*)(...)>(rb_heap_referrer_index), 4);
+        rb_define_method(rb_mHeapProfilerParserNative, "_load_referrer_index", reinterpret_cast<VALUE (*)(...)>(rb_heap_load_referrer_index), 2);
+        rb_define_method(rb_mHeapProfilerParserNative, "_save_referrer_index", reinterpret_cast<VALUE (*)(...)>(rb_heap_save_referrer_index), 3);
     }
 }
@@ -2,11 +2,40 @@
 
 module HeapProfiler
   class Analyzer
+    class << self
+      # The first `max` of `values` in the order of the `sort` style `compare` block, without sorting them all:
+      # `Enumerable#max(n)` only keeps a buffer of the best candidates. That buffer is allocated upfront though,
+      # so `values` are simply sorted when they all fit.
+      def top(values, max, &compare)
+        return values.sort(&compare).take(max) if max >= values.size
+
+        values.max(max) { |a, b| compare.call(b, a) }
+      end
+    end
+
+    # Formatting "file:line" for each object would allocate and hash a new string every time, so location
+    # names are memoized by file and line instead. Files are deduped by the parser, hence keyed by identity.
+    class LocationNames
+      def initialize
+        @lines_by_file = {}.compare_by_identity
+      end
+
+      def [](file, line)
+        lines = (@lines_by_file[file] ||= {})
+        lines[line] ||= "#{file}:#{line}".freeze
+      end
+    end
+
     class Dimension
-      attr_reader :objects, :memory
+      # Sampled totals are within this many standard errors of the actual ones with 95% confidence.
+      CONFIDENCE_Z = 1.96
+
+      attr_reader :objects, :memory, :sample_rate
       def initialize
         @objects = 0
         @memory = 0
+        @sample_rate = nil
+        @margins = nil
       end
 
       def process(_index, object)
@@ -14,6 +43,40 @@ module HeapProfiler
         @memory += object[:memsize]
       end
 
+      # The tables `Parser.aggregate` must compute for `process_aggregate`.
+      def native_tables
+        []
+      end
+
+      # The sampled chunks of the dump are a Bernoulli sample, so the variance of the scaled totals
+      # is estimated from the sums of the squared totals of each chunk.
+      def process_aggregate(_index, aggregate)
+        @objects += aggregate[:objects]
+        @memory += aggregate[:memory]
+        if (sample = aggregate[:sample])
+          rate = @sample_rate = sample[:rate]
+          @margins = {
+            "objects" => (CONFIDENCE_Z * Math.sqrt((1 - rate) * sample[:objects]) / rate).round,
+            "memory" => (CONFIDENCE_Z * Math.sqrt((1 - rate) * sample[:memory]) / rate).round,
+          }
+        end
+      end
+
+      # Scale the counts aggregated from a sample of the dump up to estimates for the whole dump.
+      def scale(factor)
+        @objects = (@objects * factor).round
+        @memory = (@memory * factor).round
+      end
+
+      def sampled?
+        !@sample_rate.nil?
+      end
+
+      # The half width of the 95% confidence interval of a sampled total, 0 for exact ones.
+      def margin(metric)
+        @margins ? @margins.fetch(metric) : 0
+      end
+
       def stats(metric)
         case metric
         when "objects"
@@ -28,12 +91,12 @@ module HeapProfiler
 
     class GroupedDimension < Dimension
       class << self
-        def build(grouping)
+        def build(grouping, approximate: false)
           klass = case grouping
           when "file"
             FileGroupDimension
           when "location"
-            LocationGroupDimension
+            approximate ? ApproximateLocationGroupDimension : LocationGroupDimension
           when "gem"
             GemGroupDimension
           when "class"
@@ -45,9 +108,12 @@ module HeapProfiler
         end
       end
 
+      attr_reader :retained_size
+
       def initialize
         @objects = Hash.new { |h, k| h[k] = 0 }
         @memory = Hash.new { |h, k| h[k] = 0 }
+        @retained_size = Hash.new { |h, k| h[k] = 0 }
       end
 
       def process(index, object)
@@ -57,16 +123,36 @@ module HeapProfiler
         end
       end
 
+      def add(group, objects, memory)
+        @objects[group] += objects
+        @memory[group] += memory
+      end
+
+      # Retained sizes are only computed by `Parser.aggregate`, from its `:retained` table.
+      def add_retained_size(group, memory)
+        @retained_size[group] += memory
+      end
+
+      def scale(factor)
+        [@objects, @memory].each { |stats| stats.transform_values! { |value| (value * factor).round } }
+      end
+
+      def stats(metric)
+        metric == "retained_size" ? retained_size : super
+      end
+
+      # How much the `metric` of `group` may be overestimated. Only approximate dimensions have errors.
+      def error(_metric, _group)
+        0
+      end
+
+      # Groups are tie-broken on their name so that the selected rows don't
+      # depend on the order in which they were processed.
       def top_n(metric, max)
-        values = stats(metric).sort do |a, b|
-          b[1] <=> a[1]
-        end
-        top = values.take(max)
-        top.sort! do |a, b|
+        Analyzer.top(stats(metric), max) do |a, b|
           cmp = b[1] <=> a[1]
           cmp == 0 ? b[0] <=> a[0] : cmp
         end
-        top
       end
     end
 
@@ -77,19 +163,88 @@ module HeapProfiler
           @memory[group] += object[:memsize]
         end
       end
+
+      def native_tables
+        [:files]
+      end
+
+      def process_aggregate(_index, aggregate)
+        aggregate[:files].each do |file, objects, memory|
+          add(file, objects, memory) if file
+        end
+        aggregate.dig(:retained, :files)&.each do |file, memory|
+          add_retained_size(file, memory)
+        end
+      end
     end
 
     class LocationGroupDimension < GroupedDimension
+      def initialize
+        super
+        @names = LocationNames.new
+      end
+
       def process(_index, object)
         file = object[:file]
         line = object[:line]
 
         if file && line
-          group = "#{file}:#{line}"
+          group = @names[file, line]
           @objects[group] += 1
           @memory[group] += object[:memsize]
         end
       end
+
+      def native_tables
+        [:locations]
+      end
+
+      # Only the top locations for each metric are returned by `Parser.aggregate`.
+      def process_aggregate(_index, aggregate)
+        aggregate[:locations].each do |location, objects, memory|
+          add(location, objects, memory)
+        end
+        aggregate.dig(:retained, :locations)&.each do |location, memory|
+          add_retained_size(location, memory)
+        end
+      end
+    end
+
+    # Locations counted by native sketches of bounded size rather than exactly, see `Analyzer#run`'s
+    # `approximate` option. The count of a location is overestimated by at most its error.
+    class ApproximateLocationGroupDimension < LocationGroupDimension
+      def initialize
+        super
+        @errors = { "objects" => Hash.new(0), "memory" => Hash.new(0) }
+      end
+
+      def error(metric, group)
+        @errors.key?(metric) ? @errors[metric][group] : 0
+      end
+
+      def scale(factor)
+        super
+        @errors.each_value { |errors| errors.transform_values! { |error| (error * factor).round } }
+      end
+
+      def native_tables
+        [:approximate_locations]
+      end
+
+      def process_aggregate(_index, aggregate)
+        locations = aggregate[:approximate_locations]
+        locations[:objects].each do |location, objects, error|
+          @objects[location] += objects
+          @errors["objects"][location] += error
+        end
+        locations[:memory].each do |location, memory, error|
+          @memory[location] += memory
+          @errors["memory"][location] += error
+        end
+        aggregate.dig(:retained, :locations)&.each do |location, memory|
+          add_retained_size(location, memory)
+        end
+      end
     end
 
     class GemGroupDimension < GroupedDimension
@@ -99,6 +254,22 @@ module HeapProfiler
           @memory[group] += object[:memsize]
         end
       end
+
+      def native_tables
+        [:files]
+      end
+
+      # Retained sizes are computed natively by gem, from `Analyzer#gems_of`.
+      def process_aggregate(index, aggregate)
+        aggregate[:files].each do |file, objects, memory|
+          if (group = index.guess_gem(file: file))
+            add(group, objects, memory)
+          end
+        end
+        aggregate.dig(:retained, :gems)&.each do |gem, memory|
+          add_retained_size(gem, memory)
+        end
+      end
     end
 
     class ClassGroupDimension < GroupedDimension
@@ -108,74 +279,152 @@ module HeapProfiler
           @memory[group] += object[:memsize]
         end
       end
+
+      def native_tables
+        [:classes]
+      end
+
+      # Class names are resolved once per distinct type, class, imemo_type and struct. Retained sizes are
+      # computed natively by class name, from `Analyzer#classes_of`.
+      def process_aggregate(index, aggregate)
+        aggregate[:classes].each do |object, objects, memory|
+          if (group = index.guess_class(object))
+            add(group, objects, memory)
+          end
+        end
+        aggregate.dig(:retained, :classes)&.each do |name, memory|
+          add_retained_size(name, memory)
+        end
+      end
     end
 
     class StringDimension
       class StringLocation
-        attr_reader :location, :count, :memsize
+        attr_reader :location, :count, :memsize, :error
 
         def initialize(location)
           @location = location
           @count = 0
           @memsize = 0
+          @error = 0
         end
 
         def process(object)
           @count += 1
           @memsize += object[:memsize]
         end
+
+        def add(count, memsize, error = 0)
+          @count += count
+          @memsize += memsize
+          @error += error
+        end
+
+        def scale(factor)
+          @count = (@count * factor).round
+          @memsize = (@memsize * factor).round
+          @error = (@error * factor).round
+        end
       end
 
       class StringGroup
-        attr_reader :value, :count, :memsize, :locations
+        attr_reader :value, :count, :memsize, :error, :locations
         def initialize(value) # TODO: should we consider encoding?
           @value = value
           @locations_counts = Hash.new { |h, k| h[k] = StringLocation.new(k) }
           @count = 0
           @memsize = 0
+          @error = 0
         end
 
-        def process(object)
+        def process(object, names)
           @count += 1
           @memsize += object[:memsize]
           if (file = object[:file]) && (line = object[:line])
-            @locations_counts["#{file}:#{line}"].process(object)
+            @locations_counts[names[file, line]].process(object)
           end
         end
 
+        def add(count, memsize, error = 0)
+          @count += count
+          @memsize += memsize
+          @error += error
+        end
+
+        def add_location(location, count, memsize, error = 0)
+          @locations_counts[location].add(count, memsize, error)
+        end
+
+        def scale(factor)
+          @count = (@count * factor).round
+          @memsize = (@memsize * factor).round
+          @error = (@error * factor).round
+          @locations_counts.each_value { |location| location.scale(factor) }
+        end
+
         def top_n(max)
-          values = @locations_counts.values
-          values.sort! do |a, b|
+          Analyzer.top(@locations_counts.values, max) do |a, b|
             cmp = b.count <=> a.count
             cmp == 0 ? b.location <=> a.location : cmp
           end
-          values.take(max)
         end
       end
 
       attr_reader :stats
       def initialize
         @stats = Hash.new { |h, k| h[k] = StringGroup.new(k) }
+        @names = LocationNames.new
       end
 
       def process(_index, object)
         return unless object[:type] == :STRING
         value = object[:value]
         return unless value # broken strings etc
-        @stats[value].process(object)
+        @stats[value].process(object, @names)
       end
 
-      def top_n(max)
-        values = @stats.values
-        values.sort! do |a, b|
-          b.count <=> a.count
+      def native_tables
+        [:strings]
+      end
+
+      # Only the top strings, and their top locations, are returned by `Parser.aggregate`.
+      def process_aggregate(_index, aggregate)
+        aggregate[:strings].each do |value, count, memsize, locations|
+          group = @stats[value]
+          group.add(count, memsize)
+          locations.each do |location, location_count, location_memsize|
+            group.add_location(location, location_count, location_memsize)
+          end
         end
-        top = values.take(max)
-        top.sort! do |a, b|
+      end
+
+      def scale(factor)
+        @stats.each_value { |group| group.scale(factor) }
+      end
+
+      def top_n(max)
+        Analyzer.top(@stats.values, max) do |a, b|
           cmp = b.count <=> a.count
           cmp == 0 ? b.value <=> a.value : cmp
         end
-        top
+      end
+    end
+
+    # Strings counted by native sketches of bounded size rather than exactly, like `ApproximateLocationGroupDimension`.
+    # The counts of strings and of their locations are overestimated by at most their `error`.
+    class ApproximateStringDimension < StringDimension
+      def native_tables
+        [:approximate_strings]
+      end
+
+      def process_aggregate(_index, aggregate)
+        aggregate[:approximate_strings].each do |value, count, memsize, error, locations|
+          group = @stats[value]
+          group.add(count, memsize, error)
+          locations.each do |location, location_count, location_memsize, location_error|
+            group.add_location(location, location_count, location_memsize, location_error)
+          end
+        end
       end
     end
 
@@ -190,15 +439,29 @@ module HeapProfiler
         end
       end
 
+      def native_tables
+        [:shape_edges]
+      end
+
+      def process_aggregate(_index, aggregate)
+        aggregate[:shape_edges].each do |name, count|
+          @stats[name] += count
+        end
+      end
+
+      def scale(factor)
+        @stats.transform_values! { |count| (count * factor).round }
+      end
+
       def top_n(max)
-        @stats.sort do |(a_name, a_count), (b_name, b_count)|
+        Analyzer.top(@stats, max) do |(a_name, a_count), (b_name, b_count)|
           cmp = b_count <=> a_count
           if cmp == 0
             a_name <=> b_name
           else
             cmp
           end
-        end.take(max)
+        end
       end
     end
 
@@ -207,26 +470,71 @@ module HeapProfiler
       @index = index
     end
 
-    def run(metrics, groupings)
+    # With `approximate`, a number of counters, locations and strings are counted natively in sketches of that
+    # many counters per thread, which bounds their memory on huge dumps, at the cost of approximate counts.
+    #
+    # With a `sample` rate, e.g. 0.1, only chunks of about that fraction of the dump are parsed, and all counts are
+    # scaled up by its inverse. The totals then have the `margin` of their 95% confidence interval.
+    def run(metrics, groupings, max: AbstractResults.top_entries_count, approximate: nil, sample: nil)
       dimensions = {}
       metrics.each do |metric|
         if metric == "strings"
-          dimensions["strings"] = StringDimension.new
+          dimensions["strings"] = approximate ? ApproximateStringDimension.new : StringDimension.new
         elsif metric == "shape_edges"
           dimensions["shape_edges"] = ShapeEdgeDimension.new
         else
           dimensions["total"] = Dimension.new
           groupings.each do |grouping|
-            dimensions[grouping] = GroupedDimension.build(grouping)
+            dimensions[grouping] = GroupedDimension.build(grouping, approximate: !!approximate)
           end
         end
       end
 
       processors = dimensions.values
-      @heap.each_object do |object|
-        processors.each { |p| p.process(@index, object) }
+      if @heap.respond_to?(:aggregate)
+        # Let the native parser do the heavy lifting, and only materialize the resulting tables.
+        tables = processors.flat_map(&:native_tables).uniq
+        tables << :retained if metrics.include?("retained_size")
+        # Class names are only resolved once the pass is done, so the index can be built in the same pass
+        # when it's for the same dump, rather than parsing it twice.
+        fused = !@index.built? && @index.heap.path == @heap.path && !@index.load_cache
+        tables << :index if fused
+
+        if metrics.include?("retained_size")
+          classes = method(:classes_of) if groupings.include?("class")
+          gems = method(:gems_of) if groupings.include?("gem")
+        end
+        aggregate = @heap.aggregate(tables: tables, max: max, approximate: approximate, sample: sample, classes: classes,
+          gems: gems)
+        if fused
+          @index.load(aggregate[:class_index], aggregate[:string_index])
+          # A sampled index is missing strings, so it isn't worth saving.
+          Parser.save_index(@heap.path, aggregate[:class_index], aggregate[:string_index]) unless sample
+        end
+        processors.each { |p| p.process_aggregate(@index, aggregate) }
+        processors.each { |p| p.scale(1.0 / sample) } if sample
+      else
+        raise ArgumentError, "Only native aggregations can be sampled" if sample
+        @heap.each_object do |object|
+          processors.each { |p| p.process(@index, object) }
+        end
       end
       dimensions
     end
+
+    private
+
+    # The name of each class key, for `Parser::Native#aggregate` to group retained memory by class name. Many keys
+    # share a name, e.g. all strings are "String", and an object dominated by another of the same name is only
+    # counted once. When the index is built in the same pass, it's only loaded once the graph is built.
+    def classes_of(keys, class_index, string_index)
+      @index.load(class_index, string_index) if class_index
+      keys.map { |key| @index.guess_class(key) }
+    end
+
+    # The gem of each file, for `Parser::Native#aggregate` to group retained memory by gem.
+    def gems_of(files)
+      files.map { |file| @index.guess_gem(file: file) }
+    end
   end
 end
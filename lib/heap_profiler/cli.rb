@@ -9,6 +9,10 @@ module HeapProfiler
 
     def run
       parser.parse!(@argv)
+      if @sample && @retained_size
+        $stderr.puts("Retained sizes can't be sampled, they require the whole object graph")
+        return 1
+      end
 
       begin
         case @argv.first
@@ -18,6 +22,13 @@ module HeapProfiler
         when "report"
           print_report(@argv[1])
           return 0
+        when "why"
+          return print_retention_path(@argv[1], @argv[2]) if @argv.size == 3
+        when "growth"
+          if @argv.size >= 3
+            print_growth(@argv.drop(1))
+            return 0
+          end
         else
           if @argv.size == 1
             print_report(@argv.first)
@@ -26,25 +37,56 @@ module HeapProfiler
         end
       rescue CapacityError => error
         STDERR.puts(error.message)
-        STDERR.puts("Current size: #{Parser.batch_size}B")
-        STDERR.puts("Try increasing it with --batch-size")
-        STDERR.puts
+        return 1
       end
       print_usage
       1
     end
 
     def print_report(path)
+      metrics = AbstractResults::METRICS
+      metrics += ["retained_size"] if @retained_size
       results = if File.directory?(path)
         if @retained_only
-          DiffResults.new(path, ["retained"])
+          DiffResults.new(path, ["retained"], metrics)
         else
-          DiffResults.new(path)
+          DiffResults.new(path, DiffResults::TYPES, metrics)
         end
       else
-        HeapResults.new(path)
+        HeapResults.new(path, metrics)
+      end
+      results.pretty_print(scale_bytes: true, normalize_paths: true, approximate: @approximate, sample: @sample)
+    end
+
+    def print_growth(paths)
+      GrowthResults.new(paths).pretty_print(scale_bytes: true, normalize_paths: true)
+    end
+
+    # Print the shortest chain of references from a ROOT line to `target`, either the address of an object,
+    # or the name of a class, in which case the chain leads to its closest instance.
+    def print_retention_path(path, target)
+      heap = Dump.new(path)
+      index = Index.new(heap)
+      referrers = Parser.referrer_index(path)
+      retention_path = if /\A0x\h+\z/i.match?(target)
+        referrers.retention_path([target.to_i(16)])
+      else
+        classes = index.classes.select { |_address, name| name == target }.map(&:first)
+        referrers.retention_path_to_instances(classes)
+      end
+
+      unless retention_path
+        $stderr.puts("#{target} isn't reachable from the GC roots")
+        return 1
       end
-      results.pretty_print(scale_bytes: true, normalize_paths: true)
+
+      puts "ROOT (#{referrers.root_of(retention_path.first)})"
+      retention_path.each do |address|
+        object = heap.object_at(referrers.line_offset(address))
+        location = "  #{object[:file]}:#{object[:line]}" if object[:file]
+        puts "  -> 0x#{address.to_s(16)}  #{index.guess_class(object)}#{location}"
+      end
+      0
     end
 
     def clean_dump(path)
@@ -75,6 +117,9 @@ module HeapProfiler
       puts @parser.help
     end
 
+    # Enough to find the heaviest locations and strings of most dumps exactly, in at most around 60MB per thread.
+    APPROXIMATE_COUNTERS = 100_000
+
     SIZE_UNITS = {
       'B' => 1,
       'K' => 1_000,
@@ -112,6 +157,14 @@ module HeapProfiler
 
             clean: Remove all malformed lines from the provided heap dump. Can be useful to workaround some ruby bugs.
 
+            why: Print the shortest chain of references from the GC roots to an object of the provided heap dump,
+                 given its address, or to the closest instance of a class, given its name.
+                 e.g. heap-profiler why path/to/file.heap 0x7f921e88a8f8
+
+            growth: Compare a series of heap dumps taken from the same process over time, oldest first. Reports the groups
+                    that kept growing, and the objects allocated between the first two dumps that are still alive in the others.
+                    e.g. heap-profiler growth tmp/1.heap tmp/2.heap tmp/3.heap
+
           GLOBAL OPTIONS
         EOS
         opts.separator ""
@@ -120,13 +173,43 @@ module HeapProfiler
           @retained_only = true
         end
 
+        opts.on('--retained-size', 'Also report the memory each group keeps alive, from the dominator tree of the objects.') do
+          @retained_size = true
+        end
+
+        help = "Count locations and strings approximately, with NUM counters per thread. (Defaults to #{APPROXIMATE_COUNTERS})"
+        opts.on("--approximate[=NUM]", Integer, help) do |arg|
+          @approximate = arg || APPROXIMATE_COUNTERS
+          if @approximate < 1
+            STDERR.puts "Invalid approximate: the number of counters must be positive"
+            exit 1
+          end
+        end
+
+        opts.on("--sample=RATE", Float, "Only parse a random fraction of the dump, e.g. 0.1, and scale its counts up.") do |arg|
+          @sample = arg
+          unless @sample > 0 && @sample <= 1
+            STDERR.puts "Invalid sample: the rate must be greater than 0 and at most 1"
+            exit 1
+          end
+        end
+
         HeapProfiler::AbstractResults.top_entries_count = 50
         opts.on("-m", "--max=NUM", Integer, "Max number of entries to output. (Defaults to 50)") do |arg|
           HeapProfiler::AbstractResults.top_entries_count = arg
         end
 
+        opts.on("-j", "--threads=NUM", Integer, "Number of threads used to parse a single heap dump. (Defaults to 1)") do |arg|
+          HeapProfiler::Parser.threads = arg
+        end
+
+        HeapProfiler::Parser.index_cache = true
+        opts.on("--[no-]index-cache", "Save the dump index next to it, and reuse it in later runs. (Defaults to true)") do |arg|
+          HeapProfiler::Parser.index_cache = arg
+        end
+
         help = <<~EOS.lines.join(" ")
-          Sets the simdjson parser batch size. It must be larger than the largest JSON document in the heap dump, and defaults to 10MB.
+          Sets the simdjson parser batch size. Larger JSON documents are parsed individually. Defaults to 1MB.
         EOS
         opts.on('--batch-size SIZE', help.strip) do |size_string|
           HeapProfiler::Parser.batch_size = parse_byte_size(size_string)
@@ -3,6 +3,8 @@
 module HeapProfiler
   class Diff
     class DumpSubset
+      attr_reader :path
+
       def initialize(path, generation)
         @path = path
         @generation = generation
@@ -11,6 +13,10 @@ module HeapProfiler
       def each_object(&block)
         Parser.load_many(@path, since: @generation, &block)
       end
+
+      def aggregate(**kwargs)
+        Parser.aggregate(@path, since: @generation, **kwargs)
+      end
     end
 
     attr_reader :allocated
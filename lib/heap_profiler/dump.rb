@@ -54,36 +54,54 @@ module HeapProfiler
     # Before 2.7 it will allocate one String per class to get its name.
     # After 2.7, it only allocate a couple hashes, a file etc.
     #
-    # Either way we need to exclude them from the reports
+    # Either way we need to exclude them from the reports, so we write to `file` the lines of objects
+    # that aren't in `other`. Lines without an address, like ROOT ones, are always written.
     def diff(other, file)
-      each_line_with_address do |line, address|
-        file << line unless other.index.include?(address)
-      end
+      Parser.diff(path, other.index, file)
+    end
+
+    # Compare this dump with `other`, an earlier dump, without holding a set of either's addresses.
+    # The lines of the `added`, `removed` and `retained` objects are written to the corresponding IO if any,
+    # and their counts are returned, e.g. `{ added: 12, removed: 3, retained: 4567 }`.
+    def compare(other, added: nil, removed: nil, retained: nil)
+      Parser.compare(other.path, path, added: added, removed: removed, retained: retained)
     end
 
+    # The path may also be a pipe, e.g. `/dev/stdin`, in which case the dump is streamed
+    # through a buffer of twice `Parser.batch_size`, but can only be read once.
     def each_object(since: nil, &block)
       Parser.load_many(path, since: since, &block)
     end
 
+    def aggregate(**kwargs)
+      Parser.aggregate(path, **kwargs)
+    end
+
     def stats
       @stats ||= GlobalStats.from(self)
     end
 
+    # The object on the line starting at `offset`, e.g. as found with `Parser::ReferrerIndex#line_offset`,
+    # with its type and addresses parsed like `each_object` yields them.
+    def object_at(offset)
+      require "json"
+      line = File.open(path) do |file|
+        file.seek(offset)
+        file.gets
+      end
+      object = JSON.parse(line, symbolize_names: true)
+      object[:type] = object[:type]&.to_sym
+      object[:address] = object[:address].to_i(16) if object[:address]
+      object[:class] = object[:class].to_i(16) if object[:class]
+      object
+    end
+
     def size
       @size ||= File.open(path).each_line.count
     end
 
     def index
-      @index ||= Native.addresses_set(path)
-    end
-
-    def each_line_with_address
-      File.open(path).each_line do |line|
-        # This is a cheap, hacky extraction of addresses.
-        # So far it seems to work on 2.7.1 but that might not hold true on all versions.
-        # Also the root objects don't have an address, but that's fine
-        yield line, line.byteslice(14, 12).to_i(16)
-      end
+      @index ||= Parser.addresses_set(path)
     end
 
     def exist?
@@ -6,6 +6,7 @@ require "heap_profiler/dump"
 require "heap_profiler/index"
 require "heap_profiler/diff"
 require "heap_profiler/analyzer"
+require "heap_profiler/growth"
 require "heap_profiler/polychrome"
 require "heap_profiler/monochrome"
 require "heap_profiler/results"
@@ -0,0 +1,93 @@
+# frozen_string_literal: true
+
+module HeapProfiler
+  # Tracks the objects of a series of dumps taken from the same process over time, to find what keeps growing.
+  #
+  # Each dump is only aggregated once, natively, in a pass which also triangulates leaks: objects allocated
+  # between the first two snapshots, i.e. that are in the second one but not in the first, and that are still
+  # alive in every later snapshot are likely retained by mistake. Only the addresses of those candidates are
+  # kept from one snapshot to the next.
+  class Growth
+    # Snapshots are compared group by group, so all the groups are needed, not only the top ones.
+    ALL_GROUPS = 1 << 30
+    METRICS = ["memory", "objects"].freeze
+
+    # A dump, as seen by `Analyzer`, which also collects the addresses of its objects, or of the survivors
+    # of the previous snapshots, from the same pass.
+    class Snapshot
+      attr_reader :path, :addresses, :survivors
+
+      def initialize(path, addresses: false, survivors: nil)
+        @path = path
+        @track_addresses = addresses
+        @candidates = survivors
+      end
+
+      def aggregate(tables:, **kwargs)
+        tables += [:addresses] if @track_addresses
+        result = Parser.aggregate(@path, tables: tables, survivors: @candidates, **kwargs)
+        @addresses = result[:addresses]
+        @survivors = result[:survivors]
+        result
+      end
+    end
+
+    attr_reader :paths, :snapshots, :survivors
+
+    def initialize(paths, groupings = AbstractResults::GROUPINGS)
+      @paths = paths
+      @groupings = groupings
+      @snapshots = nil
+      @survivors = nil
+    end
+
+    def run
+      previous = candidates = nil
+      @snapshots = @paths.each_with_index.map do |path, position|
+        snapshot = Snapshot.new(path, addresses: position < 2, survivors: (candidates if position >= 2))
+        index = Index.new(Dump.new(path))
+        dimensions = Analyzer.new(snapshot, index).run(METRICS, @groupings, max: ALL_GROUPS)
+
+        case position
+        when 0
+          previous = snapshot.addresses
+        when 1
+          candidates = snapshot.addresses - previous
+          previous = nil
+        else
+          candidates = snapshot.survivors[:addresses]
+          @survivors = survivor_dimensions(index, snapshot.survivors) if position == @paths.size - 1
+        end
+        dimensions
+      end
+      self
+    end
+
+    # The groups whose `metric` never decreased from one snapshot to the next, and grew overall,
+    # as `[group, values]` pairs with a value per snapshot, the fastest growing first.
+    def growing(grouping, metric)
+      series = Hash.new { |h, k| h[k] = Array.new(@snapshots.size, 0) }
+      @snapshots.each_with_index do |dimensions, position|
+        dimensions[grouping].stats(metric).each do |group, value|
+          series[group][position] = value
+        end
+      end
+
+      growing = series.select do |_group, values|
+        values.last > values.first && values.each_cons(2).all? { |before, after| before <= after }
+      end
+      growing.sort_by { |group, values| [values.first - values.last, group] }
+    end
+
+    private
+
+    def survivor_dimensions(index, aggregate)
+      dimensions = { "total" => Analyzer::Dimension.new }
+      @groupings.each do |grouping|
+        dimensions[grouping] = Analyzer::GroupedDimension.build(grouping)
+      end
+      dimensions.each_value { |dimension| dimension.process_aggregate(index, aggregate) }
+      dimensions
+    end
+  end
+end
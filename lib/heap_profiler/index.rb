@@ -2,19 +2,48 @@
 
 module HeapProfiler
   class Index
+    attr_reader :heap
+
+    # The index is only built once needed, so that `Analyzer` can fill it with `load`
+    # from the same pass it aggregates the dump in.
     def initialize(heap)
       @heap = heap
-      @classes = {}
-      @strings = {}
+      @classes = nil
+      @strings = nil
       @gems = {}
-      build!
     end
 
     def build!
-      @classes, @strings = Parser.build_index(@heap.path)
+      load(*Parser.build_index(@heap.path))
+    end
+
+    # Load the index saved next to the dump, see `Parser.index_cache`. Returns nil if there is none.
+    def load_cache
+      if (index = Parser.cached_index(@heap.path))
+        load(*index)
+      end
+    end
+
+    def load(classes, strings)
+      @classes = classes
+      @strings = strings
       self
     end
 
+    def built?
+      !@classes.nil?
+    end
+
+    def classes
+      build! unless built?
+      @classes
+    end
+
+    def strings
+      build! unless built?
+      @strings
+    end
+
     BUILTIN_CLASSES = {
       FILE: "File",
       ICLASS: "ICLASS",
@@ -46,7 +75,7 @@ module HeapProfiler
       return IMEMO_TYPES[object[:imemo_type]] if type == :IMEMO
 
       class_name = if (class_address = object[:class])
-        @classes.fetch(class_address) do
+        classes.fetch(class_address) do
           return DATA_TYPES[object[:struct]] if type == :DATA
 
           $stderr.puts("WARNING: Couldn't infer class name of: #{object.inspect}")
@@ -66,7 +95,7 @@ module HeapProfiler
       return value if value
 
       if object[:shared]
-        @strings[Native.parse_address(object[:references].first)]
+        strings[object[:references].first]
       end
     end
 
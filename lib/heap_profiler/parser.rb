@@ -5,9 +5,26 @@ module HeapProfiler
     CLASS_DEFAULT_PROC = ->(_hash, key) { "<Class#0x#{key.to_s(16)}>" }
 
     class << self
-      attr_accessor :batch_size
+      attr_accessor :batch_size, :threads, :api, :index_cache
     end
-    self.batch_size = 10_000_000 # 10MB
+    # Documents larger than the batch size, e.g. the ROOT `references` lines, are parsed on their own,
+    # so it can stay small enough for the parser buffers to fit in cache.
+    self.batch_size = 1_000_000 # 1MB
+
+    # Number of shards a single dump is split into and parsed concurrently.
+    # Each extra thread allocates its own parser buffers, see `batch_size`.
+    self.threads = 1
+
+    # The API used by the native parser, either simdjson's `:dom` or `:ondemand`, or `:scanner`.
+    # On Demand skips the fields we don't need, like `references`, rather than building a tape for them.
+    # The scanner only reads lines laid out like ObjectSpace.dump_all writes them, and hands the others to simdjson.
+    self.api = :dom
+
+    # Whether indexes are saved in a sidecar next to their dump, e.g. `allocated.heap.hpidx`, and reused
+    # by later analyses of the same dump. Disabled by default so that the library doesn't write next to dumps.
+    self.index_cache = false
+    INDEX_CACHE_EXTENSION = ".hpidx"
+    REFERRER_INDEX_EXTENSION = ".hpref"
 
     class Ruby
       def build_index(path)
@@ -15,6 +32,7 @@ module HeapProfiler
         classes_index = {}
         classes_index.default_proc = CLASS_DEFAULT_PROC
         strings_index = {}
+        shared_roots = {}
 
         File.open(path).each_line do |line|
           object = JSON.parse(line, symbolize_names: true)
@@ -31,42 +49,196 @@ module HeapProfiler
               classes_index[address] = name
             end
           when 'STRING'
-            next if object[:shared]
-            if (value = object[:value])
+            if object[:shared]
+              shared_roots[parse_address(object[:references].first)] = true
+            elsif (value = object[:value])
               strings_index[parse_address(object[:address])] = value
             end
           end
         end
 
+        # Only the strings shared strings point to are needed to resolve their value.
+        strings_index.select! { |address, _| shared_roots.key?(address) }
         [classes_index, strings_index]
       end
 
       def parse_address(address)
         address.to_i(16)
       end
+
+      def parse_addresses(addresses)
+        addresses.map { |address| parse_address(address) }
+      end
+    end
+
+    # The class names of a dump by address, as returned by `Native#build_index`. It's a compact native table
+    # which only creates Ruby strings when looked up, and otherwise behaves like a Hash with `CLASS_DEFAULT_PROC`.
+    class ClassIndex
+      include Enumerable
+
+      def [](address)
+        lookup(address) || CLASS_DEFAULT_PROC.call(self, address)
+      end
+
+      def fetch(address)
+        if (name = lookup(address))
+          name
+        elsif block_given?
+          yield address
+        else
+          raise KeyError, "class not found: 0x#{address.to_s(16)}"
+        end
+      end
+
+      def key?(address)
+        !lookup(address).nil?
+      end
+      alias_method :include?, :key?
+
+      def values
+        map(&:last)
+      end
+
+      def to_hash
+        hash = to_h
+        hash.default_proc = CLASS_DEFAULT_PROC
+        hash
+      end
+
+      def ==(other)
+        other.respond_to?(:to_hash) && to_hash == other.to_hash
+      end
+    end
+
+    # The sorted addresses of the objects of a dump, as returned by `Native#addresses_set`. Responds to `size`, `include?`,
+    # and `-` to get those that aren't in another set.
+    class AddressSet
+    end
+
+    # The objects of a dump and their references, as returned by `Native#object_graph`. Objects are looked up
+    # by address, and the roots of the dump are the references of address 0.
+    class ObjectGraph
+    end
+
+    # The referrers of each object of a dump, as returned by `Native#referrer_index`, to find out why objects are
+    # retained, e.g. with `retention_path`. Objects referenced by ROOT lines are referenced by address 0.
+    class ReferrerIndex
     end
 
     class Native
-      def build_index(path, batch_size: Parser.batch_size)
-        indexes = _build_index(path, batch_size)
-        indexes.first.default_proc = CLASS_DEFAULT_PROC
-        indexes
+      def build_index(path, batch_size: Parser.batch_size, threads: Parser.threads, api: Parser.api)
+        _build_index(path, batch_size, threads, api)
+      end
+
+      def load_many(path, since: nil, batch_size: Parser.batch_size, threads: Parser.threads, api: Parser.api, &block)
+        _load_many(path, since, batch_size, threads, api, &block)
+      end
+
+      # With a `sample` rate, e.g. 0.1, only about that fraction of the objects are aggregated, and the result
+      # has a `:sample` entry, see `Analyzer#run`. The `:index` table still has every class, but only the strings
+      # of the sample.
+      #
+      # The `:retained` table only has memory retained by gem given `gems`, which maps an array of file paths
+      # to their gem names, or nil, so that objects are grouped by gem while walking the dominator tree.
+      def aggregate(path, tables:, max:, since: nil, survivors: nil, approximate: nil, sample: nil, classes: nil,
+        gems: nil, batch_size: Parser.batch_size, threads: Parser.threads, api: Parser.api)
+        _aggregate(path, since, batch_size, threads, api, tables, max, survivors, approximate, sample, classes, gems)
+      end
+
+      def addresses_set(path, batch_size: Parser.batch_size, threads: Parser.threads, api: Parser.api)
+        _addresses_set(path, batch_size, threads, api)
+      end
+
+      def diff(path, other, io, batch_size: Parser.batch_size)
+        _diff(path, other, io, batch_size)
+      end
+
+      def compare(before, after, added: nil, removed: nil, retained: nil, batch_size: Parser.batch_size,
+        threads: Parser.threads)
+        _compare(before, after, added, removed, retained, batch_size, threads)
+      end
+
+      def object_graph(path, batch_size: Parser.batch_size, threads: Parser.threads, api: Parser.api)
+        _object_graph(path, batch_size, threads, api)
+      end
+
+      def referrer_index(path, batch_size: Parser.batch_size, threads: Parser.threads, api: Parser.api)
+        _referrer_index(path, batch_size, threads, api)
+      end
+
+      def load_referrer_index(path)
+        _load_referrer_index(path, path + REFERRER_INDEX_EXTENSION)
       end
 
-      def load_many(path, since: nil, batch_size: Parser.batch_size, &block)
-        _load_many(path, since, batch_size, &block)
+      def save_referrer_index(path, index)
+        _save_referrer_index(path, path + REFERRER_INDEX_EXTENSION, index)
+      end
+
+      def load_index_cache(path)
+        _load_index_cache(path, path + INDEX_CACHE_EXTENSION)
+      end
+
+      def save_index_cache(path, classes, strings)
+        classes.is_a?(ClassIndex) && _save_index_cache(path, path + INDEX_CACHE_EXTENSION, classes, strings)
       end
     end
 
     class << self
       def build_index(path)
-        current.build_index(path)
+        if (index = cached_index(path))
+          return index
+        end
+
+        index = current.build_index(path)
+        save_index(path, *index)
+        index
+      end
+
+      # The index saved next to the dump by a previous run, if `index_cache` is enabled and it's up to date.
+      def cached_index(path)
+        current.load_index_cache(path) if index_cache
+      end
+
+      def save_index(path, classes, strings)
+        current.save_index_cache(path, classes, strings) if index_cache
       end
 
       def load_many(path, **kwargs, &block)
         current.load_many(path, **kwargs, &block)
       end
 
+      def aggregate(path, **kwargs)
+        current.aggregate(path, **kwargs)
+      end
+
+      def addresses_set(path, **kwargs)
+        current.addresses_set(path, **kwargs)
+      end
+
+      def diff(path, other, io, **kwargs)
+        current.diff(path, other, io, **kwargs)
+      end
+
+      def compare(before, after, **kwargs)
+        current.compare(before, after, **kwargs)
+      end
+
+      def object_graph(path, **kwargs)
+        current.object_graph(path, **kwargs)
+      end
+
+      # Like indexes, referrer indexes are saved next to their dump if `index_cache` is enabled, e.g.
+      # `allocated.heap.hpref`, and later only mapped rather than built again.
+      def referrer_index(path, **kwargs)
+        if index_cache && (index = current.load_referrer_index(path))
+          return index
+        end
+
+        index = current.referrer_index(path, **kwargs)
+        current.save_referrer_index(path, index) if index_cache
+        index
+      end
+
       private
 
       def current
@@ -15,7 +15,8 @@ module HeapProfiler
     }.freeze
 
     METRICS = ["memory", "objects", "strings", "shape_edges"].freeze
-    GROUPED_METRICS = ["memory", "objects"]
+    # Retained sizes require building the whole object graph, so they're only reported on demand.
+    GROUPED_METRICS = ["memory", "objects", "retained_size"]
     GROUPINGS = ["gem", "file", "location", "class"].freeze
 
     attr_reader :types, :dimensions
@@ -58,6 +59,26 @@ module HeapProfiler
       end
     end
 
+    # Approximate values are overestimated by at most their error, see `Analyzer#run`.
+    def format_error(error, scale)
+      return "" if error.zero?
+
+      " (error <= #{scale ? scale_bytes(error) : error})"
+    end
+
+    # Sampled totals are followed by the margin of their 95% confidence interval, see `Analyzer#run`.
+    def format_total(total)
+      return "#{scale_bytes(total.memory)} (#{total.objects} objects)" unless total.sampled?
+
+      "#{scale_bytes(total.memory)} ± #{scale_bytes(total.margin('memory'))} " \
+        "(#{total.objects} ± #{total.margin('objects')} objects)"
+    end
+
+    def print_sample_note(io, total)
+      io.puts "Estimated from a #{format('%g', total.sample_rate * 100)}% sample of the dump, " \
+              "totals with 95% confidence intervals" if total.sampled?
+    end
+
     def scale_bytes(bytes)
       return "0 B" if bytes.zero?
 
@@ -82,11 +103,11 @@ module HeapProfiler
       @colorize = color_output ? Polychrome : Monochrome
 
       analyzer = Analyzer.new(heap, index)
-      dimensions = analyzer.run(@metrics, @groupings)
+      dimensions = analyzer.run(@metrics, @groupings, approximate: options[:approximate], sample: options[:sample])
 
-      if dimensions['total']
-        io.puts "Total: #{scale_bytes(dimensions['total'].memory)} " \
-                "(#{dimensions['total'].objects} objects)"
+      if (total = dimensions['total'])
+        io.puts "Total: #{format_total(total)}"
+        print_sample_note(io, total)
       end
 
       @metrics.each do |metric|
@@ -107,15 +128,17 @@ module HeapProfiler
 
     def dump_data(io, dimensions, metric, grouping, options)
       print_title io, "#{metric} by #{grouping}"
-      data = dimensions[grouping].top_n(metric, AbstractResults.top_entries_count)
+      dimension = dimensions[grouping]
+      data = dimension.top_n(metric, AbstractResults.top_entries_count)
 
-      scale_data = metric == "memory" && options[:scale_bytes]
+      scale_data = metric != "objects" && options[:scale_bytes]
       normalize_paths = options[:normalize_paths]
 
       if data && !data.empty?
+        errors = data.map { |group, _| format_error(dimension.error(metric, group), scale_data) }
         data.each { |pair| pair[0] = normalize_path(pair[0]) } if normalize_paths
         data.each { |pair| pair[1] = scale_bytes(pair[1]) } if scale_data
-        data.each { |k, v| print_output(io, v, k) }
+        data.each_with_index { |(k, v), i| print_output(io, v, "#{k}#{errors[i]}") }
       else
         io.puts "NO DATA"
       end
@@ -130,11 +153,11 @@ module HeapProfiler
 
       dimensions["strings"].top_n(top).each do |string|
         memsize = scale_data ? scale_bytes(string.memsize) : string.memsize
-        print_output2 io, memsize, string.count, @colorize.string(string.value.inspect)
+        print_output2 io, memsize, string.count, "#{@colorize.string(string.value.inspect)}#{format_error(string.error, false)}"
         string.top_n(top).each do |string_location|
           location = string_location.location
           location = normalize_path(location) if normalize_paths
-          print_output2 io, '', string_location.count, location
+          print_output2 io, '', string_location.count, "#{location}#{format_error(string_location.error, false)}"
         end
         io.puts
       end
@@ -175,13 +198,13 @@ module HeapProfiler
       dimensions = {}
       heaps.each do |type, heap|
         analyzer = Analyzer.new(heap, index)
-        dimensions[type] = analyzer.run(@metrics, @groupings)
+        dimensions[type] = analyzer.run(@metrics, @groupings, approximate: options[:approximate], sample: options[:sample])
       end
 
       dimensions.each do |type, metrics|
-        io.puts "Total #{type}: #{scale_bytes(metrics['total'].memory)} " \
-                "(#{metrics['total'].objects} objects)"
+        io.puts "Total #{type}: #{format_total(metrics['total'])}"
       end
+      print_sample_note(io, dimensions.values.first['total']) unless dimensions.empty?
 
       @types.each do |type|
         @metrics.each do |metric|
@@ -207,15 +230,17 @@ module HeapProfiler
 
     def dump_data(io, dimensions, type, metric, grouping, options)
       print_title io, "#{type} #{metric} by #{grouping}"
-      data = dimensions[type][grouping].top_n(metric, AbstractResults.top_entries_count)
+      dimension = dimensions[type][grouping]
+      data = dimension.top_n(metric, AbstractResults.top_entries_count)
 
-      scale_data = metric == "memory" && options[:scale_bytes]
+      scale_data = metric != "objects" && options[:scale_bytes]
       normalize_paths = options[:normalize_paths]
 
       if data && !data.empty?
+        errors = data.map { |group, _| format_error(dimension.error(metric, group), scale_data) }
         data.each { |pair| pair[0] = normalize_path(pair[0]) } if normalize_paths
         data.each { |pair| pair[1] = scale_bytes(pair[1]) } if scale_data
-        data.each { |k, v| print_output(io, v, k) }
+        data.each_with_index { |(k, v), i| print_output(io, v, "#{k}#{errors[i]}") }
       else
         io.puts "NO DATA"
       end
@@ -230,11 +255,11 @@ module HeapProfiler
 
       dimensions["strings"].top_n(top).each do |string|
         memsize = scale_data ? scale_bytes(string.memsize) : string.memsize
-        print_output2 io, memsize, string.count, @colorize.string(string.value.inspect)
+        print_output2 io, memsize, string.count, "#{@colorize.string(string.value.inspect)}#{format_error(string.error, false)}"
         string.top_n(top).each do |string_location|
           location = string_location.location
           location = normalize_path(location) if normalize_paths
-          print_output2 io, '', string_location.count, location
+          print_output2 io, '', string_location.count, "#{location}#{format_error(string_location.error, false)}"
         end
         io.puts
       end
@@ -253,4 +278,77 @@ module HeapProfiler
       end
     end
   end
+
+  class GrowthResults < AbstractResults
+    def initialize(paths, groupings = GROUPINGS)
+      @paths = paths
+      @groupings = groupings
+    end
+
+    def pretty_print(io = $stdout, **options)
+      growth = Growth.new(@paths, @groupings).run
+
+      color_output = options.fetch(:color_output) { io.respond_to?(:isatty) && io.isatty }
+      @colorize = color_output ? Polychrome : Monochrome
+
+      growth.snapshots.each_with_index do |dimensions, position|
+        io.puts "Snapshot #{position + 1}: #{scale_bytes(dimensions['total'].memory)} " \
+                "(#{dimensions['total'].objects} objects)"
+      end
+
+      Growth::METRICS.each do |metric|
+        @groupings.each do |grouping|
+          dump_growth(io, growth, metric, grouping, options)
+        end
+      end
+
+      if (survivors = growth.survivors)
+        io.puts
+        io.puts "Survivors, allocated between the first two snapshots and alive in all the others: " \
+                "#{scale_bytes(survivors['total'].memory)} (#{survivors['total'].objects} objects)"
+        Growth::METRICS.each do |metric|
+          @groupings.each do |grouping|
+            dump_survivors(io, survivors, metric, grouping, options)
+          end
+        end
+      end
+    end
+
+    def dump_growth(io, growth, metric, grouping, options)
+      print_title io, "growing #{metric} by #{grouping}"
+      data = growth.growing(grouping, metric).take(AbstractResults.top_entries_count)
+
+      if data.empty?
+        io.puts "NO DATA"
+        return
+      end
+
+      data.each do |group, values|
+        group = normalize_path(group) if options[:normalize_paths]
+        first, last = [values.first, values.last].map { |value| format_metric(metric, value, options) }
+        print_output(io, "+#{format_metric(metric, values.last - values.first, options)}", "#{group} (#{first} -> #{last})")
+      end
+    end
+
+    def dump_survivors(io, survivors, metric, grouping, options)
+      print_title io, "survivors #{metric} by #{grouping}"
+      data = survivors[grouping].top_n(metric, AbstractResults.top_entries_count)
+
+      if data.empty?
+        io.puts "NO DATA"
+        return
+      end
+
+      data.each do |group, value|
+        group = normalize_path(group) if options[:normalize_paths]
+        print_output(io, format_metric(metric, value, options), group)
+      end
+    end
+
+    private
+
+    def format_metric(metric, value, options)
+      metric != "objects" && options[:scale_bytes] ? scale_bytes(value) : value
+    end
+  end
 end
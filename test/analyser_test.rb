@@ -51,8 +51,135 @@ module HeapProfiler
       assert_equal expected, data['class'].objects
     end
 
+    def test_native_aggregation_matches_ruby_processing
+      heap = Dump.new(fixtures_path('ruby-3.0-singleton-classes.heap'))
+      index = Index.new(heap)
+      metrics = AbstractResults::METRICS
+      groupings = AbstractResults::GROUPINGS
+
+      native = Analyzer.new(heap, index).run(metrics, groupings, max: 20)
+      ruby = Analyzer.new(ObjectsOnlyHeap.new(heap), index).run(metrics, groupings, max: 20)
+
+      assert_equal ruby['total'].objects, native['total'].objects
+      assert_equal ruby['total'].memory, native['total'].memory
+      %w(gem file class).each do |grouping|
+        assert_equal ruby[grouping].objects, native[grouping].objects
+        assert_equal ruby[grouping].memory, native[grouping].memory
+      end
+      groupings.each do |grouping|
+        %w(objects memory).each do |metric|
+          assert_equal ruby[grouping].top_n(metric, 20), native[grouping].top_n(metric, 20)
+        end
+      end
+      assert_equal summarize_strings(ruby['strings']), summarize_strings(native['strings'])
+      assert_equal ruby['shape_edges'].top_n(20), native['shape_edges'].top_n(20)
+    end
+
+    def test_retained_size_by_gem
+      Tempfile.create do |file|
+        file.puts('{"type":"ROOT", "root":"vm", "references":["0xa"]}')
+        file.puts('{"address":"0xa", "type":"STRING", "value":"a", "file":"/gems/foo-1.0/lib/a.rb", "line":1, "references":["0xb"], "memsize":10}')
+        file.puts('{"address":"0xb", "type":"STRING", "value":"b", "file":"/gems/foo-1.0/lib/b.rb", "line":1, "memsize":20}')
+        file.flush
+
+        heap = Dump.new(file.path)
+        data = Analyzer.new(heap, Index.new(heap)).run(%w(memory retained_size), %w(gem file))
+        # The object of b.rb is dominated by the one of a.rb, so the gem of both only retains it once.
+        assert_equal({ "/gems/foo-1.0/lib/a.rb" => 30, "/gems/foo-1.0/lib/b.rb" => 20 }, data['file'].retained_size)
+        assert_equal({ "foo-1.0" => 30 }, data['gem'].retained_size)
+      end
+    end
+
+    def test_retained_size_by_class_name
+      Tempfile.create do |file|
+        file.puts('{"type":"ROOT", "root":"vm", "references":["0xa"]}')
+        file.puts('{"address":"0x1", "type":"CLASS", "name":"Array", "memsize":10}')
+        file.puts('{"address":"0x2", "type":"CLASS", "name":"MyList", "memsize":10}')
+        file.puts('{"address":"0xa", "type":"ARRAY", "class":"0x1", "references":["0xb"], "memsize":100}')
+        file.puts('{"address":"0xb", "type":"ARRAY", "class":"0x2", "references":["0xc"], "memsize":100}')
+        file.puts('{"address":"0xc", "type":"ARRAY", "memsize":100}')
+        file.flush
+
+        # All three class keys are named "Array", and each array dominates the next, so they're only counted once.
+        [true, false].each do |built|
+          heap = Dump.new(file.path)
+          index = Index.new(heap)
+          index.build! if built
+          data = Analyzer.new(heap, index).run(%w(memory retained_size), %w(class))
+          assert_equal({ "Array" => 300 }, data['class'].retained_size)
+          assert_equal 320, data['total'].memory
+          assert_equal "MyList", index.classes[0x2]
+        end
+      end
+    end
+
+    def test_approximate_aggregation_matches_exact_with_enough_counters
+      heap = Dump.new(fixtures_path('ruby-3.0-singleton-classes.heap'))
+      index = Index.new(heap)
+      metrics = %w(objects memory strings)
+
+      exact = Analyzer.new(heap, index).run(metrics, %w(location), max: 20)
+      approximate = Analyzer.new(heap, index).run(metrics, %w(location), max: 20, approximate: 100_000)
+
+      assert_instance_of Analyzer::ApproximateLocationGroupDimension, approximate['location']
+      %w(objects memory).each do |metric|
+        assert_equal exact['location'].top_n(metric, 20), approximate['location'].top_n(metric, 20)
+        approximate['location'].top_n(metric, 20).each { |group, _| assert_equal 0, approximate['location'].error(metric, group) }
+      end
+      assert_equal summarize_strings(exact['strings']), summarize_strings(approximate['strings'])
+    end
+
+    def test_sampled_aggregation_scales_counts
+      Tempfile.create do |file|
+        dump = File.read(fixtures_path('ruby-3.0-singleton-classes.heap'))
+        10.times { file.write(dump) }
+        file.flush
+
+        heap = Dump.new(file.path)
+        exact = Analyzer.new(heap, Index.new(heap)).run(%w(objects memory), %w(class))
+        sampled = Analyzer.new(heap, Index.new(heap)).run(%w(objects memory), %w(class), sample: 0.5)
+
+        %w(objects memory).each do |metric|
+          total = sampled['total']
+          assert_predicate total, :sampled?
+          assert_operator total.margin(metric), :>, 0
+          assert_in_delta exact['total'].stats(metric), total.stats(metric), total.margin(metric)
+          # Groups are scaled up like the totals.
+          assert_in_delta exact['class'].stats(metric).values.sum, sampled['class'].stats(metric).values.sum, total.margin(metric)
+        end
+        refute_predicate exact['total'], :sampled?
+        assert_equal 0, exact['total'].margin('objects')
+      end
+    end
+
+    def test_top_matches_sort
+      random = Random.new(42)
+      values = 500.times.to_h { |i| ["group-#{i}", random.rand(10)] }
+      compare = ->(a, b) { (b[1] <=> a[1]).nonzero? || b[0] <=> a[0] }
+
+      [0, 1, 20, 499, 500, 1 << 30].each do |max|
+        assert_equal values.sort(&compare).take(max), Analyzer.top(values, max, &compare), "max: #{max}"
+      end
+    end
+
     private
 
+    class ObjectsOnlyHeap
+      def initialize(heap)
+        @heap = heap
+      end
+
+      def each_object(&block)
+        @heap.each_object(&block)
+      end
+    end
+
+    def summarize_strings(dimension)
+      dimension.top_n(20).map do |group|
+        [group.value, group.count, group.memsize, group.top_n(20).map { |l| [l.location, l.count, l.memsize] }]
+      end
+    end
+
     def build_analyzer(report_path, type = 'allocated')
       diff = Diff.new(fixtures_path(report_path))
       heap = diff.public_send("#{type}_diff")
@@ -0,0 +1,77 @@
+# frozen_string_literal: true
+require "test_helper"
+
+module HeapProfiler
+  class GrowthTest < Minitest::Test
+    CLASSES = <<~DUMP
+      {"address":"0x100", "type":"CLASS", "name":"Session", "memsize":500}
+      {"address":"0x200", "type":"CLASS", "name":"Cache", "memsize":500}
+    DUMP
+
+    SNAPSHOTS = [
+      <<~DUMP,
+        {"address":"0x1", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "memsize":40}
+        {"address":"0x2", "type":"OBJECT", "class":"0x200", "file":"b.rb", "line":1, "memsize":100}
+      DUMP
+      <<~DUMP,
+        {"address":"0x1", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "memsize":40}
+        {"address":"0x2", "type":"OBJECT", "class":"0x200", "file":"b.rb", "line":1, "memsize":80}
+        {"address":"0x3", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "memsize":40}
+        {"address":"0x4", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "memsize":40}
+        {"address":"0x5", "type":"OBJECT", "class":"0x200", "file":"b.rb", "line":2, "memsize":10}
+      DUMP
+      <<~DUMP,
+        {"address":"0x1", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "memsize":40}
+        {"address":"0x2", "type":"OBJECT", "class":"0x200", "file":"b.rb", "line":1, "memsize":80}
+        {"address":"0x3", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "memsize":40}
+        {"address":"0x6", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "memsize":40}
+      DUMP
+    ].freeze
+
+    def test_growing_groups
+      with_snapshots do |paths|
+        growth = Growth.new(paths).run
+
+        assert_equal [["Session", [40, 120, 120]]], growth.growing("class", "memory")
+        assert_equal [["Session", [1, 3, 3]]], growth.growing("class", "objects")
+        assert_equal [["a.rb:1", [40, 120, 120]]], growth.growing("location", "memory")
+        assert_equal [["a.rb", [1, 3, 3]]], growth.growing("file", "objects")
+      end
+    end
+
+    def test_survivors
+      with_snapshots do |paths|
+        survivors = Growth.new(paths).run.survivors
+
+        # 0x3, 0x4 and 0x5 were allocated between the first two snapshots, but only 0x3 is still alive.
+        assert_equal 1, survivors["total"].objects
+        assert_equal({ "Session" => 40 }, survivors["class"].memory)
+        assert_equal({ "a.rb:1" => 1 }, survivors["location"].objects)
+
+        assert_nil Growth.new(paths.take(2)).run.survivors
+      end
+    end
+
+    def test_pretty_print
+      with_snapshots do |paths|
+        io = StringIO.new
+        GrowthResults.new(paths, ["class"]).pretty_print(io, scale_bytes: true)
+        assert_includes io.string, "+80.00 B  Session (40.00 B -> 120.00 B)"
+        assert_includes io.string, "40.00 B  Session"
+      end
+    end
+
+    private
+
+    def with_snapshots
+      Dir.mktmpdir do |dir|
+        paths = SNAPSHOTS.each_with_index.map do |objects, position|
+          path = File.join(dir, "#{position + 1}.heap")
+          File.write(path, CLASSES + objects)
+          path
+        end
+        yield paths
+      end
+    end
+  end
+end
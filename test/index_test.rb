@@ -11,6 +11,73 @@ module HeapProfiler
       assert_equal '<something> (DATA)', @index.guess_class({ type: :DATA, struct: :something })
     end
 
+    def test_index_built_while_analyzing
+      heap = Dump.new(fixtures_path('ruby-3.0-singleton-classes.heap'))
+      index = Index.new(heap)
+      refute_predicate index, :built?
+
+      Analyzer.new(heap, index).run(%w(objects), %w(class))
+      assert_predicate index, :built?
+
+      classes, strings = Parser.build_index(heap.path)
+      assert_equal classes, index.classes
+      assert_equal strings, index.strings
+      assert_equal '<Class#0x2a>', index.classes[0x2a]
+    end
+
+    def test_index_cache
+      Parser.index_cache = true
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'dump.heap')
+        FileUtils.cp(fixtures_path('ruby-3.0-singleton-classes.heap'), path)
+        classes, strings = Parser::Native.new.build_index(path)
+
+        heap = Dump.new(path)
+        Analyzer.new(heap, Index.new(heap)).run(%w(objects), %w(class))
+        assert File.exist?("#{path}.hpidx")
+
+        index = Index.new(heap)
+        assert index.load_cache
+        assert_equal classes, index.classes
+        assert_equal strings, index.strings
+        assert_equal classes, Parser.build_index(path).first
+
+        File.open(path, 'a') { |file| file.puts('{"address":"0x2a", "type":"CLASS", "name":"Appended"}') }
+        assert_nil Index.new(heap).load_cache
+        assert_equal 'Appended', Parser.build_index(path).first[0x2a]
+        assert_equal 'Appended', Index.new(heap).load_cache.classes[0x2a]
+      end
+    ensure
+      Parser.index_cache = false
+    end
+
+    def test_concurrent_index_cache_writes
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'dump.heap')
+        FileUtils.cp(fixtures_path('ruby-3.0-singleton-classes.heap'), path)
+        classes, strings = Parser::Native.new.build_index(path)
+
+        8.times.map { Thread.new { Parser::Native.new.save_index_cache(path, classes, strings) } }.each(&:join)
+        assert_equal ['dump.heap', 'dump.heap.hpidx'], Dir.children(dir).sort
+        assert_equal classes, Parser::Native.new.load_index_cache(path).first
+      end
+    end
+
+    def test_index_cache_of_dump_rewritten_within_a_second
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'dump.heap')
+        padding = %{{"type":"ROOT", "root":"vm", "references":["0x2a"]}\n} * 2048
+        File.write(path, padding + %{{"address":"0x2a", "type":"CLASS", "name":"Before"}\n} + padding)
+        File.utime(Time.at(1_000_000_000, 100, :nsec), Time.at(1_000_000_000, 100, :nsec), path)
+        Parser::Native.new.save_index_cache(path, *Parser::Native.new.build_index(path))
+        assert_equal 'Before', Parser::Native.new.load_index_cache(path).first[0x2a]
+
+        File.write(path, padding + %{{"address":"0x2a", "type":"CLASS", "name":"Rename"}\n} + padding)
+        File.utime(Time.at(1_000_000_000, 200, :nsec), Time.at(1_000_000_000, 200, :nsec), path)
+        assert_nil Parser::Native.new.load_index_cache(path)
+      end
+    end
+
     private
 
     def fixtures_path(subpath)
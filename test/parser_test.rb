@@ -15,6 +15,16 @@ module HeapProfiler
       assert_address_parsing '0x7f921e8a29d0'
       assert_address_parsing '0xffffffffffffff'
       assert_address_parsing '0xFFFFFFFFFFFFFFF'
+      assert_address_parsing '0x1'
+      assert_address_parsing '0xaBcDeF0123456'
+    end
+
+    def test_batch_address_parsing
+      addresses = ['0x0', '0x7f921e8b8190', '0xa', '0xFFFFFFFFFFFFFFF', '0x7f922208ff78']
+      addresses += 100.times.map { |i| "0x#{(0x7f921e8b8190 + i * 40).to_s(16)}" }
+      assert_equal addresses.map { |address| address.to_i(16) }, @native.parse_addresses(addresses)
+      assert_equal @ruby.parse_addresses(addresses), @native.parse_addresses(addresses)
+      assert_equal [], @native.parse_addresses([])
     end
 
     def test_class_index
@@ -30,15 +40,375 @@ module HeapProfiler
     end
 
     def test_string_index
-      _, string_index = @native.build_index(fixtures_path('diffed-heap/allocated.heap'))
-      assert_equal 24_145, string_index.size
-      assert_equal "load_plugins", string_index[0x104c06688]
-
-      _, ruby_string_index = @ruby.build_index(fixtures_path('diffed-heap/allocated.heap'))
-      assert_equal 24_145, ruby_string_index.size
-      assert_equal [], ruby_string_index.values - string_index.values
-      assert_equal [], string_index.values - ruby_string_index.values
+      path = fixtures_path('ruby-3.0-singleton-classes.heap')
+      _, string_index = @native.build_index(path)
+      # Only the roots of shared strings are indexed.
+      assert_equal 18, string_index.size
+      assert_equal "/opt/rubies/3.0.0/lib/ruby/3.0.0/objspace.rb", string_index[0x7ffe4904ca50]
+
+      _, ruby_string_index = @ruby.build_index(path)
       assert_equal ruby_string_index, string_index
+
+      shared_roots = []
+      @native.load_many(path) { |object| shared_roots << object[:references].first if object[:shared] }
+      assert_empty string_index.keys - shared_roots
+      assert_equal string_index, @native.build_index(path, threads: 4, batch_size: 1_000).last
+    end
+
+    def test_addresses_set
+      path = fixtures_path('ruby-3.0-singleton-classes.heap')
+      require 'json'
+      addresses = File.readlines(path).filter_map { |line| JSON.parse(line)['address']&.to_i(16) }
+
+      set = @native.addresses_set(path)
+      assert_instance_of Parser::AddressSet, set
+      assert_equal addresses.uniq.size, set.size
+      assert(addresses.all? { |address| set.include?(address) })
+      refute set.include?(0x2a)
+      refute set.include?("0x2a")
+      assert_equal set.size, @native.addresses_set(path, threads: 4, api: :scanner).size
+    end
+
+    def test_diff
+      path = fixtures_path('ruby-3.0-singleton-classes.heap')
+      require 'json'
+      lines = File.readlines(path)
+      Dir.mktmpdir do |dir|
+        before = Dump.new(File.join(dir, 'before.heap'))
+        File.write(before.path, lines.first(lines.size / 2).join)
+
+        output = StringIO.new
+        Dump.new(path).diff(before, output)
+        expected = lines.reject do |line|
+          address = JSON.parse(line)['address']
+          address && before.index.include?(address.to_i(16))
+        end
+        assert_equal expected.join, output.string
+        assert_operator expected.size, :<, lines.size
+
+        output = StringIO.new
+        roots = lines.select { |line| line.start_with?('{"type":"ROOT"') }
+        assert_equal roots.size, @native.diff(path, @native.addresses_set(path), output)
+        assert_equal roots.join, output.string
+      end
+    end
+
+    def test_compare
+      require 'json'
+      lines = File.readlines(fixtures_path('ruby-3.0-singleton-classes.heap')).select { |line| line.start_with?('{"address"') }
+      Dir.mktmpdir do |dir|
+        before = File.join(dir, 'before.heap')
+        after = File.join(dir, 'after.heap')
+        File.write(before, lines.first(lines.size * 2 / 3).join)
+        File.write(after, lines.last(lines.size * 2 / 3).shuffle(random: Random.new(42)).join)
+        before_lines = File.readlines(before)
+        after_lines = File.readlines(after)
+        before_addresses = before_lines.map { |line| JSON.parse(line)['address'] }
+        after_addresses = after_lines.map { |line| JSON.parse(line)['address'] }
+
+        added, removed, retained = StringIO.new, StringIO.new, StringIO.new
+        counts = Dump.new(after).compare(Dump.new(before), added: added, removed: removed, retained: retained)
+        expected_added, expected_retained = after_lines.partition { |line| !before_addresses.include?(JSON.parse(line)['address']) }
+        expected_removed = before_lines.reject { |line| after_addresses.include?(JSON.parse(line)['address']) }
+
+        assert_equal({ added: expected_added.size, removed: expected_removed.size, retained: expected_retained.size }, counts)
+        assert_equal expected_added.join, added.string
+        assert_equal expected_removed.join, removed.string
+        assert_equal expected_retained.join, retained.string
+        assert_equal counts, @native.compare(before, after, threads: 4)
+
+        with_fifo(after) do |fifo|
+          assert_raises(ArgumentError) { @native.compare(before, fifo) }
+        end
+      end
+    end
+
+    def test_object_graph
+      require 'json'
+      path = fixtures_path('ruby-3.0-singleton-classes.heap')
+      objects = File.readlines(path).map { |line| JSON.parse(line) }
+      addresses = objects.filter_map { |object| object['address']&.to_i(16) }.to_set
+
+      references = Hash.new { |hash, address| hash[address] = [] }
+      memsizes = Hash.new(0)
+      objects.each do |object|
+        address = object['address']&.to_i(16) || 0
+        references[address].concat((object['references'] || []).map { |reference| reference.to_i(16) }.select { |reference| addresses.include?(reference) })
+        memsizes[address] += object['memsize'] || 0
+      end
+
+      graph = @native.object_graph(path)
+      assert_instance_of Parser::ObjectGraph, graph
+      assert_equal addresses.size + 1, graph.size
+      assert_equal references.sum { |_, edges| edges.size }, graph.edge_count
+      references.each do |address, edges|
+        assert_equal edges, graph.references(address)
+        assert_equal memsizes[address], graph.memsize_of(address)
+      end
+      assert_operator graph.references(0).size, :>, 0
+      assert_nil graph.references(0x2a)
+      refute graph.include?(0x2a)
+
+      [{ api: :ondemand }, { api: :scanner }, { threads: 4, batch_size: 1_000 }].each do |options|
+        other = @native.object_graph(path, **options)
+        assert_equal graph.edge_count, other.edge_count
+        addresses.each { |address| assert_equal graph.references(address).sort, other.references(address).sort }
+      end
+    end
+
+    RETENTION_DUMP = <<~DUMP
+      {"type":"ROOT", "root":"vm", "references":["0xa"]}
+      {"address":"0xa", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "references":["0xb", "0xc"], "memsize":10}
+      {"address":"0xb", "type":"OBJECT", "class":"0x200", "file":"b.rb", "line":1, "references":["0xd"], "memsize":20}
+      {"address":"0xc", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":2, "references":["0xd", "0xe"], "memsize":30}
+      {"address":"0xd", "type":"OBJECT", "class":"0x200", "file":"b.rb", "line":2, "memsize":40}
+      {"address":"0xe", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "references":["0xa"], "memsize":50}
+      {"address":"0xf", "type":"OBJECT", "class":"0x100", "file":"a.rb", "line":1, "references":["0xa"], "memsize":60}
+    DUMP
+
+    def test_object_graph_retention
+      Tempfile.create do |file|
+        file.write(RETENTION_DUMP)
+        file.flush
+        graph = @native.object_graph(file.path)
+
+        assert_equal({ 0xa => 150, 0xb => 20, 0xc => 80, 0xd => 40, 0xe => 50 }, [0xa, 0xb, 0xc, 0xd, 0xe].to_h { |address| [address, graph.retained_size_of(address)] })
+        assert_equal({ 0xa => 0, 0xb => 0xa, 0xc => 0xa, 0xd => 0xa, 0xe => 0xc }, [0xa, 0xb, 0xc, 0xd, 0xe].to_h { |address| [address, graph.dominator_of(address)] })
+        assert_equal 150, graph.retained_size_of(0)
+        assert_nil graph.retained_size_of(0xf)
+        assert_nil graph.dominator_of(0xf)
+        assert_nil graph.dominator_of(0)
+      end
+    end
+
+    def test_aggregate_retained
+      Tempfile.create do |file|
+        file.write(RETENTION_DUMP)
+        file.flush
+
+        # Objects nested in an object of the same group are only counted once.
+        expected = {
+          classes: [[{ type: :OBJECT, class: 0x100 }, 150], [{ type: :OBJECT, class: 0x200 }, 60]],
+          files: [["a.rb", 150], ["b.rb", 60]],
+          locations: [["a.rb:1", 150], ["a.rb:2", 80], ["b.rb:2", 40], ["b.rb:1", 20]],
+          gems: [],
+        }
+        %i(dom ondemand scanner).each do |api|
+          result = @native.aggregate(file.path, tables: [:retained], max: 10, api: api)[:retained]
+          assert_equal expected, result.transform_values { |rows| rows.sort_by { |key, bytes| [-bytes, key.to_s] } }, "api: #{api}"
+        end
+        assert_equal [["a.rb:1", 150]], @native.aggregate(file.path, tables: [:retained], max: 1)[:retained][:locations]
+      end
+    end
+
+    def test_aggregate_retained_by_gem
+      Tempfile.create do |file|
+        file.write(RETENTION_DUMP)
+        file.flush
+
+        # Objects of b.rb are dominated by 0xa, of a.rb, so they're only counted once for a gem of both files.
+        gems = ->(files) { files.map { |path| "gem" if path } }
+        assert_equal [["gem", 150]], @native.aggregate(file.path, tables: [:retained], max: 10, gems: gems)[:retained][:gems]
+        gems = ->(files) { files.map { |path| "gem" if path == "b.rb" } }
+        assert_equal [["gem", 60]], @native.aggregate(file.path, tables: [:retained], max: 10, gems: gems)[:retained][:gems]
+
+        assert_raises(ZeroDivisionError) do
+          @native.aggregate(file.path, tables: [:retained], max: 10, gems: ->(_files) { 1 / 0 })
+        end
+      end
+    end
+
+    def test_aggregate_retained_by_class_name
+      Tempfile.create do |file|
+        file.write(RETENTION_DUMP)
+        file.flush
+
+        # Objects of both classes are dominated by 0xa, so they're only counted once for a name shared by both.
+        classes = ->(keys, _classes, _strings) { keys.map { "Object" } }
+        result = @native.aggregate(file.path, tables: [:retained], max: 10, classes: classes)[:retained]
+        assert_equal [["Object", 150]], result[:classes]
+        classes = ->(keys, _classes, _strings) { keys.map { |key| "Other" if key[:class] == 0x200 } }
+        assert_equal [["Other", 60]], @native.aggregate(file.path, tables: [:retained], max: 10, classes: classes)[:retained][:classes]
+
+        # The index built in the same pass is given to the resolver, to name classes before it's returned.
+        indexes = nil
+        classes = ->(keys, class_index, string_index) { indexes = [class_index, string_index]; keys.map { nil } }
+        result = @native.aggregate(file.path, tables: [:retained, :index], max: 10, classes: classes)
+        assert_equal [result[:class_index], result[:string_index]], indexes
+        assert_equal [], result[:retained][:classes]
+
+        assert_raises(ZeroDivisionError) do
+          @native.aggregate(file.path, tables: [:retained], max: 10, classes: ->(*) { 1 / 0 })
+        end
+      end
+    end
+
+    def test_aggregate_survivors
+      Tempfile.create do |file|
+        file.write(RETENTION_DUMP)
+        file.flush
+        Tempfile.create do |earlier|
+          earlier.write(RETENTION_DUMP.lines.values_at(1, 3).join)
+          earlier.puts('{"address":"0x2a", "type":"OBJECT", "memsize":1}')
+          earlier.flush
+          previous = @native.aggregate(earlier.path, tables: [:addresses], max: 10)[:addresses]
+          assert_equal 3, previous.size
+
+          result = @native.aggregate(file.path, tables: [:files, :addresses], max: 10, survivors: previous)
+          assert_equal 6, result[:addresses].size
+          assert_equal 2, result[:survivors][:objects]
+          assert_equal 40, result[:survivors][:memory]
+          assert_equal [["a.rb", 2, 40]], result[:survivors][:files]
+          assert_equal [0xa, 0xc], [0xa, 0xb, 0xc, 0x2a].select { |address| result[:survivors][:addresses].include?(address) }
+
+          added = result[:addresses] - previous
+          assert_equal 4, added.size
+          assert_equal [0xb, 0xd], [0xa, 0xb, 0xc, 0xd, 0x2a].select { |address| added.include?(address) }
+        end
+      end
+    end
+
+    def test_aggregate_location_ties
+      locations = [["a.rb", 9], ["a.rb", 10], ["a.rb", 1], ["a.rb", 100], ["a.rb.x", 1], ["a.rb:x", 1], ["a", 2], ["b", 3]]
+      Tempfile.create do |file|
+        locations.each_with_index do |(path, line), index|
+          file.puts(%({"address":"0x#{(index + 1).to_s(16)}", "type":"STRING", "value":"dup", "file":"#{path}", "line":#{line}, "memsize":40}))
+        end
+        file.flush
+
+        # Ties are broken on the highest "file:line", like `Analyzer::GroupedDimension#top_n`.
+        expected = locations.map { |path, line| "#{path}:#{line}" }.sort.reverse
+        result = @native.aggregate(file.path, tables: [:locations, :strings], max: 20)
+        assert_equal expected, result[:locations].map(&:first).uniq
+        assert_equal expected, result[:strings].first.last.map(&:first)
+        assert_equal expected.first(3), @native.aggregate(file.path, tables: [:locations], max: 3)[:locations].map(&:first).uniq
+      end
+    end
+
+    def test_aggregate_approximate
+      Tempfile.create do |file|
+        address = 0
+        write = ->(value, path, line, count) do
+          count.times do
+            file.puts(%({"address":"0x#{(address += 1).to_s(16)}", "type":"STRING", "value":"#{value}", "file":"#{path}", "line":#{line}, "memsize":40}))
+          end
+        end
+        write.call("hot", "a.rb", 1, 30)
+        write.call("warm", "b.rb", 2, 20)
+        60.times { |index| write.call("cold-#{index}", "c.rb", index + 10, 1) }
+        file.flush
+
+        tables = [:approximate_locations, :approximate_strings]
+        [{}, { threads: 4, batch_size: 1_000 }].each do |options|
+          result = @native.aggregate(file.path, tables: tables, max: 2, approximate: 8, **options)
+          # Estimates are never below the true counts, and at most their error above.
+          [["a.rb:1", 30], ["b.rb:2", 20]].zip(result[:approximate_locations][:objects]) do |(location, count), (name, estimate, error)|
+            assert_equal location, name
+            assert_includes (estimate - error)..estimate, count
+          end
+          [["a.rb:1", 1_200], ["b.rb:2", 800]].zip(result[:approximate_locations][:memory]) do |(location, memory), (name, estimate, error)|
+            assert_equal location, name
+            assert_includes (estimate - error)..estimate, memory
+          end
+          assert_equal ["hot", "warm"], result[:approximate_strings].map(&:first)
+          hot = result[:approximate_strings].first
+          assert_includes (hot[1] - hot[3])..hot[1], 30
+          assert_equal ["a.rb:1"], hot[4].map(&:first)
+        end
+
+        # With enough counters, counts are exact.
+        exact = @native.aggregate(file.path, tables: [:locations, :strings], max: 5)
+        result = @native.aggregate(file.path, tables: tables, max: 5, approximate: 100, threads: 4, batch_size: 1_000)
+        assert_equal exact[:locations].first(5).map { |location, count, _| [location, count, 0] }, result[:approximate_locations][:objects]
+        assert_equal exact[:strings].map { |value, count, memsize, _| [value, count, memsize, 0] }, result[:approximate_strings].map { |row| row.first(4) }
+
+        assert_raises(ArgumentError) { @native.aggregate(file.path, tables: tables, max: 5) }
+      end
+    end
+
+    def test_aggregate_approximate_long_strings
+      Tempfile.create do |file|
+        [["a" * 1_000, 3], ["a" * 999 + "b", 2], ["a" + "é" * 100, 1]].each_with_index do |(value, count), index|
+          count.times do |copy|
+            file.puts(%({"address":"0x#{index}#{copy}", "type":"STRING", "value":"#{value}", "file":"a.rb", "line":#{index}, "memsize":40}))
+          end
+        end
+        file.flush
+
+        # Only the start of long strings is kept, but they're still counted apart by their whole value.
+        result = @native.aggregate(file.path, tables: [:approximate_strings], max: 5, approximate: 10)
+        expected = [["a" * 128 + "...", 3, 120, 0], ["a" * 128 + "...", 2, 80, 0], ["a" + "é" * 63 + "...", 1, 40, 0]]
+        assert_equal expected, result[:approximate_strings].map { |row| row.first(4) }
+        assert_equal [["a.rb:1", 2, 80, 0]], result[:approximate_strings][1].last
+      end
+    end
+
+    def test_aggregate_sample
+      Tempfile.create do |file|
+        dump = File.read(fixtures_path('ruby-3.0-singleton-classes.heap'))
+        10.times { file.write(dump) }
+        file.flush
+
+        tables = %i(files classes locations strings)
+        exact = @native.aggregate(file.path, tables: tables, max: 10)
+        full = @native.aggregate(file.path, tables: tables, max: 10, sample: 1.0)
+        assert_equal({ rate: 1.0, objects: full[:sample][:objects], memory: full[:sample][:memory] }, full.delete(:sample))
+        assert_equal exact, full
+
+        sample = @native.aggregate(file.path, tables: tables + [:index], max: 10, sample: 0.25)
+        assert_operator sample[:objects], :>, 0
+        assert_operator sample[:objects], :<, exact[:objects] / 2
+        # Chunks are picked the same way whatever the shards.
+        sharded = @native.aggregate(file.path, tables: tables + [:index], max: 10, sample: 0.25, threads: 4)
+        assert_equal sample[:objects], sharded[:objects]
+        assert_equal sample[:locations], sharded[:locations]
+
+        # The lines left out of the sample are still skimmed for class names.
+        assert_equal @native.build_index(file.path).first, sample[:class_index]
+
+        [0, -0.5, 1.5].each do |rate|
+          assert_raises(ArgumentError) { @native.aggregate(file.path, tables: tables, max: 10, sample: rate) }
+        end
+        assert_raises(ArgumentError) { @native.aggregate(file.path, tables: [:retained], max: 10, sample: 0.5) }
+        with_fifo(file.path) do |fifo|
+          assert_raises(ArgumentError) { @native.aggregate(fifo, tables: tables, max: 10, sample: 0.5) }
+        end
+      end
+    end
+
+    def test_referrer_index
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "dump.heap")
+        File.write(path, <<~DUMP)
+          {"type":"ROOT", "root":"vm", "references":["0xa"]}
+          {"type":"ROOT", "root":"global_tbl", "references":["0xe", "0xa"]}
+          #{RETENTION_DUMP.lines.drop(1).join}
+        DUMP
+
+        indexes = %i(dom ondemand scanner).map { |api| @native.referrer_index(path, api: api) }
+        assert @native.save_referrer_index(path, indexes.first)
+        indexes << @native.load_referrer_index(path)
+
+        indexes.each do |index|
+          assert_equal 7, index.size
+          assert_equal [0xb, 0xc], index.referrers(0xd)
+          assert_equal [0, 0, 0xe, 0xf], index.referrers(0xa)
+          assert_equal "vm", index.root_of(0xa)
+          assert_equal "global_tbl", index.root_of(0xe)
+          assert_nil index.root_of(0xb)
+          assert_equal '{"address":"0xf"', File.read(path)[index.line_offset(0xf), 16]
+          assert_nil index.line_offset(0)
+
+          assert_equal [0xa, 0xb, 0xd], index.retention_path([0xd])
+          assert_equal [0xe], index.retention_path([0xd, 0xe])
+          assert_nil index.retention_path([0xf])
+          assert_nil index.retention_path([0x2a])
+          assert_equal [0xa, 0xb], index.retention_path_to_instances([0x200])
+        end
+
+        File.open(path, "a") { |file| file.puts('{"address":"0x2a", "type":"OBJECT", "references":["0xa"]}') }
+        assert_nil @native.load_referrer_index(path)
+      end
     end
 
     def test_ruby_3_singleton_classes
@@ -51,14 +421,304 @@ module HeapProfiler
       assert_equal '<Class /tmp/dump-singleton.rb:8>', class_index[0x7ffe49045ef8]
     end
 
+    def test_native_class_index
+      path = fixtures_path('ruby-3.0-singleton-classes.heap')
+      class_index, _ = @native.build_index(path)
+      ruby_class_index, _ = @ruby.build_index(path)
+
+      assert_instance_of Parser::ClassIndex, class_index
+      assert_equal ruby_class_index.size, class_index.size
+      assert_equal ruby_class_index, class_index.to_hash
+      assert_equal class_index, ruby_class_index
+      ruby_class_index.each do |address, name|
+        assert_equal name, class_index.fetch(address)
+      end
+
+      assert_nil class_index.lookup(0x2a)
+      refute class_index.key?(0x2a)
+      assert_equal :missing, class_index.fetch(0x2a) { :missing }
+      assert_raises(KeyError) { class_index.fetch(0x2a) }
+
+      require 'objspace'
+      ruby_memsize = ObjectSpace.memsize_of(ruby_class_index) + ruby_class_index.sum { |_, name| ObjectSpace.memsize_of(name) }
+      assert_operator ObjectSpace.memsize_of(class_index), :<, ruby_memsize
+    end
+
     def test_insufficient_batch_size
-      previous_batch_size = Parser.batch_size
-      Parser.batch_size = 100
-      assert_raises CapacityError do
-        @native.build_index(fixtures_path('diffed-heap/allocated.heap'))
+      path = fixtures_path('diffed-heap/retained.heap')
+      index = @native.build_index(path)
+      objects = []
+      @native.load_many(path) { |object| objects << object }
+
+      %i(dom ondemand).each do |api|
+        # Most lines are larger than 100B, they must be parsed on their own rather than fail.
+        assert_equal index, @native.build_index(path, batch_size: 100, api: api)
+        small_batch_objects = []
+        @native.load_many(path, batch_size: 100, api: api) { |object| small_batch_objects << object }
+        assert_equal objects, small_batch_objects
+      end
+    end
+
+    def test_ondemand_api
+      [
+        'diffed-heap/retained.heap',
+        'empty-heap/retained.heap',
+        'ruby-3.0-singleton-classes.heap',
+      ].each do |fixture|
+        path = fixtures_path(fixture)
+        assert_equal @native.build_index(path, api: :dom), @native.build_index(path, api: :ondemand)
+
+        objects = []
+        @native.load_many(path, api: :dom) { |object| objects << object }
+        ondemand_objects = []
+        @native.load_many(path, api: :ondemand) { |object| ondemand_objects << object }
+        assert_equal objects, ondemand_objects
+      end
+    end
+
+    def test_ondemand_mistyped_fields
+      Tempfile.create do |file|
+        file.puts('{"address":"0x1", "type":"STRING", "value":"foo", "file":"a.rb", "line":1, "memsize":40}')
+        file.puts('{"address":"0x2", "type":"STRING", "value":"bar", "file":null, "line":2, "memsize":40}')
+        file.puts('{"address":"0x3", "type":"STRING", "value":1, "file":"b.rb", "line":3, "memsize":"big"}')
+        file.puts('{"address":"0x4", "type":"DATA", "struct":false, "generation":-1.5, "memsize":40}')
+        file.flush
+
+        # Mistyped fields are skipped like the DOM API does, rather than leaving partially loaded objects.
+        objects = []
+        @native.load_many(file.path, api: :dom) { |object| objects << object }
+        ondemand_objects = []
+        @native.load_many(file.path, api: :ondemand) { |object| ondemand_objects << object }
+        assert_equal 4, objects.size
+        assert_equal objects, ondemand_objects
+      end
+    end
+
+    def test_scanner_api
+      [
+        'diffed-heap/retained.heap',
+        'empty-heap/retained.heap',
+        'ruby-3.0-singleton-classes.heap',
+      ].each do |fixture|
+        path = fixtures_path(fixture)
+        assert_equal @native.build_index(path, api: :dom), @native.build_index(path, api: :scanner)
+        tables = %i(files classes locations strings shape_edges)
+        assert_equal @native.aggregate(path, tables: tables, max: 10, api: :dom),
+          @native.aggregate(path, tables: tables, max: 10, api: :scanner)
+      end
+    end
+
+    def test_scanner_fallback
+      lines = File.readlines(fixtures_path('diffed-heap/retained.heap')).take(20)
+      lines += [
+        # Escape sequences, in an extracted string and in a skipped one.
+        %{{"address":"0x1000", "type":"STRING", "class":"0x2000", "value":"a \\"quoted\\" \\u00e9", "memsize":40}\n},
+        %{{"address":"0x1008", "type":"STRING", "class":"0x2000", "value":"foo", "encoding":"\\u0055TF-8", "memsize":40}\n},
+        # Unusual spacing, key order and numbers.
+        %{{ "type" : "OBJECT","address":"0x1010","class":"0x2000","memsize":1e2,"ivars":-3}\n},
+        %{{"type":"OBJECT", "address":"0x1018", "class":"0x2000", "memsize":0.5}\r\n},
+        "\n",
+        %{{"address":"0x1020", "type":"ARRAY", "class":"0x2000", "references":["0x1000", "0x1008"], "memsize":40}},
+      ]
+
+      Tempfile.create do |file|
+        file.write(lines.join)
+        file.flush
+
+        [1_000_000, 100].each do |batch_size|
+          objects = []
+          @native.load_many(file.path, batch_size: batch_size, api: :dom) { |object| objects << object }
+          scanned_objects = []
+          @native.load_many(file.path, batch_size: batch_size, api: :scanner) { |object| scanned_objects << object }
+          assert_equal 25, scanned_objects.size
+          assert_equal objects, scanned_objects
+        end
+      end
+    end
+
+    def test_unknown_api
+      assert_raises ArgumentError do
+        @native.build_index(fixtures_path('diffed-heap/retained.heap'), api: :sax)
+      end
+    end
+
+    def test_page_aligned_dump
+      Tempfile.create do |file|
+        # The dump is memory mapped, so make sure we don't read past the end of the mapping
+        # when the file doesn't leave any slack on its last page.
+        lines = File.readlines(fixtures_path('diffed-heap/retained.heap')).take(10)
+        dump = lines.join
+        file.write(dump.chomp.ljust(16_384 - 1), "\n")
+        file.flush
+        assert_equal 16_384, File.size(file.path)
+
+        %i(dom ondemand scanner).each do |api|
+          count = 0
+          @native.load_many(file.path, api: api) { count += 1 }
+          assert_equal 10, count
+        end
+      end
+    end
+
+    def test_streaming_input
+      path = fixtures_path('diffed-heap/retained.heap')
+      objects = []
+      @native.load_many(path) { |object| objects << object }
+
+      %i(dom ondemand scanner).each do |api|
+        streamed_objects = []
+        # A tiny batch size forces the stream buffer to be refilled many times.
+        with_fifo(path) do |fifo|
+          @native.load_many(fifo, batch_size: 1_000, threads: 4, api: api) { |object| streamed_objects << object }
+        end
+        assert_equal objects, streamed_objects
+      end
+    end
+
+    def test_streaming_input_line_larger_than_buffer
+      path = fixtures_path('diffed-heap/retained.heap')
+      objects = []
+      @native.load_many(path) { |object| objects << object }
+
+      %i(dom ondemand scanner).each do |api|
+        streamed_objects = []
+        with_fifo(path) do |fifo|
+          @native.load_many(fifo, batch_size: 100, api: api) { |object| streamed_objects << object }
+        end
+        assert_equal objects, streamed_objects
+      end
+    end
+
+    def test_sharded_parsing
+      Tempfile.create do |file|
+        # Shards are at least 4MB, so we need a larger dump to actually exercise them. Objects are also
+        # loaded by rounds of about 4MB per shard, so this one takes two.
+        dump = File.read(fixtures_path('diffed-heap/retained.heap'))
+        200.times { file.write(dump) }
+        file.flush
+
+        assert_equal @native.build_index(file.path), @native.build_index(file.path, threads: 4)
+
+        objects = []
+        @native.load_many(file.path) { |object| objects << object }
+        sharded_objects = []
+        @native.load_many(file.path, threads: 4) { |object| sharded_objects << object }
+        assert_equal 103_200, sharded_objects.size
+        assert_equal objects, sharded_objects
+
+        graph = @native.object_graph(file.path)
+        sharded_graph = @native.object_graph(file.path, threads: 4)
+        assert_equal graph.edge_count, sharded_graph.edge_count
+        ([0] + objects.map { |object| object[:address] }.uniq).each do |address|
+          assert_equal graph.references(address), sharded_graph.references(address)
+        end
+      end
+    end
+
+    def test_sharded_aggregate
+      Tempfile.create do |file|
+        dump = File.read(fixtures_path('ruby-3.0-singleton-classes.heap'))
+        10.times { file.write(dump) }
+        file.flush
+
+        tables = %i(files classes locations strings shape_edges)
+        aggregate = @native.aggregate(file.path, tables: tables, max: 10)
+        assert_equal 67_580, aggregate[:objects]
+
+        sharded_aggregate = @native.aggregate(file.path, tables: tables, max: 10, threads: 4)
+        # Full tables are returned in no particular order.
+        %i(files classes).each do |table|
+          assert_equal aggregate.delete(table).sort_by(&:inspect), sharded_aggregate.delete(table).sort_by(&:inspect)
+        end
+        assert_equal aggregate, sharded_aggregate
+      end
+    end
+
+    def test_sharded_parsing_break
+      Tempfile.create do |file|
+        dump = File.read(fixtures_path('diffed-heap/retained.heap'))
+        200.times { file.write(dump) }
+        file.flush
+
+        count = 0
+        @native.load_many(file.path, threads: 4) do
+          count += 1
+          break if count == 10
+        end
+        assert_equal 10, count
+      end
+    end
+
+    def test_yield_break_and_raise
+      Tempfile.create do |file|
+        dump = File.read(fixtures_path('diffed-heap/retained.heap'))
+        10.times { file.write(dump) }
+        file.flush
+
+        # Objects are yielded by batches, make sure we stop in the middle of one.
+        count = 0
+        @native.load_many(file.path) do
+          count += 1
+          break if count == 2_000
+        end
+        assert_equal 2_000, count
+
+        assert_raises ArgumentError do
+          @native.load_many(file.path) { raise ArgumentError }
+        end
+      end
+    end
+
+    def test_cached_values_survive_compaction
+      skip("GC.compact isn't supported") unless GC.respond_to?(:compact)
+
+      path = fixtures_path('ruby-3.0-singleton-classes.heap')
+      # Deep copies, so that only the parser references the values it cached, e.g. files.
+      expected = []
+      @native.load_many(path) { |object| expected << Marshal.load(Marshal.dump(object)) }
+
+      objects = []
+      @native.load_many(path) do |object|
+        GC.compact if (objects.size % 1_000).zero?
+        objects << Marshal.load(Marshal.dump(object))
+      end
+      assert_equal expected, objects
+    end
+
+    def test_interrupt_streaming_input
+      Dir.mktmpdir do |dir|
+        fifo = File.join(dir, 'dump.fifo')
+        File.mkfifo(fifo)
+        writer = Thread.new { File.open(fifo, 'w') { |io| sleep } }
+
+        parsing = Thread.new { @native.load_many(fifo) {} }
+        parsing.report_on_exception = false
+        sleep 0.1 until parsing.status == 'sleep' || !parsing.alive?
+        parsing.raise(Interrupt)
+        assert_raises(Interrupt) { parsing.join }
+        writer.kill.join
+      end
+    end
+
+    def test_interrupt_opening_fifo
+      Dir.mktmpdir do |dir|
+        fifo = File.join(dir, 'dump.fifo')
+        File.mkfifo(fifo)
+
+        # Without a writer, opening the FIFO blocks until interrupted.
+        parsing = Thread.new { @native.aggregate(fifo, tables: [:files], max: 10) }
+        parsing.report_on_exception = false
+        sleep 0.1 until parsing.status == 'sleep' || !parsing.alive?
+        parsing.raise(Interrupt)
+        assert_raises(Interrupt) { parsing.join }
+
+        # Interrupts that don't raise only retry the open.
+        parsing = Thread.new { @native.aggregate(fifo, tables: [:files], max: 10) }
+        sleep 0.1 until parsing.status == 'sleep' || !parsing.alive?
+        parsing.wakeup
+        File.open(fifo, 'w') { |io| io.puts('{"address":"0x1", "type":"OBJECT", "file":"a.rb", "memsize":40}') }
+        assert_equal [["a.rb", 1, 40]], parsing.value[:files]
       end
-    ensure
-      Parser.batch_size = previous_batch_size
     end
 
     private
@@ -67,6 +727,19 @@ module HeapProfiler
       assert_equal address.to_i(16), @native.parse_address(address)
     end
 
+    def with_fifo(source_path)
+      Dir.mktmpdir do |dir|
+        fifo = File.join(dir, 'dump.fifo')
+        File.mkfifo(fifo)
+        writer = Thread.new do
+          File.open(fifo, 'w') { |io| IO.copy_stream(source_path, io) }
+        rescue Errno::EPIPE
+        end
+        yield fifo
+        writer.join
+      end
+    end
+
     def fixtures_path(subpath)
       File.expand_path(File.join('../fixtures', subpath), __FILE__)
     end
@@ -368,6 +368,20 @@ module HeapProfiler
       EOS
     end
 
+    def test_sampled_heap_results
+      results = HeapResults.new(fixtures_path('diffed-heap/retained.heap'))
+      exact = StringIO.new
+      results.pretty_print(exact, scale_bytes: true, normalize_paths: true)
+      sampled = StringIO.new
+      results.pretty_print(sampled, scale_bytes: true, normalize_paths: true, sample: 1.0)
+
+      assert_equal <<~EOS, sampled.string.lines.first(2).join
+        Total: 54.30 kB ± 0 B (516 ± 0 objects)
+        Estimated from a 100% sample of the dump, totals with 95% confidence intervals
+      EOS
+      assert_equal exact.string.lines.drop(1), sampled.string.lines.drop(2)
+    end
+
     private
 
     def fixtures_path(subpath)